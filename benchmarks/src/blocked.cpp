@@ -0,0 +1,113 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "simulate.h"
+#include "counters.h"
+
+#include "singler_classic_markers/blocked.hpp"
+#include "singler_classic_markers/profiles.hpp"
+
+#include "tatami/tatami.hpp"
+
+// Arguments are: number of genes, number of samples, number of labels, number of blocks, density (as a percentage), sparse, row-major, use_minimum, keep_ties, number of threads.
+static void blocked_arguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({ "genes", "samples", "labels", "blocks", "density", "sparse", "row", "minimum", "ties", "threads" });
+#ifdef SINGLER_CLASSIC_MARKERS_FULL_BENCHMARKS
+    b->ArgsProduct({
+        { 1000, 10000 },
+        { 1000 },
+        { 5, 20 },
+        { 2, 10 },
+        { 10, 100 },
+        { 0, 1 },
+        { 0, 1 },
+        { 0, 1 },
+        { 0, 1 },
+        { 1, 4 }
+    });
+#else
+    // Small default grid that covers each matrix representation; the full sweep is enabled with SINGLER_CLASSIC_MARKERS_FULL_BENCHMARKS.
+    b->ArgsProduct({
+        { 10000 },
+        { 1000 },
+        { 20 },
+        { 5 },
+        { 10 },
+        { 0, 1 },
+        { 0, 1 },
+        { 0 },
+        { 0 },
+        { 1 }
+    });
+#endif
+    b->Unit(benchmark::kMillisecond);
+    b->UseRealTime(); // as the work is done in the worker threads.
+}
+
+struct BlockedSetup {
+    BlockedSetup(const benchmark::State& state) :
+        matrix(cached_matrix(state.range(0), state.range(1), state.range(4) / 100.0, state.range(5), state.range(6))),
+        labels(simulate_groups(matrix.ncol(), state.range(2), /* seed = */ 42)),
+        blocks(simulate_groups(matrix.ncol(), state.range(3), /* seed = */ 69))
+    {
+        options.use_minimum = state.range(7);
+        options.keep_ties = state.range(8);
+        options.num_threads = state.range(9);
+    }
+
+    const tatami::Matrix<double, int>& matrix;
+    std::vector<int> labels, blocks;
+    singler_classic_markers::ChooseBlockedOptions options;
+};
+
+static void BM_ChooseBlocked(benchmark::State& state) {
+    BlockedSetup setup(state);
+    singler_classic_markers::ChooseStatistics stats;
+    setup.options.statistics = &stats;
+    PhaseCounters counters;
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose_blocked(setup.matrix, setup.labels.data(), setup.blocks.data(), setup.options);
+        benchmark::DoNotOptimize(output);
+        counters.add(stats);
+    }
+    set_genes_per_second(state);
+    counters.report(state);
+}
+BENCHMARK(BM_ChooseBlocked)->Apply(blocked_arguments);
+
+static void BM_ChooseBlockedIndex(benchmark::State& state) {
+    BlockedSetup setup(state);
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose_blocked_index(setup.matrix, setup.labels.data(), setup.blocks.data(), setup.options);
+        benchmark::DoNotOptimize(output);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseBlockedIndex)->Apply(blocked_arguments);
+
+// Splitting choose_blocked() into the computation of the medians and the combination of per-block differences in the queues.
+static void BM_ChooseBlockedMedians(benchmark::State& state) {
+    BlockedSetup setup(state);
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    popt.num_threads = setup.options.num_threads;
+    for (auto _ : state) {
+        auto profiles = singler_classic_markers::compute_blocked_median_profiles(setup.matrix, setup.labels.data(), setup.blocks.data(), popt);
+        benchmark::DoNotOptimize(profiles);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseBlockedMedians)->Apply(blocked_arguments);
+
+static void BM_ChooseBlockedQueues(benchmark::State& state) {
+    BlockedSetup setup(state);
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    popt.num_threads = setup.options.num_threads;
+    const auto profiles = singler_classic_markers::compute_blocked_median_profiles(setup.matrix, setup.labels.data(), setup.blocks.data(), popt);
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose_blocked_from_profiles(profiles, setup.options);
+        benchmark::DoNotOptimize(output);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseBlockedQueues)->Apply(blocked_arguments);
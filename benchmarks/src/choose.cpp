@@ -0,0 +1,146 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "simulate.h"
+#include "counters.h"
+
+#include "singler_classic_markers/choose.hpp"
+#include "singler_classic_markers/profiles.hpp"
+
+#include "tatami/tatami.hpp"
+
+// Arguments are: number of genes, number of samples, number of labels, density (as a percentage), sparse, row-major, keep_ties, number of threads.
+static void choose_arguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({ "genes", "samples", "labels", "density", "sparse", "row", "ties", "threads" });
+#ifdef SINGLER_CLASSIC_MARKERS_FULL_BENCHMARKS
+    b->ArgsProduct({
+        { 1000, 10000 },
+        { 100, 1000 },
+        { 5, 20 },
+        { 10, 100 },
+        { 0, 1 },
+        { 0, 1 },
+        { 0, 1 },
+        { 1, 4 }
+    });
+#else
+    // Small default grid that covers each matrix representation; the full sweep is enabled with SINGLER_CLASSIC_MARKERS_FULL_BENCHMARKS.
+    b->ArgsProduct({
+        { 10000 },
+        { 1000 },
+        { 20 },
+        { 10 },
+        { 0, 1 },
+        { 0, 1 },
+        { 0 },
+        { 1 }
+    });
+#endif
+    b->Unit(benchmark::kMillisecond);
+    b->UseRealTime(); // as the work is done in the worker threads.
+}
+
+static const tatami::Matrix<double, int>& choose_matrix(const benchmark::State& state) {
+    return cached_matrix(state.range(0), state.range(1), state.range(3) / 100.0, state.range(4), state.range(5));
+}
+
+static singler_classic_markers::ChooseOptions choose_options(const benchmark::State& state) {
+    singler_classic_markers::ChooseOptions opt;
+    opt.keep_ties = state.range(6);
+    opt.num_threads = state.range(7);
+    return opt;
+}
+
+static void BM_Choose(benchmark::State& state) {
+    const auto& mat = choose_matrix(state);
+    auto labels = simulate_groups(mat.ncol(), state.range(2), /* seed = */ 42);
+    auto opt = choose_options(state);
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    PhaseCounters counters;
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose(mat, labels.data(), opt);
+        benchmark::DoNotOptimize(output);
+        counters.add(stats);
+    }
+    set_genes_per_second(state);
+    counters.report(state);
+}
+BENCHMARK(BM_Choose)->Apply(choose_arguments);
+
+static void BM_ChooseIndex(benchmark::State& state) {
+    const auto& mat = choose_matrix(state);
+    auto labels = simulate_groups(mat.ncol(), state.range(2), /* seed = */ 42);
+    auto opt = choose_options(state);
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose_index(mat, labels.data(), opt);
+        benchmark::DoNotOptimize(output);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseIndex)->Apply(choose_arguments);
+
+/*
+ * The remaining benchmarks split choose() into its phases, i.e., extraction, computing the medians and updating the queues.
+ * The time spent computing medians is the difference between BM_ChooseMedians and BM_ChooseExtract.
+ */
+
+static void BM_ChooseExtract(benchmark::State& state) {
+    const auto& mat = choose_matrix(state);
+    const int nthreads = state.range(7);
+    const bool row = mat.prefer_rows();
+    const int primary = (row ? mat.nrow() : mat.ncol());
+    const int secondary = (row ? mat.ncol() : mat.nrow());
+
+    for (auto _ : state) {
+        tatami::parallelize([&](int, int start, int length) -> void {
+            std::vector<double> vbuffer(secondary);
+            if (mat.is_sparse()) {
+                std::vector<int> ibuffer(secondary);
+                auto ext = tatami::consecutive_extractor<true>(mat, row, start, length);
+                for (int i = 0; i < length; ++i) {
+                    auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                    benchmark::DoNotOptimize(range);
+                }
+            } else {
+                auto ext = tatami::consecutive_extractor<false>(mat, row, start, length);
+                for (int i = 0; i < length; ++i) {
+                    auto ptr = ext->fetch(vbuffer.data());
+                    benchmark::DoNotOptimize(ptr);
+                }
+            }
+        }, primary, nthreads);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseExtract)->Apply(choose_arguments);
+
+static void BM_ChooseMedians(benchmark::State& state) {
+    const auto& mat = choose_matrix(state);
+    auto labels = simulate_groups(mat.ncol(), state.range(2), /* seed = */ 42);
+    singler_classic_markers::ComputeMedianProfilesOptions opt;
+    opt.num_threads = state.range(7);
+    for (auto _ : state) {
+        auto profiles = singler_classic_markers::compute_median_profiles(mat, labels.data(), opt);
+        benchmark::DoNotOptimize(profiles);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseMedians)->Apply(choose_arguments);
+
+static void BM_ChooseQueues(benchmark::State& state) {
+    const auto& mat = choose_matrix(state);
+    auto labels = simulate_groups(mat.ncol(), state.range(2), /* seed = */ 42);
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    popt.num_threads = state.range(7);
+    const auto profiles = singler_classic_markers::compute_median_profiles(mat, labels.data(), popt);
+
+    auto opt = choose_options(state);
+    for (auto _ : state) {
+        auto output = singler_classic_markers::choose_from_profiles(profiles, opt);
+        benchmark::DoNotOptimize(output);
+    }
+    set_genes_per_second(state);
+}
+BENCHMARK(BM_ChooseQueues)->Apply(choose_arguments);
@@ -0,0 +1,37 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <benchmark/benchmark.h>
+
+#include "singler_classic_markers/statistics.hpp"
+
+// Genes are always in the rows, so this is the same regardless of the dimension that is iterated over during extraction.
+inline void set_genes_per_second(benchmark::State& state) {
+    state.counters["genes_per_second"] = benchmark::Counter(static_cast<double>(state.range(0)), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Accumulating the time spent in each phase across iterations, where the per-thread times are summed.
+struct PhaseCounters {
+    double extraction_time = 0;
+    double median_time = 0;
+    double queue_time = 0;
+    double merge_time = 0;
+
+    void add(const singler_classic_markers::ChooseStatistics& statistics) {
+        for (const auto& t : statistics.threads) {
+            extraction_time += t.extraction_time;
+            median_time += t.median_time;
+            queue_time += t.queue_time;
+        }
+        merge_time += statistics.merge_time;
+    }
+
+    void report(benchmark::State& state) const {
+        state.counters["extraction_time"] = benchmark::Counter(extraction_time, benchmark::Counter::kAvgIterations);
+        state.counters["median_time"] = benchmark::Counter(median_time, benchmark::Counter::kAvgIterations);
+        state.counters["queue_time"] = benchmark::Counter(queue_time, benchmark::Counter::kAvgIterations);
+        state.counters["merge_time"] = benchmark::Counter(merge_time, benchmark::Counter::kAvgIterations);
+    }
+};
+
+#endif
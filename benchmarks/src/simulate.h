@@ -0,0 +1,58 @@
+#ifndef SIMULATE_H
+#define SIMULATE_H
+
+#include <vector>
+#include <random>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+
+#include "tatami/tatami.hpp"
+
+// If 'row = true', the matrix is row-major (dense) or compressed sparse row (sparse); otherwise it is column-major or compressed sparse column.
+inline std::shared_ptr<tatami::Matrix<double, int> > simulate_matrix(int nr, int nc, double density, bool sparse, bool row, int seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<> dist;
+    std::uniform_real_distribution<> udist;
+
+    std::vector<double> contents(static_cast<std::size_t>(nr) * static_cast<std::size_t>(nc));
+    for (auto& c : contents) {
+        c = (udist(rng) <= density ? dist(rng) : 0.0);
+    }
+
+    std::shared_ptr<tatami::Matrix<double, int> > mat;
+    if (row) {
+        mat.reset(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(contents)));
+    } else {
+        mat.reset(new tatami::DenseColumnMatrix<double, int>(nr, nc, std::move(contents)));
+    }
+    if (sparse) {
+        return tatami::convert_to_compressed_sparse<double, int>(*mat, row, {});
+    } else {
+        return mat;
+    }
+}
+
+inline std::vector<int> simulate_groups(int nc, int ngroups, int seed) {
+    std::vector<int> groups(nc);
+    std::mt19937_64 rng(seed);
+    for (int i = 0; i < nc; ++i) {
+        groups[i] = (i < ngroups ? i : static_cast<int>(rng() % ngroups)); // at least one entry per group.
+    }
+    std::shuffle(groups.begin(), groups.end(), rng);
+    return groups;
+}
+
+// Only regenerating the matrix when the parameters change, as the simulation is much slower than the benchmarked functions.
+inline const tatami::Matrix<double, int>& cached_matrix(int nr, int nc, double density, bool sparse, bool row) {
+    static std::shared_ptr<tatami::Matrix<double, int> > cache;
+    static std::vector<double> params;
+    std::vector<double> current { static_cast<double>(nr), static_cast<double>(nc), density, static_cast<double>(sparse), static_cast<double>(row) };
+    if (!cache || params != current) {
+        cache = simulate_matrix(nr, nc, density, sparse, row, /* seed = */ nr * 13 + nc * 17 + static_cast<int>(density * 100) + sparse);
+        params.swap(current);
+    }
+    return *cache;
+}
+
+#endif
@@ -0,0 +1,337 @@
+#ifndef SINGLER_CLASSIC_MARKERS_ADD_LABEL_HPP
+#define SINGLER_CLASSIC_MARKERS_ADD_LABEL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "queue.hpp"
+#include "scan.hpp"
+#include "statistics.hpp"
+#include "number.hpp"
+#include "choose.hpp"
+#include "blocked.hpp"
+#include "profiles.hpp"
+
+/**
+ * @file add_label.hpp
+ * @brief Add a new label to existing markers.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @cond
+ */
+template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Profile_, typename Block_>
+Markers<include_stat_, Index_, Stat_> add_label_raw(
+    const Markers<include_stat_, Index_, Stat_>& existing,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Block_* block, // set to NULL for unblocked analyses.
+    const std::optional<std::size_t>& number,
+    const bool keep_ties,
+    const std::optional<bool>& use_minimum, // only set for blocked analyses.
+    const ScanOptions& scan_options,
+    ChooseStatistics* statistics
+) {
+    const auto num_threads = scan_options.num_threads;
+    const auto NR = profiles.num_rows;
+    if (matrix.nrow() != NR) {
+        throw std::runtime_error("number of rows in 'matrix' should be the same as that in 'profiles'");
+    }
+
+    const auto nold = profiles.num_labels;
+    if (existing.size() != nold) {
+        throw std::runtime_error("number of labels in 'existing' should be the same as that in 'profiles'");
+    }
+
+    const auto nblocks = profiles.num_blocks;
+    const auto old_ncombos = sanisizer::product<std::size_t>(nold, nblocks);
+    if (profiles.medians.size() != sanisizer::product<std::size_t>(NR, old_ncombos)) {
+        throw std::runtime_error("inconsistent dimensions for the median profiles");
+    }
+    if (!profiles.combo_sizes.empty() && profiles.combo_sizes.size() != old_ncombos) {
+        throw std::runtime_error("inconsistent dimensions for the combination sizes of the median profiles");
+    }
+
+    // Computing the medians for the new label in each block.
+    const auto NC = matrix.ncol();
+    auto new_combos = sanisizer::create<std::vector<std::size_t> >(NC);
+    if (block) {
+        for (I<decltype(NC)> c = 0; c < NC; ++c) {
+            new_combos[c] = block[c];
+            if (new_combos[c] >= nblocks) {
+                throw std::runtime_error("block assignments for the new label should be less than the number of blocks in 'profiles'");
+            }
+        }
+    }
+    auto new_combo_sizes = tatami_stats::tabulate_groups(new_combos.data(), NC);
+    new_combo_sizes.resize(nblocks);
+
+    // Blocks shared by the new label and each old label, so that the per-block differences are summed in the same order as in choose_blocked().
+    auto shared = sanisizer::create<std::vector<std::vector<std::size_t> > >(nold);
+    if (use_minimum.has_value()) {
+        const auto old_combo_sizes = get_profile_combo_sizes(profiles, old_ncombos); // this checks the size of 'profiles.combo_sizes', if it is not empty.
+        for (I<decltype(nold)> g = 0; g < nold; ++g) {
+            const auto old_sizes = old_combo_sizes.data() + g * nblocks; // product is safe as it was checked above.
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                if (new_combo_sizes[b] && old_sizes[b]) {
+                    shared[g].push_back(b);
+                }
+            }
+        }
+    }
+
+    initialize_statistics(statistics, num_threads);
+    auto new_medians = sanisizer::create<std::vector<Profile_> >(sanisizer::product<std::size_t>(NR, nblocks));
+    const auto num_scanned = scan_matrix<Profile_>(
+        matrix,
+        nblocks,
+        new_combos.data(),
+        new_combo_sizes,
+        /* setup = */ [&]() -> bool { return false; },
+        /* fun = */ [&](const Index_ r, const std::vector<Profile_>& medians, bool&) -> void {
+            std::copy(medians.begin(), medians.end(), new_medians.begin() + static_cast<std::size_t>(r) * nblocks); // product is safe as it was checked above.
+        },
+        /* finalize = */ [&](const int, bool&) -> void {},
+        scan_options
+    );
+
+    // Only computing the comparisons involving the new label.
+    // The first 'nold' buffers contain the comparisons of the new label over each old label,
+    // while the next 'nold' buffers contain the comparisons of each old label over the new label.
+    const auto nnew = nold + 1;
+    const auto num_keep = get_num_keep<Index_>(nnew, number);
+    const auto nbuffers = sanisizer::product<std::size_t>(nold, 2);
+    auto pbuffers = sanisizer::create<std::vector<std::optional<TopBufferSet<Stat_, Index_> > > >(num_threads);
+
+    const auto num_used = tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+        TopBufferSet<Stat_, Index_> curbuffers(num_keep, nbuffers, keep_ties);
+        if (statistics) {
+            curbuffers.enable_counting();
+        }
+        PhaseTimer queue_timer(statistics != NULL);
+        queue_timer.start();
+        auto left = sanisizer::create<std::vector<Stat_> >(nblocks);
+        auto right = sanisizer::create<std::vector<Stat_> >(nblocks);
+
+        for (Index_ r = start, end = start + length; r < end; ++r) {
+            const auto new_ptr = new_medians.data() + static_cast<std::size_t>(r) * nblocks; // product is safe as it was checked above.
+            std::copy_n(new_ptr, nblocks, left.begin());
+            const auto old_ptr = profiles.medians.data() + static_cast<std::size_t>(r) * old_ncombos; // product is safe as it was checked above.
+
+            auto candidates = curbuffers.candidates();
+            for (I<decltype(nold)> g = 0; g < nold; ++g) {
+                std::copy_n(old_ptr + g * nblocks, nblocks, right.begin());
+                auto& xout = candidates[g];
+                auto& yout = candidates[nold + g];
+
+                if (!use_minimum.has_value()) {
+                    const Stat_ delta = left.front() - right.front();
+                    xout = delta;
+                    yout = -delta;
+                    continue;
+                }
+
+                BlockDifferenceSummary<Stat_> summary;
+                const auto& curshared = shared[g];
+                if (!curshared.empty()) {
+                    if (*use_minimum) {
+                        summarize_block_differences<false, true>(left.data(), right.data(), curshared.data(), curshared.size(), summary);
+                    } else {
+                        summarize_block_differences<true, false>(left.data(), right.data(), curshared.data(), curshared.size(), summary);
+                    }
+                }
+                set_block_difference_candidates(summary, *use_minimum, xout, yout);
+            }
+
+            curbuffers.add_candidates(r);
+        }
+
+        if (statistics) {
+            auto& curstatistics = statistics->threads[t];
+            queue_timer.stop(curstatistics.queue_time);
+            curbuffers.transfer_counts(curstatistics);
+        }
+        pbuffers[t] = std::move(curbuffers);
+    }, NR, num_threads);
+    pbuffers.resize(num_used);
+    finalize_statistics(statistics, std::max(num_scanned, num_used));
+
+    // Copying the existing comparisons and adding the new ones.
+    Markers<include_stat_, Index_, Stat_> output;
+    PhaseTimer merge_timer(statistics != NULL);
+    merge_timer.start();
+    output.reserve(nnew);
+    for (const auto& x : existing) {
+        output.push_back(x);
+        output.back().emplace_back();
+        if (num_used) {
+            const auto g = output.size() - 1;
+            copy_top_entries<include_stat_>(merge_top_buffers(pbuffers, nold + g), output.back().back());
+        }
+    }
+
+    output.emplace_back(nnew);
+    if (num_used) {
+        auto& last = output.back();
+        for (I<decltype(nold)> g = 0; g < nold; ++g) {
+            copy_top_entries<include_stat_>(merge_top_buffers(pbuffers, g), last[g]);
+        }
+    }
+    if (statistics) {
+        merge_timer.stop(statistics->merge_time);
+    }
+
+    // Updating the profiles in place so that more labels can be added later.
+    const auto new_ncombos = sanisizer::product<std::size_t>(nnew, nblocks);
+    auto updated = sanisizer::create<std::vector<Profile_> >(sanisizer::product<std::size_t>(NR, new_ncombos));
+    for (I<decltype(NR)> r = 0; r < NR; ++r) {
+        const auto old_ptr = profiles.medians.data() + static_cast<std::size_t>(r) * old_ncombos;
+        const auto out_ptr = updated.data() + static_cast<std::size_t>(r) * new_ncombos;
+        std::copy_n(old_ptr, old_ncombos, out_ptr);
+        std::copy_n(new_medians.data() + static_cast<std::size_t>(r) * nblocks, nblocks, out_ptr + old_ncombos);
+    }
+    profiles.medians.swap(updated);
+    if (!profiles.combo_sizes.empty()) { // otherwise, we continue to infer the combination sizes from the medians.
+        profiles.combo_sizes.insert(profiles.combo_sizes.end(), new_combo_sizes.begin(), new_combo_sizes.end());
+    }
+    profiles.num_labels = nnew;
+
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Add a new label to the markers from `choose()`, without recomputing the comparisons between the existing labels.
+ * Only the new label's columns are scanned, and only the comparisons involving the new label are performed.
+ * This is useful for extending a reference with one more label at a time.
+ *
+ * The new label is assigned the index \f$L\f$ for \f$L\f$ existing labels.
+ * The new comparisons are identical to those from `choose()` on the combined reference, given the same number of markers.
+ * Note that the default number of markers depends on the number of labels (see `default_number()`),
+ * so `ChooseOptions::number` should be explicitly set if the existing and new comparisons should use the same number of markers.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Profile_ Floating-point type of the medians.
+ *
+ * @param existing Existing markers for \f$L\f$ labels, typically from `choose()` or a previous call to `add_label()`.
+ * @param[in,out] profiles Median profiles for the \f$L\f$ existing labels, typically from `compute_median_profiles()`.
+ * On output, this is updated with the medians for the new label so that further labels can be added.
+ * @param matrix Matrix containing the reference samples for the new label.
+ * This should have the same rows as the matrix used to compute `profiles`.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between the \f$L + 1\f$ labels, see `choose()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Profile_>
+std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > add_label(
+    const std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > >& existing,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const ChooseOptions& options
+) {
+    check_unblocked_profiles(profiles);
+    return add_label_raw<true, Stat_>(existing, profiles, matrix, static_cast<int*>(NULL), options.number, options.keep_ties, {}, create_scan_options(options), options.statistics);
+}
+
+/**
+ * Variant of `add_label()` for the markers from `choose_index()`, where only the indices of the top markers are reported.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Profile_ Floating-point type of the medians.
+ *
+ * @param existing Existing markers for \f$L\f$ labels, typically from `choose_index()` or a previous call to `add_label_index()`.
+ * @param[in,out] profiles Median profiles for the \f$L\f$ existing labels, see `add_label()`.
+ * @param matrix Matrix containing the reference samples for the new label.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between the \f$L + 1\f$ labels, see `choose_index()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Profile_>
+std::vector<std::vector<std::vector<Index_> > > add_label_index(
+    const std::vector<std::vector<std::vector<Index_> > >& existing,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const ChooseOptions& options
+) {
+    check_unblocked_profiles(profiles);
+    return add_label_raw<false, Stat_>(existing, profiles, matrix, static_cast<int*>(NULL), options.number, options.keep_ties, {}, create_scan_options(options), options.statistics);
+}
+
+/**
+ * Add a new label to the markers from `choose_blocked()`, without recomputing the comparisons between the existing labels.
+ * This is the same as `add_label()` except that the new label's samples are assigned to the existing blocks.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param existing Existing markers for \f$L\f$ labels, typically from `choose_blocked()` or a previous call to `add_label_blocked()`.
+ * @param[in,out] profiles Median profiles for each combination of the \f$L\f$ existing labels and \f$B\f$ blocks, typically from `compute_blocked_median_profiles()`.
+ * On output, this is updated with the medians for the new label.
+ * @param matrix Matrix containing the reference samples for the new label.
+ * This should have the same rows as the matrix used to compute `profiles`.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column, and should lie in \f$[0, B)\f$.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between the \f$L + 1\f$ labels, see `choose_blocked()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Profile_, typename Block_>
+std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > add_label_blocked(
+    const std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > >& existing,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return add_label_raw<true, Stat_>(existing, profiles, matrix, block, options.number, options.keep_ties, options.use_minimum, create_scan_options(options), options.statistics);
+}
+
+/**
+ * Variant of `add_label_blocked()` for the markers from `choose_blocked_index()`, where only the indices of the top markers are reported.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param existing Existing markers for \f$L\f$ labels, typically from `choose_blocked_index()` or a previous call to `add_label_blocked_index()`.
+ * @param[in,out] profiles Median profiles for each combination of label and block, see `add_label_blocked()`.
+ * @param matrix Matrix containing the reference samples for the new label.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`, see `add_label_blocked()`.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between the \f$L + 1\f$ labels, see `choose_blocked_index()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Profile_, typename Block_>
+std::vector<std::vector<std::vector<Index_> > > add_label_blocked_index(
+    const std::vector<std::vector<std::vector<Index_> > >& existing,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return add_label_raw<false, Stat_>(existing, profiles, matrix, block, options.number, options.keep_ties, options.use_minimum, create_scan_options(options), options.statistics);
+}
+
+}
+
+#endif
@@ -4,8 +4,13 @@
 #include <cstddef>
 #include <optional>
 #include <vector>
+#include <functional>
+#include <atomic>
 #include <limits>
 #include <cmath>
+#include <array>
+#include <algorithm>
+#include <utility>
 
 #include "sanisizer/sanisizer.hpp"
 #include "tatami/tatami.hpp"
@@ -13,6 +18,8 @@
 
 #include "queue.hpp"
 #include "scan.hpp"
+#include "statistics.hpp"
+#include "progress.hpp"
 #include "number.hpp"
 
 namespace singler_classic_markers {
@@ -46,17 +53,368 @@ struct ChooseBlockedOptions {
      * The parallelization scheme is determined by `tatami::parallelize()`.
      */
     int num_threads = 1;
+
+    /**
+     * Whether to dynamically assign rows to threads.
+     * If `true`, each thread repeatedly takes the next chunk of `dynamic_chunk_size` rows until all rows are processed.
+     * This balances the work across threads when the cost of each row is highly variable, e.g., in sparse matrices where highly expressed genes are clustered together.
+     * If `false`, each thread processes a contiguous range of rows of (roughly) equal size, as determined by `tatami::parallelize()`.
+     * The results are the same regardless of the scheduling.
+     */
+    bool dynamic_scheduling = false;
+
+    /**
+     * Number of rows in each chunk when `dynamic_scheduling = true`.
+     * Smaller chunks improve load balancing at the cost of more overhead from creating new extractors for each chunk.
+     */
+    std::size_t dynamic_chunk_size = 1000;
+
+    /**
+     * Whether to extract rows in a separate thread for each worker, so that the extraction of the next batch of rows overlaps with the computation of medians for the current batch.
+     * This is most useful for matrices where extraction is slow, e.g., file-backed matrices.
+     * Only used for matrices that prefer row access, see `column_slab_size` for the alternative.
+     * Ignored if `approximate = true`.
+     */
+    bool pipeline = false;
+
+    /**
+     * Number of rows in each batch when `pipeline = true`.
+     */
+    std::size_t pipeline_batch_size = 100;
+
+    /**
+     * Maximum number of batches that can be extracted ahead of the computation when `pipeline = true`.
+     * Larger values can smooth over variable extraction times at the cost of more memory.
+     */
+    std::size_t pipeline_depth = 2;
+
+    /**
+     * Number of rows to process at once when the matrix prefers column access, see `tatami::Matrix::prefer_rows()`.
+     * For such matrices, each thread extracts a slab of rows from all columns and computes the medians for all rows in the slab, which avoids the cost of row access.
+     * Larger slabs require fewer passes over the columns at the cost of more memory.
+     * If not set, the slab size is chosen so that each thread holds approximately 1 million matrix values.
+     */
+    std::optional<std::size_t> column_slab_size;
+
+    /**
+     * Whether to approximate the median of each group with a quantile sketch.
+     * This bounds the memory usage of each thread regardless of the number of columns in the matrix, which is useful for very large references.
+     * For a group of \f$n\f$ samples and a sketch size of \f$k\f$, the rank of the reported median differs from that of the exact median by no more than \f$(n/k)(1 + \log_2(n/k))\f$.
+     * Medians are exact for groups with no more than \f$k\f$ samples.
+     */
+    bool approximate = false;
+
+    /**
+     * Size of the quantile sketch when `approximate = true`.
+     * Larger values improve the accuracy of the approximation at the cost of more memory and time.
+     */
+    std::size_t approximate_sketch_size = 1024;
+
+    /**
+     * Pointer to a `ChooseStatistics` object in which to store instrumentation statistics, e.g., the time spent in each phase.
+     * If NULL, no statistics are collected.
+     */
+    ChooseStatistics* statistics = NULL;
+
+    /**
+     * Function to report the progress of the scan over the rows of the matrix.
+     * This is called with the number of rows processed so far and the total number of rows.
+     * It may be called from any worker thread but never concurrently, and should return quickly as the calling worker is blocked in the meantime.
+     * Reports are throttled to once every `check_interval` rows per thread, and some reports may be skipped if another thread is already reporting.
+     * If empty, progress is not reported.
+     */
+    std::function<void(std::size_t, std::size_t)> progress;
+
+    /**
+     * Pointer to a flag that can be set by another thread to cancel the marker detection.
+     * Each thread checks this flag every `check_interval` rows, and a `CancelledError` is thrown once it is set.
+     * If NULL, the marker detection cannot be cancelled.
+     */
+    const std::atomic<bool>* cancel = NULL;
+
+    /**
+     * Number of rows processed by each thread between progress reports and checks of the `cancel` flag.
+     * Smaller values improve responsiveness at the cost of more overhead.
+     */
+    std::size_t check_interval = 1000;
+};
+
+/**
+ * @brief Results of `choose_blocked_both()`.
+ * @tparam Markers_ Type of the markers for a single statistic, e.g., the return value of `choose_blocked()` or `choose_blocked_index()`.
+ */
+template<typename Markers_>
+struct ChooseBlockedBothResults {
+    /**
+     * Top markers for each pairwise comparison, using the mean of the per-block differences.
+     * This is the same as the output of `choose_blocked()` with `ChooseBlockedOptions::use_minimum = false`.
+     */
+    Markers_ mean;
+
+    /**
+     * Top markers for each pairwise comparison, using the minimum of the per-block differences.
+     * This is the same as the output of `choose_blocked()` with `ChooseBlockedOptions::use_minimum = true`.
+     */
+    Markers_ minimum;
 };
 
 /**
  * @cond
  */
-template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Label_, typename Block_>
-Markers<include_stat_, Index_, Stat_> choose_blocked_raw(
+template<typename Stat_>
+struct BlockDifferenceSummary {
+    Stat_ sum = 0;
+    Stat_ count = 0;
+    Stat_ min = std::numeric_limits<Stat_>::infinity();
+    Stat_ max = -std::numeric_limits<Stat_>::infinity();
+};
+
+// Summarizing the per-block differences between the medians of two labels, ignoring blocks where either median is NaN.
+// 'delta(i)' should return the difference for the 'i'-th of 'n' blocks to be considered.
+// We accumulate in a fixed number of independent lanes so that the compiler can vectorize the reductions,
+// given that it won't reassociate the floating-point additions by itself.
+template<bool mean_, bool minimum_, typename Stat_, class Delta_>
+void summarize_block_differences_raw(const std::size_t n, Delta_ delta, BlockDifferenceSummary<Stat_>& summary) {
+    constexpr std::size_t nlanes = 4;
+    constexpr Stat_ inf = std::numeric_limits<Stat_>::infinity();
+    std::array<Stat_, nlanes> lsum, lcount, lmin, lmax;
+    lsum.fill(0);
+    lcount.fill(0);
+    lmin.fill(inf);
+    lmax.fill(-inf);
+
+    const auto add = [&](const std::size_t lane, const Stat_ d) -> void {
+        const bool valid = (d == d); // i.e., not NaN.
+        lcount[lane] += valid;
+        if constexpr(mean_) {
+            lsum[lane] += (valid ? d : 0);
+        }
+        if constexpr(minimum_) {
+            lmin[lane] = std::min(lmin[lane], (valid ? d : inf));
+            lmax[lane] = std::max(lmax[lane], (valid ? d : -inf));
+        }
+    };
+
+    const std::size_t nfull = n - n % nlanes;
+    for (std::size_t b = 0; b < nfull; b += nlanes) {
+        for (std::size_t l = 0; l < nlanes; ++l) {
+            add(l, delta(b + l));
+        }
+    }
+    for (std::size_t b = nfull; b < n; ++b) {
+        add(b - nfull, delta(b));
+    }
+
+    for (std::size_t l = 0; l < nlanes; ++l) {
+        summary.count += lcount[l];
+        if constexpr(mean_) {
+            summary.sum += lsum[l];
+        }
+        if constexpr(minimum_) {
+            summary.min = std::min(summary.min, lmin[l]);
+            summary.max = std::max(summary.max, lmax[l]);
+        }
+    }
+}
+
+// Summarizing the differences between the contiguous medians of two labels across all blocks.
+template<bool mean_, bool minimum_, typename Stat_>
+void summarize_block_differences(const Stat_* left, const Stat_* right, const std::size_t nblocks, BlockDifferenceSummary<Stat_>& summary) {
+    summarize_block_differences_raw<mean_, minimum_>(nblocks, [&](const std::size_t b) -> Stat_ { return left[b] - right[b]; }, summary);
+}
+
+// Summarizing the differences between the contiguous medians of two labels across a subset of 'nshared' blocks.
+template<bool mean_, bool minimum_, typename Stat_>
+void summarize_block_differences(const Stat_* left, const Stat_* right, const std::size_t* shared, const std::size_t nshared, BlockDifferenceSummary<Stat_>& summary) {
+    summarize_block_differences_raw<mean_, minimum_>(nshared, [&](const std::size_t i) -> Stat_ { const auto b = shared[i]; return left[b] - right[b]; }, summary);
+}
+
+template<typename Stat_>
+void set_block_difference_candidates(const BlockDifferenceSummary<Stat_>& summary, const bool use_minimum, Stat_& xout, Stat_& yout) {
+    if (summary.count) {
+        if (use_minimum) {
+            xout = summary.min;
+            yout = -summary.max;
+        } else {
+            const auto val = summary.sum / summary.count;
+            xout = val;
+            yout = -val;
+        }
+    } else {
+        xout = std::numeric_limits<Stat_>::quiet_NaN();
+        yout = std::numeric_limits<Stat_>::quiet_NaN();
+    }
+}
+
+template<typename Stat_, typename Index_>
+void add_blocked_differences(
+    const Index_ r,
+    const Stat_* medians,
+    const std::size_t ngroups,
+    const std::size_t nblocks,
+    const bool use_minimum,
+    PairwiseTopQueues<Stat_, Index_>& curqueues
+) {
+    auto candidates = curqueues.candidates();
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        candidates[g1 * ngroups + g1] = 0; // product is safe as it was checked when constructing the queues.
+    }
+
+    for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
+        const auto left = medians + g1 * nblocks; // product is safe as the number of combinations was already checked by the caller.
+        for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2) {
+            const auto right = medians + g2 * nblocks;
+            auto& xout = candidates[g1 * ngroups + g2];
+            auto& yout = candidates[g2 * ngroups + g1];
+
+            BlockDifferenceSummary<Stat_> summary;
+            if (use_minimum) {
+                summarize_block_differences<false, true>(left, right, nblocks, summary);
+            } else {
+                summarize_block_differences<true, false>(left, right, nblocks, summary);
+            }
+            set_block_difference_candidates(summary, use_minimum, xout, yout);
+        }
+    }
+
+    curqueues.add_candidates(r);
+}
+
+// Blocks that contain columns from both labels in each pair, stored in compressed form for all pairs (g1, g2) where g2 < g1.
+// The blocks for the 'p'-th pair are stored in 'blocks[offsets[p]]' to 'blocks[offsets[p + 1]]', where pairs are ordered by g1 and then g2.
+// In references where most labels are only present in a few blocks, this avoids iterating over blocks where the difference is always NaN.
+struct SharedBlocks {
+    std::vector<std::size_t> offsets;
+    std::vector<std::size_t> blocks;
+};
+
+template<typename Index_>
+SharedBlocks create_shared_blocks(const std::size_t ngroups, const std::size_t nblocks, const std::vector<Index_>& combo_sizes) {
+    SharedBlocks output;
+    output.offsets.push_back(0);
+    for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
+        const auto left = combo_sizes.data() + g1 * nblocks; // product is safe as the number of combinations was already checked by the caller.
+        for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2) {
+            const auto right = combo_sizes.data() + g2 * nblocks;
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                if (left[b] && right[b]) {
+                    output.blocks.push_back(b);
+                }
+            }
+            output.offsets.push_back(output.blocks.size());
+        }
+    }
+    return output;
+}
+
+// Same as add_blocked_differences() but only considering the blocks shared by each pair of labels.
+template<typename Stat_, typename Index_>
+void add_shared_blocked_differences(
+    const Index_ r,
+    const Stat_* medians,
+    const std::size_t ngroups,
+    const std::size_t nblocks,
+    const SharedBlocks& shared,
+    const bool use_minimum,
+    PairwiseTopQueues<Stat_, Index_>& curqueues
+) {
+    auto candidates = curqueues.candidates();
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        candidates[g1 * ngroups + g1] = 0; // product is safe as it was checked when constructing the queues.
+    }
+
+    std::size_t pair = 0;
+    for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
+        const auto left = medians + g1 * nblocks; // product is safe as the number of combinations was already checked by the caller.
+        for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2, ++pair) {
+            auto& xout = candidates[g1 * ngroups + g2];
+            auto& yout = candidates[g2 * ngroups + g1];
+
+            const auto start = shared.offsets[pair];
+            const auto nshared = shared.offsets[pair + 1] - start;
+            BlockDifferenceSummary<Stat_> summary;
+            if (nshared) {
+                const auto right = medians + g2 * nblocks;
+                const auto bptr = shared.blocks.data() + start;
+                if (use_minimum) {
+                    summarize_block_differences<false, true>(left, right, bptr, nshared, summary);
+                } else {
+                    summarize_block_differences<true, false>(left, right, bptr, nshared, summary);
+                }
+            }
+            set_block_difference_candidates(summary, use_minimum, xout, yout);
+        }
+    }
+
+    curqueues.add_candidates(r);
+}
+
+// Same as add_shared_blocked_differences() but filling queues for both the mean and minimum from a single pass over the shared blocks.
+template<typename Stat_, typename Index_>
+void add_shared_blocked_differences_both(
+    const Index_ r,
+    const Stat_* medians,
+    const std::size_t ngroups,
+    const std::size_t nblocks,
+    const SharedBlocks& shared,
+    PairwiseTopQueues<Stat_, Index_>& mean_queues,
+    PairwiseTopQueues<Stat_, Index_>& min_queues
+) {
+    auto mean_candidates = mean_queues.candidates();
+    auto min_candidates = min_queues.candidates();
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        mean_candidates[g1 * ngroups + g1] = 0; // product is safe as it was checked when constructing the queues.
+        min_candidates[g1 * ngroups + g1] = 0;
+    }
+
+    std::size_t pair = 0;
+    for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
+        const auto left = medians + g1 * nblocks; // product is safe as the number of combinations was already checked by the caller.
+        for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2, ++pair) {
+            const auto start = shared.offsets[pair];
+            const auto nshared = shared.offsets[pair + 1] - start;
+            BlockDifferenceSummary<Stat_> summary;
+            if (nshared) {
+                summarize_block_differences<true, true>(left, medians + g2 * nblocks, shared.blocks.data() + start, nshared, summary);
+            }
+
+            const auto x = g1 * ngroups + g2, y = g2 * ngroups + g1;
+            set_block_difference_candidates(summary, false, mean_candidates[x], mean_candidates[y]);
+            set_block_difference_candidates(summary, true, min_candidates[x], min_candidates[y]);
+        }
+    }
+
+    mean_queues.add_candidates(r);
+    min_queues.add_candidates(r);
+}
+
+template<typename Label_, typename Block_, typename Index_>
+std::vector<std::size_t> create_blocked_combinations(
+    const Index_ NC,
+    const Label_* label,
+    const Block_* block,
+    const std::size_t ngroups,
+    const std::size_t nblocks,
+    std::vector<Index_>& combo_sizes
+) {
+    // Block is the faster changing dimension, so all medians for the same label are contiguous across blocks.
+    const auto ncombos = sanisizer::product<std::size_t>(ngroups, nblocks); // check that all products below are safe.
+    auto combinations = sanisizer::create<std::vector<std::size_t> >(NC);
+    for (I<decltype(NC)> c = 0; c < NC; ++c) {
+        combinations[c] = sanisizer::nd_offset<std::size_t>(block[c], nblocks, label[c]);
+    }
+    combo_sizes = tatami_stats::tabulate_groups(combinations.data(), NC);
+    combo_sizes.resize(ncombos); // in case the last combinations are empty.
+    return combinations;
+}
+
+template<bool include_stat_, typename Stat_, bool flat_ = false, typename Value_, typename Index_, typename Label_, typename Block_>
+MarkerOutput<include_stat_, flat_, Index_, Stat_> choose_blocked_raw(
     const tatami::Matrix<Value_, Index_>& matrix, 
     const Label_* label,
     const Block_* block,
-    const ChooseBlockedOptions& options
+    const ChooseBlockedOptions& options,
+    const std::optional<std::pair<std::size_t, std::size_t> >& rows = std::nullopt
 ) {
     const auto NC = matrix.ncol();
     const std::size_t ngroups = tatami_stats::total_groups/*<std::size_t>*/(label, NC);
@@ -65,78 +423,113 @@ Markers<include_stat_, Index_, Stat_> choose_blocked_raw(
     const auto num_keep = get_num_keep<Index_>(ngroups, options.number);
     auto pqueues = sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads);
 
-    // Creating the combinations between block and not.
-    const auto ncombos = sanisizer::product<std::size_t>(ngroups, nblocks); // check that all producs below are safe.
-    auto combinations = sanisizer::create<std::vector<std::size_t> >(NC);
-    for (I<decltype(NC)> c = 0; c < NC; ++c) {
-        combinations[c] = sanisizer::nd_offset<std::size_t>(label[c], ngroups, block[c]); // group is the faster changing dimension.
-    }
-    auto combo_sizes = tatami_stats::tabulate_groups(combinations.data(), NC);
+    std::vector<Index_> combo_sizes;
+    const auto combinations = create_blocked_combinations(NC, label, block, ngroups, nblocks, combo_sizes);
+    const auto shared = create_shared_blocks(ngroups, nblocks, combo_sizes);
 
+    auto scan_options = create_scan_options(options);
+    scan_options.rows = rows;
+    initialize_statistics(options.statistics, options.num_threads);
     const auto num_used = scan_matrix<Stat_>(
         matrix,
-        sanisizer::cast<std::size_t>(ncombos),
+        combo_sizes.size(),
         combinations.data(),
         combo_sizes,
 
         /* setup = */ [&]() -> PairwiseTopQueues<Stat_, Index_> {
-            PairwiseTopQueues<Stat_, Index_> output;
-            allocate_pairwise_queues(output, num_keep, ngroups, options.keep_ties, /* check_nan = */ false); // we'll check it ourselves.
-            return output;
+            PairwiseTopQueues<Stat_, Index_> curqueues(num_keep, ngroups, options.keep_ties);
+            if (options.statistics) {
+                curqueues.enable_counting();
+            }
+            return curqueues;
         },
 
         /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
-            for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
-                for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2) {
-
-                    if (options.use_minimum) {
-                        Stat_ xval = std::numeric_limits<Stat_>::infinity();
-                        Stat_ yval = std::numeric_limits<Stat_>::infinity();
-                        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-                            const auto delta = medians[sanisizer::nd_offset<std::size_t>(g1, ngroups, b)] - medians[sanisizer::nd_offset<std::size_t>(g2, ngroups, b)];
-                            if (!std::isnan(delta)) {
-                                xval = std::min(xval, delta);
-                                yval = std::min(yval, -delta);
-                            }
-                        }
-
-                        if (std::isfinite(xval)) {
-                            curqueues[g1][g2].emplace(xval, r); 
-                            curqueues[g2][g1].emplace(yval, r); 
-                        }
-
-                    } else {
-                        Stat_ val = 0;
-                        std::size_t denom = 0;
-                        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-                            const auto delta = medians[sanisizer::nd_offset<std::size_t>(g1, ngroups, b)] - medians[sanisizer::nd_offset<std::size_t>(g2, ngroups, b)];
-                            if (!std::isnan(delta)) {
-                                ++denom;
-                                val += delta; 
-                            }
-                        }
-
-                        if (denom) {
-                            val /= denom;
-                            curqueues[g1][g2].emplace(val, r); 
-                            curqueues[g2][g1].emplace(-val, r); 
-                        }
-                    }
-
-                }
-            }
+            add_shared_blocked_differences(r, medians.data(), ngroups, nblocks, shared, options.use_minimum, curqueues);
         },
 
         /* finalize = */ [&](const int t, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
+            if (options.statistics) {
+                curqueues.transfer_counts(options.statistics->threads[t]);
+            }
             pqueues[t] = std::move(curqueues);
         },
 
-        options.num_threads
+        scan_options
     );
 
     pqueues.resize(num_used); 
-    Markers<include_stat_, Index_, Stat_> output;
-    report_best_top_queues<include_stat_>(pqueues, ngroups, output);
+    finalize_statistics(options.statistics, num_used);
+    MarkerOutput<include_stat_, flat_, Index_, Stat_> output;
+    time_merge(options.statistics, [&]() -> void {
+        report_best_top_queues<include_stat_>(pqueues, ngroups, output, options.num_threads);
+    });
+    return output;
+}
+
+template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Label_, typename Block_>
+ChooseBlockedBothResults<Markers<include_stat_, Index_, Stat_> > choose_blocked_both_raw(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    const auto NC = matrix.ncol();
+    const std::size_t ngroups = tatami_stats::total_groups(label, NC);
+    const std::size_t nblocks = tatami_stats::total_groups(block, NC);
+
+    const auto num_keep = get_num_keep<Index_>(ngroups, options.number);
+    auto mean_pqueues = sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads);
+    auto min_pqueues = sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads);
+
+    std::vector<Index_> combo_sizes;
+    const auto combinations = create_blocked_combinations(NC, label, block, ngroups, nblocks, combo_sizes);
+    const auto shared = create_shared_blocks(ngroups, nblocks, combo_sizes);
+
+    typedef std::pair<PairwiseTopQueues<Stat_, Index_>, PairwiseTopQueues<Stat_, Index_> > BothQueues;
+    initialize_statistics(options.statistics, options.num_threads);
+    const auto num_used = scan_matrix<Stat_>(
+        matrix,
+        combo_sizes.size(),
+        combinations.data(),
+        combo_sizes,
+
+        /* setup = */ [&]() -> BothQueues {
+            BothQueues curqueues(
+                PairwiseTopQueues<Stat_, Index_>(num_keep, ngroups, options.keep_ties),
+                PairwiseTopQueues<Stat_, Index_>(num_keep, ngroups, options.keep_ties)
+            );
+            if (options.statistics) {
+                curqueues.first.enable_counting();
+                curqueues.second.enable_counting();
+            }
+            return curqueues;
+        },
+
+        /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, BothQueues& curqueues) -> void {
+            add_shared_blocked_differences_both(r, medians.data(), ngroups, nblocks, shared, curqueues.first, curqueues.second);
+        },
+
+        /* finalize = */ [&](const int t, BothQueues& curqueues) -> void {
+            if (options.statistics) {
+                curqueues.first.transfer_counts(options.statistics->threads[t]);
+                curqueues.second.transfer_counts(options.statistics->threads[t]);
+            }
+            mean_pqueues[t] = std::move(curqueues.first);
+            min_pqueues[t] = std::move(curqueues.second);
+        },
+
+        create_scan_options(options)
+    );
+
+    mean_pqueues.resize(num_used);
+    min_pqueues.resize(num_used);
+    finalize_statistics(options.statistics, num_used);
+    ChooseBlockedBothResults<Markers<include_stat_, Index_, Stat_> > output;
+    time_merge(options.statistics, [&]() -> void {
+        report_best_top_queues<include_stat_>(mean_pqueues, ngroups, output.mean, options.num_threads);
+        report_best_top_queues<include_stat_>(min_pqueues, ngroups, output.minimum, options.num_threads);
+    });
     return output;
 }
 /**
@@ -210,6 +603,136 @@ std::vector<std::vector<std::vector<Index_> > > choose_blocked_index(
     return choose_blocked_raw<false, Stat_>(matrix, label, block, options);
 }
 
+/**
+ * Variant of `choose_blocked()` that reports the markers in a flat layout, see `choose_flat()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column. 
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels. 
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column. 
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks. 
+ * @param options Further options.
+ * 
+ * @return Top markers for each pairwise comparison between labels.
+ * This contains the same markers as the output of `choose_blocked()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+FlatMarkers<Index_, Stat_> choose_blocked_flat(
+    const tatami::Matrix<Value_, Index_>& matrix, 
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return choose_blocked_raw<true, Stat_, true>(matrix, label, block, options);
+}
+
+/**
+ * Variant of `choose_blocked()` that reports markers for both the mean and minimum of the per-block differences.
+ * This is more efficient than calling `choose_blocked()` twice with different `ChooseBlockedOptions::use_minimum`,
+ * as the per-block medians are only computed once and both statistics are obtained from a single pass over the blocks for each pair of labels.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ * `ChooseBlockedOptions::use_minimum` is ignored.
+ *
+ * @return Top markers for each pairwise comparison between labels, for each of the mean and minimum.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+ChooseBlockedBothResults<std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > > choose_blocked_both(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return choose_blocked_both_raw<true, Stat_>(matrix, label, block, options);
+}
+
+/**
+ * Variant of `choose_blocked_both()` that only reports the indices of the top markers for each pairwise comparison.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ * `ChooseBlockedOptions::use_minimum` is ignored.
+ *
+ * @return Top markers for each pairwise comparison between labels, for each of the mean and minimum.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+ChooseBlockedBothResults<std::vector<std::vector<std::vector<Index_> > > > choose_blocked_index_both(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return choose_blocked_both_raw<false, Stat_>(matrix, label, block, options);
+}
+
+/**
+ * Variant of `choose_blocked()` that reports the union of all markers, see `choose_union()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ *
+ * @return Union of the top markers and the positions of the top markers for each pairwise comparison.
+ * The differences between medians are not reported.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+UnionMarkers<Index_, Stat_> choose_blocked_union(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return union_markers(choose_blocked_raw<false, Stat_, true>(matrix, label, block, options), matrix.nrow());
+}
+
 }
 
 #endif
@@ -0,0 +1,359 @@
+#ifndef SINGLER_CLASSIC_MARKERS_CACHE_HPP
+#define SINGLER_CLASSIC_MARKERS_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <filesystem>
+#include <system_error>
+#include <type_traits>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "flat.hpp"
+#include "choose.hpp"
+#include "blocked.hpp"
+#include "utils.hpp"
+
+/**
+ * @file cache.hpp
+ * @brief Cache marker results on disk.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Options for the cached marker detection functions, e.g., `choose_flat_cached()`.
+ */
+struct CacheOptions {
+    /**
+     * Path to the directory in which to store the cached results.
+     * This is created if it does not already exist.
+     */
+    std::string directory;
+
+    /**
+     * Number of rows of the reference matrix to include in the fingerprint.
+     * These rows are evenly spaced across the matrix and all of their values are used in the fingerprint, along with the matrix dimensions, labels, blocks and options.
+     * If not set, all rows are used, which guarantees that any change to the matrix is detected but requires a full pass over the matrix.
+     * Otherwise, changes to the matrix that do not affect the sampled rows or the dimensions will not be detected.
+     */
+    std::optional<std::size_t> num_sampled_rows = 100;
+};
+
+/**
+ * @cond
+ */
+// 64-bit FNV-1a hash, which is simple and good enough to distinguish between a handful of references.
+class Fingerprint {
+public:
+    void add_bytes(const void* ptr, const std::size_t n) {
+        const auto bytes = static_cast<const unsigned char*>(ptr);
+        for (std::size_t i = 0; i < n; ++i) {
+            my_hash ^= bytes[i];
+            my_hash *= 0x100000001b3;
+        }
+    }
+
+    template<typename Type_>
+    void add(const Type_ x) {
+        static_assert(std::is_arithmetic<Type_>::value);
+        add_bytes(&x, sizeof(Type_));
+    }
+
+    void add_string(const std::string& x) {
+        add<std::uint64_t>(x.size());
+        add_bytes(x.data(), x.size());
+    }
+
+    std::uint64_t get() const {
+        return my_hash;
+    }
+
+private:
+    std::uint64_t my_hash = 0xcbf29ce484222325;
+};
+
+// This should be incremented whenever the marker detection algorithm or the format of the cached files changes,
+// so that results from older versions of this library are not incorrectly retrieved from the cache.
+constexpr std::uint64_t cache_format_version = 1;
+
+template<typename Value_, typename Index_>
+void fingerprint_matrix(const tatami::Matrix<Value_, Index_>& matrix, const std::optional<std::size_t>& num_sampled_rows, Fingerprint& fingerprint) {
+    const auto NR = matrix.nrow();
+    const auto NC = matrix.ncol();
+    fingerprint.add<std::uint64_t>(sizeof(Value_));
+    fingerprint.add<std::uint64_t>(sizeof(Index_));
+    fingerprint.add<std::uint64_t>(NR);
+    fingerprint.add<std::uint64_t>(NC);
+
+    auto buffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
+    const auto add_row = [&](const Index_ r, const Value_* ptr) -> void {
+        fingerprint.add<std::uint64_t>(r);
+        fingerprint.add_bytes(ptr, sizeof(Value_) * static_cast<std::size_t>(NC)); // product is safe as the buffer was allocated.
+    };
+
+    const std::size_t NR_as_size = NR;
+    if (!num_sampled_rows.has_value() || *num_sampled_rows >= NR_as_size) {
+        auto ext = tatami::consecutive_extractor<false>(matrix, true, static_cast<Index_>(0), NR);
+        for (Index_ r = 0; r < NR; ++r) {
+            add_row(r, ext->fetch(buffer.data()));
+        }
+    } else {
+        const auto nsampled = *num_sampled_rows;
+        auto sampled = sanisizer::create<std::vector<Index_> >(nsampled);
+        for (std::size_t s = 0; s < nsampled; ++s) {
+            // Spreading the samples evenly across the matrix; the cast is safe as NR * s / nsampled < NR.
+            sampled[s] = static_cast<Index_>(static_cast<double>(NR_as_size) * static_cast<double>(s) / static_cast<double>(nsampled));
+        }
+
+        // Using an oracle so that the matrix can prefetch the sampled rows with a single extractor.
+        auto ext = tatami::new_extractor<false, true>(matrix, true, std::make_shared<tatami::FixedVectorOracle<Index_> >(sampled));
+        for (const auto r : sampled) {
+            add_row(r, ext->fetch(buffer.data()));
+        }
+    }
+}
+
+template<typename Group_, typename Index_>
+void fingerprint_groups(const Group_* group, const Index_ NC, Fingerprint& fingerprint) {
+    for (Index_ c = 0; c < NC; ++c) {
+        fingerprint.add<std::uint64_t>(group[c]);
+    }
+}
+
+template<class Options_>
+void fingerprint_common_options(const Options_& options, Fingerprint& fingerprint) {
+    // Only including options that affect the results, e.g., the number of threads is not included.
+    fingerprint.add<unsigned char>(options.number.has_value());
+    if (options.number.has_value()) {
+        fingerprint.add<std::uint64_t>(*(options.number));
+    }
+    fingerprint.add<unsigned char>(options.keep_ties);
+    fingerprint.add<unsigned char>(options.approximate);
+    if (options.approximate) {
+        fingerprint.add<std::uint64_t>(options.approximate_sketch_size);
+    }
+}
+
+inline std::string fingerprint_to_path(const std::string& directory, const std::uint64_t hash) {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return (std::filesystem::path(directory) / (std::string(name) + ".markers")).string();
+}
+
+// Writing to a temporary file and then renaming it to the final path.
+// This ensures that other processes never see a partially written file, as the rename is atomic on POSIX filesystems.
+// If multiple processes compute the same result, the last rename wins, which is fine as their contents are the same.
+template<typename Index_, typename Stat_>
+void save_to_cache(const FlatMarkers<Index_, Stat_>& markers, const std::string& path) {
+    static std::atomic<unsigned long long> counter(0);
+    std::string tmp = path + ".tmp";
+#ifndef _WIN32
+    tmp += "." + std::to_string(static_cast<long long>(::getpid()));
+#endif
+    tmp += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    tmp += "." + std::to_string(counter.fetch_add(1));
+
+    try {
+        save_flat_markers(markers, tmp);
+        std::filesystem::rename(tmp, path);
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+}
+
+template<typename Index_, typename Stat_, class Compute_>
+FlatMarkers<Index_, Stat_> fetch_from_cache(const std::uint64_t hash, const std::size_t ngroups, const CacheOptions& cache_options, Compute_ compute) {
+    std::filesystem::create_directories(cache_options.directory);
+    const auto path = fingerprint_to_path(cache_options.directory, hash);
+
+    if (std::filesystem::exists(path)) {
+        try {
+            auto loaded = load_flat_markers<Index_, Stat_>(path);
+            if (loaded.num_labels == ngroups) {
+                return loaded;
+            }
+        } catch (...) {
+            // Corrupted or incompatible files are just recomputed and replaced.
+        }
+    }
+
+    auto output = compute();
+    save_to_cache(output, path);
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Cached version of `choose_flat()`.
+ * If a result for the same reference, labels and options was previously stored in `CacheOptions::directory`, it is loaded and returned without scanning the matrix.
+ * Otherwise, the markers are computed with `choose_flat()` and stored in the cache directory for future calls.
+ * It is safe to call this function from multiple processes that share the same cache directory,
+ * as the result files are written to a temporary location and then atomically renamed to their final path.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ * @param cache_options Options for the cache.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_flat()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+FlatMarkers<Index_, Stat_> choose_flat_cached(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options,
+    const CacheOptions& cache_options
+) {
+    const auto NC = matrix.ncol();
+    Fingerprint fingerprint;
+    fingerprint.add_string("choose");
+    fingerprint.add<std::uint64_t>(cache_format_version);
+    fingerprint.add<std::uint64_t>(sizeof(Stat_));
+    fingerprint_matrix(matrix, cache_options.num_sampled_rows, fingerprint);
+    fingerprint_groups(label, NC, fingerprint);
+    fingerprint_common_options(options, fingerprint);
+
+    const std::size_t ngroups = tatami_stats::total_groups(label, NC);
+    return fetch_from_cache<Index_, Stat_>(fingerprint.get(), ngroups, cache_options, [&]() -> FlatMarkers<Index_, Stat_> {
+        return choose_flat<Stat_>(matrix, label, options);
+    });
+}
+
+/**
+ * Cached version of `choose_index()`, see `choose_flat_cached()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ * @param cache_options Options for the cache.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_index()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+std::vector<std::vector<std::vector<Index_> > > choose_index_cached(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options,
+    const CacheOptions& cache_options
+) {
+    return unflatten_markers<false>(choose_flat_cached<Stat_>(matrix, label, options, cache_options));
+}
+
+/**
+ * Cached version of `choose_blocked_flat()`, see `choose_flat_cached()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ * @param cache_options Options for the cache.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_blocked_flat()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+FlatMarkers<Index_, Stat_> choose_blocked_flat_cached(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options,
+    const CacheOptions& cache_options
+) {
+    const auto NC = matrix.ncol();
+    Fingerprint fingerprint;
+    fingerprint.add_string("choose_blocked");
+    fingerprint.add<std::uint64_t>(cache_format_version);
+    fingerprint.add<std::uint64_t>(sizeof(Stat_));
+    fingerprint_matrix(matrix, cache_options.num_sampled_rows, fingerprint);
+    fingerprint_groups(label, NC, fingerprint);
+    fingerprint_groups(block, NC, fingerprint);
+    fingerprint_common_options(options, fingerprint);
+    fingerprint.add<unsigned char>(options.use_minimum);
+
+    const std::size_t ngroups = tatami_stats::total_groups(label, NC);
+    return fetch_from_cache<Index_, Stat_>(fingerprint.get(), ngroups, cache_options, [&]() -> FlatMarkers<Index_, Stat_> {
+        return choose_blocked_flat<Stat_>(matrix, label, block, options);
+    });
+}
+
+/**
+ * Cached version of `choose_blocked_index()`, see `choose_flat_cached()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ * @param cache_options Options for the cache.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_blocked_index()` for details.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+std::vector<std::vector<std::vector<Index_> > > choose_blocked_index_cached(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ChooseBlockedOptions& options,
+    const CacheOptions& cache_options
+) {
+    return unflatten_markers<false>(choose_blocked_flat_cached<Stat_>(matrix, label, block, options, cache_options));
+}
+
+}
+
+#endif
@@ -3,7 +3,13 @@
 
 #include <cstddef>
 #include <optional>
+#include <utility>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <functional>
+#include <atomic>
 
 #include "sanisizer/sanisizer.hpp"
 #include "tatami/tatami.hpp"
@@ -11,6 +17,8 @@
 
 #include "queue.hpp"
 #include "scan.hpp"
+#include "statistics.hpp"
+#include "progress.hpp"
 #include "number.hpp"
 
 /**
@@ -42,16 +50,150 @@ struct ChooseOptions {
      * The parallelization scheme is determined by `tatami::parallelize()`.
      */
     int num_threads = 1;
+
+    /**
+     * Whether to dynamically assign rows to threads.
+     * If `true`, each thread repeatedly takes the next chunk of `dynamic_chunk_size` rows until all rows are processed.
+     * This balances the work across threads when the cost of each row is highly variable, e.g., in sparse matrices where highly expressed genes are clustered together.
+     * If `false`, each thread processes a contiguous range of rows of (roughly) equal size, as determined by `tatami::parallelize()`.
+     * The results are the same regardless of the scheduling.
+     */
+    bool dynamic_scheduling = false;
+
+    /**
+     * Number of rows in each chunk when `dynamic_scheduling = true`.
+     * Smaller chunks improve load balancing at the cost of more overhead from creating new extractors for each chunk.
+     */
+    std::size_t dynamic_chunk_size = 1000;
+
+    /**
+     * Whether to extract rows in a separate thread for each worker, so that the extraction of the next batch of rows overlaps with the computation of medians for the current batch.
+     * This is most useful for matrices where extraction is slow, e.g., file-backed matrices.
+     * Only used for matrices that prefer row access, see `column_slab_size` for the alternative.
+     * Ignored if `approximate = true`.
+     */
+    bool pipeline = false;
+
+    /**
+     * Number of rows in each batch when `pipeline = true`.
+     */
+    std::size_t pipeline_batch_size = 100;
+
+    /**
+     * Maximum number of batches that can be extracted ahead of the computation when `pipeline = true`.
+     * Larger values can smooth over variable extraction times at the cost of more memory.
+     */
+    std::size_t pipeline_depth = 2;
+
+    /**
+     * Number of rows to process at once when the matrix prefers column access, see `tatami::Matrix::prefer_rows()`.
+     * For such matrices, each thread extracts a slab of rows from all columns and computes the medians for all rows in the slab, which avoids the cost of row access.
+     * Larger slabs require fewer passes over the columns at the cost of more memory.
+     * If not set, the slab size is chosen so that each thread holds approximately 1 million matrix values.
+     */
+    std::optional<std::size_t> column_slab_size;
+
+    /**
+     * Whether to approximate the median of each group with a quantile sketch.
+     * This bounds the memory usage of each thread regardless of the number of columns in the matrix, which is useful for very large references.
+     * For a group of \f$n\f$ samples and a sketch size of \f$k\f$, the rank of the reported median differs from that of the exact median by no more than \f$(n/k)(1 + \log_2(n/k))\f$.
+     * Medians are exact for groups with no more than \f$k\f$ samples.
+     */
+    bool approximate = false;
+
+    /**
+     * Size of the quantile sketch when `approximate = true`.
+     * Larger values improve the accuracy of the approximation at the cost of more memory and time.
+     */
+    std::size_t approximate_sketch_size = 1024;
+
+    /**
+     * Pointer to a `ChooseStatistics` object in which to store instrumentation statistics, e.g., the time spent in each phase.
+     * If NULL, no statistics are collected.
+     */
+    ChooseStatistics* statistics = NULL;
+
+    /**
+     * Function to report the progress of the scan over the rows of the matrix.
+     * This is called with the number of rows processed so far and the total number of rows.
+     * It may be called from any worker thread but never concurrently, and should return quickly as the calling worker is blocked in the meantime.
+     * Reports are throttled to once every `check_interval` rows per thread, and some reports may be skipped if another thread is already reporting.
+     * If empty, progress is not reported.
+     */
+    std::function<void(std::size_t, std::size_t)> progress;
+
+    /**
+     * Pointer to a flag that can be set by another thread to cancel the marker detection.
+     * Each thread checks this flag every `check_interval` rows, and a `CancelledError` is thrown once it is set.
+     * If NULL, the marker detection cannot be cancelled.
+     */
+    const std::atomic<bool>* cancel = NULL;
+
+    /**
+     * Number of rows processed by each thread between progress reports and checks of the `cancel` flag.
+     * Smaller values improve responsiveness at the cost of more overhead.
+     */
+    std::size_t check_interval = 1000;
 };
 
 /**
  * @cond
  */
-template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Label_>
-Markers<include_stat_, Index_, Stat_> choose_raw(
+template<typename Stat_, typename Index_>
+void add_pairwise_differences(const Index_ r, const Stat_* medians, const std::size_t ngroups, PairwiseTopQueues<Stat_, Index_>& curqueues) {
+    // No difference can be larger than the range of the medians, so if the range is below the lowest threshold across all queues, we can skip the row.
+    // This is exact as floating-point subtraction is monotonic, i.e., 'medians[g1] - medians[g2]' can never be greater than 'max - min'.
+    // Most genes are uninformative, so this skips the O(L^2) loop below for most rows once the queues are full.
+    Stat_ lower = std::numeric_limits<Stat_>::infinity(), upper = -lower;
+    std::size_t num_missing = 0;
+    for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+        const auto val = medians[g];
+        if (std::isnan(val)) {
+            ++num_missing;
+        } else {
+            lower = std::min(lower, val);
+            upper = std::max(upper, val);
+        }
+    }
+    if (!(upper - lower >= curqueues.min_threshold())) { // also catches the case where all medians are NaN.
+        const auto num_present = ngroups - num_missing;
+        curqueues.skip_candidates(ngroups * ngroups - num_present * num_present); // all differences involving a NaN median are NaN.
+        return;
+    }
+
+    // Filling the full matrix of differences so that the admission check is a single pass.
+    // The diagonal is just zero and will be ignored, as will any NaNs from missing labels. 
+    auto candidates = curqueues.candidates();
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        const auto ref = medians[g1];
+        const auto row = candidates + g1 * ngroups; // product is safe as it was checked when constructing the queues.
+        for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
+            row[g2] = ref - medians[g2];
+        }
+    }
+    curqueues.add_candidates(r);
+}
+
+// Comparisons involving empty labels always yield NaN differences, so they should not contribute to the lower bound of the thresholds.
+template<typename Stat_, typename Index_, typename Size_>
+void exclude_missing_labels_from_bound(const std::vector<Size_>& group_sizes, PairwiseTopQueues<Stat_, Index_>& curqueues) {
+    const auto ngroups = group_sizes.size();
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        if (group_sizes[g1] == 0) {
+            for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
+                curqueues.exclude_from_bound(g1 * ngroups + g2); // product is safe as it was checked when constructing the queues.
+                curqueues.exclude_from_bound(g2 * ngroups + g1);
+            }
+        }
+    }
+}
+
+template<bool include_stat_, typename Stat_, bool flat_ = false, typename Value_, typename Index_, typename Label_>
+MarkerOutput<include_stat_, flat_, Index_, Stat_> choose_raw(
     const tatami::Matrix<Value_, Index_>& matrix, 
     const Label_* label,
-    const ChooseOptions& options
+    const ChooseOptions& options,
+    const std::optional<std::pair<std::size_t, std::size_t> >& rows = std::nullopt
 ) {
     const auto NC = matrix.ncol();
     auto group_sizes = tatami_stats::tabulate_groups(label, NC);
@@ -60,6 +202,9 @@ Markers<include_stat_, Index_, Stat_> choose_raw(
     const auto num_keep = get_num_keep<Index_>(ngroups, options.number);
     auto pqueues = sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads);
 
+    auto scan_options = create_scan_options(options);
+    scan_options.rows = rows;
+    initialize_statistics(options.statistics, options.num_threads);
     const auto num_used = scan_matrix<Stat_>(
         matrix,
         sanisizer::cast<std::size_t>(ngroups),
@@ -67,31 +212,34 @@ Markers<include_stat_, Index_, Stat_> choose_raw(
         group_sizes,
 
         /* setup = */ [&]() -> PairwiseTopQueues<Stat_, Index_> {
-            PairwiseTopQueues<Stat_, Index_> output;
-            allocate_pairwise_queues(output, num_keep, ngroups, options.keep_ties, /* check_nan = */ true);
-            return output;
+            PairwiseTopQueues<Stat_, Index_> curqueues(num_keep, ngroups, options.keep_ties);
+            exclude_missing_labels_from_bound(group_sizes, curqueues);
+            if (options.statistics) {
+                curqueues.enable_counting();
+            }
+            return curqueues;
         },
 
         /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
-            for (I<decltype(ngroups)> g1 = 1; g1 < ngroups; ++g1) {
-                for (I<decltype(ngroups)> g2 = 0; g2 < g1; ++g2) {
-                    const auto delta = medians[g1] - medians[g2];
-                    curqueues[g1][g2].emplace(delta, r); 
-                    curqueues[g2][g1].emplace(-delta, r); 
-                }
-            }
+            add_pairwise_differences(r, medians.data(), ngroups, curqueues);
         },
 
         /* finalize = */ [&](const int t, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
+            if (options.statistics) {
+                curqueues.transfer_counts(options.statistics->threads[t]);
+            }
             pqueues[t] = std::move(curqueues);
         },
 
-        options.num_threads
+        scan_options
     );
 
     pqueues.resize(num_used); 
-    Markers<include_stat_, Index_, Stat_> output;
-    report_best_top_queues<include_stat_>(pqueues, ngroups, output);
+    finalize_statistics(options.statistics, num_used);
+    MarkerOutput<include_stat_, flat_, Index_, Stat_> output;
+    time_merge(options.statistics, [&]() -> void {
+        report_best_top_queues<include_stat_>(pqueues, ngroups, output, options.num_threads);
+    });
     return output;
 }
 /**
@@ -159,6 +307,62 @@ std::vector<std::vector<std::vector<Index_> > > choose_index(
     return choose_raw<false, Stat_>(matrix, label, options);
 }
 
+/**
+ * Variant of `choose()` that reports the markers in a flat layout.
+ * This avoids allocating a separate vector for each pairwise comparison, which is more efficient for references with many labels.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column. 
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels. 
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels.
+ * This contains the same markers as the output of `choose()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+FlatMarkers<Index_, Stat_> choose_flat(
+    const tatami::Matrix<Value_, Index_>& matrix, 
+    const Label_* label,
+    const ChooseOptions& options
+) {
+    return choose_raw<true, Stat_, true>(matrix, label, options);
+}
+
+/**
+ * Variant of `choose()` that reports the union of all markers, along with the markers for each pairwise comparison as positions in the union.
+ * This is more efficient than creating the union from the output of `choose_index()`, as no intermediate vectors are allocated for each pairwise comparison.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ *
+ * @return Union of the top markers and the positions of the top markers for each pairwise comparison.
+ * The differences between medians are not reported.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+UnionMarkers<Index_, Stat_> choose_union(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options
+) {
+    return union_markers(choose_raw<false, Stat_, true>(matrix, label, options), matrix.nrow());
+}
+
 }
 
 #endif
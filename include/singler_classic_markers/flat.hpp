@@ -0,0 +1,686 @@
+#ifndef SINGLER_CLASSIC_MARKERS_FLAT_HPP
+#define SINGLER_CLASSIC_MARKERS_FLAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "sanisizer/sanisizer.hpp"
+
+#include "utils.hpp"
+
+/**
+ * @file flat.hpp
+ * @brief Flat storage of the markers for all pairwise comparisons.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Markers for all pairwise comparisons in a flat layout.
+ *
+ * All markers are stored in a single set of contiguous arrays, in contrast to the nested vectors returned by `choose()` and friends.
+ * This avoids a separate allocation for each pairwise comparison, which is helpful for references with many labels.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+struct FlatMarkers {
+    /**
+     * Number of labels.
+     */
+    std::size_t num_labels = 0;
+
+    /**
+     * Offsets for each pairwise comparison, of length \f$L^2 + 1\f$ for \f$L\f$ labels.
+     * The markers for label \f$i\f$ over label \f$j\f$ are stored in `indices` (and `stats`) from `offsets[i * L + j]` to `offsets[i * L + j + 1]`.
+     * These are ordered by decreasing difference, as described for `choose()`.
+     * No markers are ever reported when \f$i = j\f$.
+     */
+    std::vector<std::size_t> offsets;
+
+    /**
+     * Row indices of the markers for all pairwise comparisons.
+     */
+    std::vector<Index_> indices;
+
+    /**
+     * Difference between medians for each marker in `indices`.
+     * This is empty if the differences were not requested, e.g., when flattening the output of `choose_index()`.
+     */
+    std::vector<Stat_> stats;
+};
+
+/**
+ * @brief Non-owning view of the markers for a single pairwise comparison.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+struct PairMarkersView {
+    /**
+     * Number of markers.
+     */
+    std::size_t number = 0;
+
+    /**
+     * Pointer to an array of length `number`, containing the row indices of the markers.
+     */
+    const Index_* indices = NULL;
+
+    /**
+     * Pointer to an array of length `number`, containing the difference between medians for each marker.
+     * This is NULL if no differences are available.
+     */
+    const Stat_* stats = NULL;
+};
+
+/**
+ * @brief Non-owning view of the markers for all pairwise comparisons.
+ *
+ * This has the same layout as `FlatMarkers`, and can be created from a `FlatMarkers` instance with `view_flat_markers()` or from a file with `MappedFlatMarkers`.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+struct FlatMarkersView {
+    /**
+     * Number of labels.
+     */
+    std::size_t num_labels = 0;
+
+    /**
+     * Pointer to an array of offsets, see `FlatMarkers::offsets`.
+     */
+    const std::size_t* offsets = NULL;
+
+    /**
+     * Pointer to an array of row indices, see `FlatMarkers::indices`.
+     */
+    const Index_* indices = NULL;
+
+    /**
+     * Pointer to an array of differences, see `FlatMarkers::stats`.
+     * This is NULL if no differences are available.
+     */
+    const Stat_* stats = NULL;
+
+    /**
+     * @return Total number of markers across all pairwise comparisons.
+     */
+    std::size_t total() const {
+        return offsets[num_labels * num_labels];
+    }
+
+    /**
+     * @param g1 Index of the first label.
+     * @param g2 Index of the second label.
+     * @return View of the markers for `g1` over `g2`.
+     */
+    PairMarkersView<Index_, Stat_> get(const std::size_t g1, const std::size_t g2) const {
+        const auto p = g1 * num_labels + g2;
+        PairMarkersView<Index_, Stat_> output;
+        const auto start = offsets[p];
+        output.number = offsets[p + 1] - start;
+        output.indices = indices + start;
+        if (stats) {
+            output.stats = stats + start;
+        }
+        return output;
+    }
+};
+
+/**
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @param markers Markers for all pairwise comparisons.
+ * @return View of `markers`, which remains valid as long as `markers` is not modified or destroyed.
+ */
+template<typename Index_, typename Stat_>
+FlatMarkersView<Index_, Stat_> view_flat_markers(const FlatMarkers<Index_, Stat_>& markers) {
+    FlatMarkersView<Index_, Stat_> output;
+    output.num_labels = markers.num_labels;
+    output.offsets = markers.offsets.data();
+    output.indices = markers.indices.data();
+    if (!markers.stats.empty()) {
+        output.stats = markers.stats.data();
+    }
+    return output;
+}
+
+/**
+ * @cond
+ */
+template<bool include_stat_, typename Index_, typename Stat_, typename Marker_>
+FlatMarkers<Index_, Stat_> flatten_markers_raw(const std::vector<std::vector<std::vector<Marker_> > >& markers) {
+    FlatMarkers<Index_, Stat_> output;
+    const auto ngroups = markers.size();
+    output.num_labels = ngroups;
+    output.offsets.reserve(sanisizer::sum<std::size_t>(sanisizer::product<std::size_t>(ngroups, ngroups), 1));
+    output.offsets.push_back(0);
+
+    std::size_t total = 0;
+    for (const auto& current : markers) {
+        if (current.size() != ngroups) {
+            throw std::runtime_error("inconsistent number of labels in the nested markers");
+        }
+        for (const auto& pair : current) {
+            total = sanisizer::sum<std::size_t>(total, pair.size());
+            output.offsets.push_back(total);
+        }
+    }
+
+    output.indices.reserve(total);
+    if constexpr(include_stat_) {
+        output.stats.reserve(total);
+    }
+    for (const auto& current : markers) {
+        for (const auto& pair : current) {
+            for (const auto& x : pair) {
+                if constexpr(include_stat_) {
+                    output.indices.push_back(x.first);
+                    output.stats.push_back(x.second);
+                } else {
+                    output.indices.push_back(x);
+                }
+            }
+        }
+    }
+
+    return output;
+}
+
+template<bool include_stat_, typename Index_, typename Stat_>
+Markers<include_stat_, Index_, Stat_> unflatten_markers(const FlatMarkers<Index_, Stat_>& markers) {
+    const auto ngroups = markers.num_labels;
+    const auto view = view_flat_markers(markers);
+    auto output = sanisizer::create<Markers<include_stat_, Index_, Stat_> >(ngroups);
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        sanisizer::resize(output[g1], ngroups);
+        for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
+            const auto pair = view.get(g1, g2);
+            auto& current = output[g1][g2];
+            current.reserve(pair.number);
+            for (I<decltype(pair.number)> i = 0; i < pair.number; ++i) {
+                if constexpr(include_stat_) {
+                    current.emplace_back(pair.indices[i], pair.stats[i]);
+                } else {
+                    current.push_back(pair.indices[i]);
+                }
+            }
+        }
+    }
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Convert the nested markers from `choose()`, `choose_blocked()` or their profile-based counterparts into the flat layout.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param markers Markers for all pairwise comparisons.
+ * @return Flat markers, including the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+FlatMarkers<Index_, Stat_> flatten_markers(const std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > >& markers) {
+    return flatten_markers_raw<true, Index_, Stat_>(markers);
+}
+
+/**
+ * Convert the nested markers from `choose_index()`, `choose_blocked_index()` or their profile-based counterparts into the flat layout.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param markers Markers for all pairwise comparisons.
+ * @return Flat markers, where `FlatMarkers::stats` is empty.
+ */
+template<typename Stat_ = double, typename Index_>
+FlatMarkers<Index_, Stat_> flatten_markers(const std::vector<std::vector<std::vector<Index_> > >& markers) {
+    return flatten_markers_raw<false, Index_, Stat_>(markers);
+}
+
+/**
+ * @brief Markers for all pairwise comparisons, indexed into the union of all markers.
+ *
+ * This is intended for classification functions like those in **singlepp**, which only use the union of markers as features.
+ * The pairwise markers are reported as positions in the union, so that no further remapping is required.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+struct UnionMarkers {
+    /**
+     * Sorted and unique row indices of all markers across all pairwise comparisons.
+     */
+    std::vector<Index_> features;
+
+    /**
+     * Markers for all pairwise comparisons, where each entry of `FlatMarkers::indices` is a position in `features` rather than a row index.
+     */
+    FlatMarkers<Index_, Stat_> markers;
+};
+
+/**
+ * Compute the union of all markers and remap the pairwise markers to positions in the union.
+ * This uses a single pass over the markers in linear time, without sorting.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param markers Markers for all pairwise comparisons, e.g., from `choose_flat()` or `flatten_markers()`.
+ * @param num_rows Number of rows in the reference matrix.
+ * All row indices in `markers` should be less than `num_rows`.
+ *
+ * @return Union of markers and the remapped pairwise markers.
+ */
+template<typename Index_, typename Stat_>
+UnionMarkers<Index_, Stat_> union_markers(FlatMarkers<Index_, Stat_> markers, const Index_ num_rows) {
+    UnionMarkers<Index_, Stat_> output;
+
+    // Using the row-to-position mapping as both the presence marker and the remapping, so we only need one vector of length 'num_rows'.
+    constexpr Index_ absent = -1; // all positions are less than 'num_rows' so this is never a valid position.
+    auto mapping = sanisizer::create<std::vector<Index_> >(num_rows, absent);
+    for (const auto i : markers.indices) {
+        mapping[i] = 0;
+    }
+
+    Index_ counter = 0;
+    for (Index_ r = 0; r < num_rows; ++r) {
+        auto& current = mapping[r];
+        if (current != absent) {
+            current = counter;
+            output.features.push_back(r);
+            ++counter;
+        }
+    }
+
+    for (auto& i : markers.indices) {
+        i = mapping[i];
+    }
+    output.markers = std::move(markers);
+    return output;
+}
+
+/**
+ * @cond
+ */
+// Binary layout of a saved file, where all fields are stored in native byte order:
+//
+// - 8 header words of 64 bits each: the magic number, a byte order mark, sizeof(Index_), sizeof(Stat_), the flags, the number of labels, the number of markers and a reserved word.
+// - The offsets, as 64-bit words.
+// - The row indices, padded to a multiple of 8 bytes.
+// - The differences between medians, if present.
+//
+// All sections start at a multiple of 8 bytes so that they can be used directly from a memory-mapped file.
+constexpr std::uint64_t flat_markers_magic = 0x54414c464d434353; // i.e., "SCCMFLAT" in little-endian order.
+constexpr std::uint64_t flat_markers_byte_order = 0x0102030405060708;
+constexpr std::size_t flat_markers_header_words = 8;
+constexpr std::uint64_t flat_markers_flag_stats = 1;
+constexpr std::uint64_t flat_markers_flag_signed_index = 2;
+
+template<typename Index_, typename Stat_>
+struct FlatMarkersLayout {
+    std::size_t num_labels = 0;
+    std::size_t num_markers = 0;
+    bool has_stats = false;
+    std::size_t num_offsets = 0;
+    std::size_t indices_start = 0;
+    std::size_t stats_start = 0;
+    std::size_t end = 0;
+};
+
+inline std::size_t round_up_to_word(const std::size_t x) {
+    constexpr std::size_t word = sizeof(std::uint64_t);
+    return sanisizer::sum<std::size_t>(x, (word - x % word) % word);
+}
+
+template<typename Index_, typename Stat_>
+void compute_flat_markers_layout(FlatMarkersLayout<Index_, Stat_>& layout) {
+    layout.num_offsets = sanisizer::sum<std::size_t>(sanisizer::product<std::size_t>(layout.num_labels, layout.num_labels), 1);
+    const auto offsets_start = flat_markers_header_words * sizeof(std::uint64_t);
+    layout.indices_start = sanisizer::sum<std::size_t>(offsets_start, sanisizer::product<std::size_t>(layout.num_offsets, sizeof(std::uint64_t)));
+    layout.stats_start = round_up_to_word(sanisizer::sum<std::size_t>(layout.indices_start, sanisizer::product<std::size_t>(layout.num_markers, sizeof(Index_))));
+    layout.end = layout.stats_start;
+    if (layout.has_stats) {
+        layout.end = sanisizer::sum<std::size_t>(layout.end, sanisizer::product<std::size_t>(layout.num_markers, sizeof(Stat_)));
+    }
+}
+
+template<typename Index_>
+std::uint64_t flat_markers_type_flags() {
+    return (std::is_signed<Index_>::value ? flat_markers_flag_signed_index : 0);
+}
+
+template<typename Index_, typename Stat_>
+FlatMarkersLayout<Index_, Stat_> parse_flat_markers_header(const std::uint64_t* header, const std::size_t file_size) {
+    if (header[0] != flat_markers_magic) {
+        throw std::runtime_error("file does not contain flat markers");
+    }
+    if (header[1] != flat_markers_byte_order) {
+        throw std::runtime_error("flat markers were saved with a different byte order");
+    }
+    if (header[2] != sizeof(Index_) || header[3] != sizeof(Stat_) || (header[4] & flat_markers_flag_signed_index) != flat_markers_type_flags<Index_>()) {
+        throw std::runtime_error("flat markers were saved with different index or statistic types");
+    }
+
+    FlatMarkersLayout<Index_, Stat_> layout;
+    layout.has_stats = (header[4] & flat_markers_flag_stats);
+    layout.num_labels = sanisizer::cast<std::size_t>(header[5]);
+    layout.num_markers = sanisizer::cast<std::size_t>(header[6]);
+    compute_flat_markers_layout(layout);
+    if (layout.end != file_size) {
+        throw std::runtime_error("file size is not consistent with the flat markers header");
+    }
+    return layout;
+}
+
+template<typename Offset_>
+void check_flat_markers_offsets(const Offset_* offsets, const std::size_t num_offsets, const std::size_t num_markers) {
+    if (offsets[0] != 0 || offsets[num_offsets - 1] != num_markers) {
+        throw std::runtime_error("invalid offsets for the flat markers");
+    }
+    for (std::size_t i = 1; i < num_offsets; ++i) {
+        if (offsets[i] < offsets[i - 1]) {
+            throw std::runtime_error("invalid offsets for the flat markers");
+        }
+    }
+}
+
+// 'write(ptr, n)' should append 'n' bytes from 'ptr' to the output.
+template<typename Index_, typename Stat_, class Write_>
+void write_flat_markers(const FlatMarkersView<Index_, Stat_>& markers, Write_ write) {
+    FlatMarkersLayout<Index_, Stat_> layout;
+    layout.num_labels = markers.num_labels;
+    layout.num_markers = markers.total();
+    layout.has_stats = (markers.stats != NULL);
+    compute_flat_markers_layout(layout);
+
+    const std::uint64_t header[flat_markers_header_words] = {
+        flat_markers_magic,
+        flat_markers_byte_order,
+        sizeof(Index_),
+        sizeof(Stat_),
+        (layout.has_stats ? flat_markers_flag_stats : 0) | flat_markers_type_flags<Index_>(),
+        static_cast<std::uint64_t>(layout.num_labels),
+        static_cast<std::uint64_t>(layout.num_markers),
+        0
+    };
+    write(header, sizeof(header));
+
+    for (std::size_t i = 0; i < layout.num_offsets; ++i) {
+        const std::uint64_t current = markers.offsets[i];
+        write(&current, sizeof(current));
+    }
+
+    write(markers.indices, sizeof(Index_) * layout.num_markers); // product is safe as it was checked in compute_flat_markers_layout().
+    const unsigned char padding[sizeof(std::uint64_t)] = { 0 };
+    write(padding, layout.stats_start - layout.indices_start - sizeof(Index_) * layout.num_markers);
+    if (layout.has_stats) {
+        write(markers.stats, sizeof(Stat_) * layout.num_markers);
+    }
+}
+
+// Reading flat markers from an in-memory buffer of 'size' bytes, which need not be aligned.
+template<typename Index_, typename Stat_>
+FlatMarkers<Index_, Stat_> read_flat_markers(const unsigned char* data, const std::size_t size) {
+    std::uint64_t header[flat_markers_header_words];
+    if (size < sizeof(header)) {
+        throw std::runtime_error("buffer does not contain flat markers");
+    }
+    std::memcpy(header, data, sizeof(header));
+    const auto layout = parse_flat_markers_header<Index_, Stat_>(header, size);
+
+    FlatMarkers<Index_, Stat_> output;
+    output.num_labels = layout.num_labels;
+    auto offsets = sanisizer::create<std::vector<std::uint64_t> >(layout.num_offsets);
+    std::memcpy(offsets.data(), data + sizeof(header), sizeof(std::uint64_t) * layout.num_offsets);
+    check_flat_markers_offsets(offsets.data(), layout.num_offsets, layout.num_markers);
+    output.offsets.insert(output.offsets.end(), offsets.begin(), offsets.end());
+
+    sanisizer::resize(output.indices, layout.num_markers);
+    std::memcpy(output.indices.data(), data + layout.indices_start, sizeof(Index_) * layout.num_markers);
+    if (layout.has_stats) {
+        sanisizer::resize(output.stats, layout.num_markers);
+        std::memcpy(output.stats.data(), data + layout.stats_start, sizeof(Stat_) * layout.num_markers);
+    }
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Save flat markers to a binary file.
+ * The file can be loaded with `load_flat_markers()` or memory-mapped with `MappedFlatMarkers`.
+ * Values are stored in native byte order, so the file should only be read on machines with the same endianness and the same `Index_` and `Stat_` types.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param markers View of the markers for all pairwise comparisons.
+ * @param path Path to the output file.
+ */
+template<typename Index_, typename Stat_>
+void save_flat_markers(const FlatMarkersView<Index_, Stat_>& markers, const std::string& path) {
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        throw std::runtime_error("failed to open '" + path + "' for writing flat markers");
+    }
+
+    write_flat_markers(markers, [&](const void* ptr, const std::size_t n) -> void {
+        output.write(static_cast<const char*>(ptr), n);
+    });
+
+    output.close();
+    if (!output) {
+        throw std::runtime_error("failed to write flat markers to '" + path + "'");
+    }
+}
+
+/**
+ * Overload of `save_flat_markers()` for a `FlatMarkers` instance.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param markers Markers for all pairwise comparisons.
+ * @param path Path to the output file.
+ */
+template<typename Index_, typename Stat_>
+void save_flat_markers(const FlatMarkers<Index_, Stat_>& markers, const std::string& path) {
+    save_flat_markers(view_flat_markers(markers), path);
+}
+
+/**
+ * Load flat markers from a file created by `save_flat_markers()`.
+ * The `Index_` and `Stat_` types should be the same as those used to save the file.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param path Path to the file.
+ * @return Flat markers for all pairwise comparisons.
+ */
+template<typename Index_, typename Stat_>
+FlatMarkers<Index_, Stat_> load_flat_markers(const std::string& path) {
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (!input) {
+        throw std::runtime_error("failed to open '" + path + "' for reading flat markers");
+    }
+    const auto file_size = sanisizer::cast<std::size_t>(static_cast<std::streamoff>(input.tellg()));
+    input.seekg(0);
+
+    std::uint64_t header[flat_markers_header_words];
+    if (file_size < sizeof(header) || !input.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        throw std::runtime_error("file does not contain flat markers");
+    }
+    const auto layout = parse_flat_markers_header<Index_, Stat_>(header, file_size);
+
+    FlatMarkers<Index_, Stat_> output;
+    output.num_labels = layout.num_labels;
+    auto offsets = sanisizer::create<std::vector<std::uint64_t> >(layout.num_offsets);
+    input.read(reinterpret_cast<char*>(offsets.data()), sizeof(std::uint64_t) * layout.num_offsets);
+    check_flat_markers_offsets(offsets.data(), layout.num_offsets, layout.num_markers);
+    output.offsets.insert(output.offsets.end(), offsets.begin(), offsets.end());
+
+    output.indices.resize(layout.num_markers);
+    input.read(reinterpret_cast<char*>(output.indices.data()), sizeof(Index_) * layout.num_markers);
+    if (layout.has_stats) {
+        input.seekg(layout.stats_start);
+        output.stats.resize(layout.num_markers);
+        input.read(reinterpret_cast<char*>(output.stats.data()), sizeof(Stat_) * layout.num_markers);
+    }
+
+    if (!input) {
+        throw std::runtime_error("failed to read flat markers from '" + path + "'");
+    }
+    return output;
+}
+
+/**
+ * @brief Flat markers that are memory-mapped from a file.
+ *
+ * This provides a view of a file created by `save_flat_markers()`, so that the markers can be used immediately without loading the entire file.
+ * Only the offsets are copied into memory; the indices and statistics are accessed directly from the mapping.
+ * On platforms without `mmap()`, the file is read into memory instead.
+ * The `Index_` and `Stat_` types should be the same as those used to save the file.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+class MappedFlatMarkers {
+public:
+    /**
+     * @param path Path to the file.
+     */
+    MappedFlatMarkers(const std::string& path) {
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open '" + path + "' for reading flat markers");
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("failed to query the size of '" + path + "'");
+        }
+        my_size = sanisizer::cast<std::size_t>(info.st_size);
+
+        if (my_size >= flat_markers_header_words * sizeof(std::uint64_t)) {
+            void* ptr = ::mmap(NULL, my_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("failed to memory-map '" + path + "'");
+            }
+            my_mapped = ptr;
+        }
+        ::close(fd); // the mapping remains valid after closing the file descriptor.
+
+        if (my_mapped == NULL) {
+            throw std::runtime_error("file does not contain flat markers");
+        }
+        const auto base = static_cast<const std::uint64_t*>(my_mapped);
+#else
+        std::ifstream input(path, std::ios::binary | std::ios::ate);
+        if (!input) {
+            throw std::runtime_error("failed to open '" + path + "' for reading flat markers");
+        }
+        my_size = sanisizer::cast<std::size_t>(static_cast<std::streamoff>(input.tellg()));
+        input.seekg(0);
+        if (my_size < flat_markers_header_words * sizeof(std::uint64_t)) {
+            throw std::runtime_error("file does not contain flat markers");
+        }
+        my_buffer.resize(my_size / sizeof(std::uint64_t) + 1);
+        input.read(reinterpret_cast<char*>(my_buffer.data()), my_size);
+        const auto base = my_buffer.data();
+#endif
+
+        try {
+            initialize(base);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    /**
+     * @cond
+     */
+    MappedFlatMarkers(const MappedFlatMarkers&) = delete;
+    MappedFlatMarkers& operator=(const MappedFlatMarkers&) = delete;
+
+    ~MappedFlatMarkers() {
+        release();
+    }
+    /**
+     * @endcond
+     */
+
+private:
+    std::size_t my_size = 0;
+    void* my_mapped = NULL;
+    std::vector<std::uint64_t> my_buffer;
+    std::vector<std::size_t> my_offsets; // copied out of the file to avoid aliasing 'std::uint64_t' as 'std::size_t'.
+    FlatMarkersView<Index_, Stat_> my_view;
+
+    void initialize(const std::uint64_t* base) {
+        const auto layout = parse_flat_markers_header<Index_, Stat_>(base, my_size);
+        const auto bytes = reinterpret_cast<const unsigned char*>(base);
+        const auto offsets = base + flat_markers_header_words;
+        check_flat_markers_offsets(offsets, layout.num_offsets, layout.num_markers);
+
+        my_view.num_labels = layout.num_labels;
+        my_offsets.insert(my_offsets.end(), offsets, offsets + layout.num_offsets);
+        my_view.offsets = my_offsets.data();
+        my_view.indices = reinterpret_cast<const Index_*>(bytes + layout.indices_start);
+        if (layout.has_stats) {
+            my_view.stats = reinterpret_cast<const Stat_*>(bytes + layout.stats_start);
+        }
+    }
+
+    void release() {
+#ifndef _WIN32
+        if (my_mapped) {
+            ::munmap(my_mapped, my_size);
+            my_mapped = NULL;
+        }
+#endif
+    }
+
+public:
+    /**
+     * @return View of the markers for all pairwise comparisons.
+     * This remains valid for the lifetime of this object.
+     */
+    const FlatMarkersView<Index_, Stat_>& view() const {
+        return my_view;
+    }
+};
+
+}
+
+#endif
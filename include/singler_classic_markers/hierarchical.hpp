@@ -0,0 +1,333 @@
+#ifndef SINGLER_CLASSIC_MARKERS_HIERARCHICAL_HPP
+#define SINGLER_CLASSIC_MARKERS_HIERARCHICAL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "quickstats/quickstats.hpp"
+
+#include "queue.hpp"
+#include "scan.hpp"
+#include "statistics.hpp"
+#include "number.hpp"
+#include "choose.hpp"
+
+/**
+ * @file hierarchical.hpp
+ * @brief Choose markers between siblings in a tree of labels.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Markers for the comparisons between siblings in a tree of labels.
+ *
+ * @tparam Markers_ Class of the markers for each group of siblings, e.g., the return type of `choose()` or `choose_index()`.
+ */
+template<class Markers_>
+struct HierarchicalMarkers {
+    /**
+     * Children of each node in the tree, sorted in increasing order.
+     * This has length equal to the number of nodes plus 1, where the last entry contains the root nodes.
+     */
+    std::vector<std::vector<std::size_t> > children;
+
+    /**
+     * Markers for the comparisons between the children of each node, with the same length as `children`.
+     * For node `p`, `markers[p][i][j]` contains the top markers for `children[p][i]` over `children[p][j]`.
+     */
+    std::vector<Markers_> markers;
+};
+
+/**
+ * @cond
+ */
+// Each group of siblings is stored as the children of its parent, with the roots stored at the end.
+// 'order' contains all non-label nodes such that each node comes after its children, so that their values can be computed in a single pass.
+struct LabelTree {
+    std::vector<std::vector<std::size_t> > children;
+    std::vector<std::size_t> order;
+    std::vector<std::size_t> nonempty;
+};
+
+inline LabelTree build_label_tree(const std::vector<std::optional<std::size_t> >& parents, const std::size_t num_labels) {
+    const auto num_nodes = parents.size();
+    if (num_nodes < num_labels) {
+        throw std::runtime_error("tree should contain a node for each label");
+    }
+
+    LabelTree tree;
+    tree.children = sanisizer::create<std::vector<std::vector<std::size_t> > >(sanisizer::sum<std::size_t>(num_nodes, 1));
+    for (I<decltype(num_nodes)> n = 0; n < num_nodes; ++n) {
+        const auto& par = parents[n];
+        if (!par.has_value()) {
+            tree.children[num_nodes].push_back(n);
+        } else if (*par >= num_nodes) {
+            throw std::runtime_error("parent of each node should be less than the number of nodes");
+        } else if (*par < num_labels) {
+            // Otherwise, the children of a label would be compared to each other but their values would not contribute to the label's value.
+            throw std::runtime_error("labels should not have any children in the tree");
+        } else {
+            tree.children[*par].push_back(n);
+        }
+    }
+
+    // Kahn's algorithm, starting from the leaves and moving up to the roots.
+    // Any node that is never reached must be part of a cycle.
+    auto pending = sanisizer::create<std::vector<std::size_t> >(num_nodes);
+    std::vector<std::size_t> queue;
+    for (I<decltype(num_nodes)> n = 0; n < num_nodes; ++n) {
+        pending[n] = tree.children[n].size();
+        if (pending[n] == 0) {
+            queue.push_back(n);
+        }
+    }
+
+    I<decltype(num_nodes)> num_processed = 0;
+    while (num_processed < queue.size()) {
+        const auto current = queue[num_processed];
+        ++num_processed;
+        if (current >= num_labels) {
+            tree.order.push_back(current);
+        }
+        const auto& par = parents[current];
+        if (par.has_value()) {
+            auto& remaining = pending[*par];
+            --remaining;
+            if (remaining == 0) {
+                queue.push_back(*par);
+            }
+        }
+    }
+    if (num_processed != num_nodes) {
+        throw std::runtime_error("tree should not contain any cycles");
+    }
+
+    for (I<decltype(tree.children.size())> p = 0, end = tree.children.size(); p < end; ++p) {
+        if (!tree.children[p].empty()) {
+            tree.nonempty.push_back(p);
+        }
+    }
+    return tree;
+}
+
+template<typename Stat_, typename Index_>
+struct HierarchicalWorkspace {
+    std::vector<PairwiseTopQueues<Stat_, Index_> > queues;
+    std::vector<Stat_> values;
+    std::vector<Stat_> siblings;
+    std::vector<Stat_> buffer;
+};
+
+// The value of each label is its median, while the value of each other node is the median of its children's values.
+// This weights each child equally, regardless of the number of samples or labels underneath it.
+template<typename Stat_, typename Index_>
+void add_sibling_differences(const Index_ r, const Stat_* medians, const std::size_t num_labels, const LabelTree& tree, HierarchicalWorkspace<Stat_, Index_>& work) {
+    auto& values = work.values;
+    std::copy_n(medians, num_labels, values.begin());
+    for (const auto n : tree.order) {
+        work.buffer.clear();
+        for (const auto c : tree.children[n]) {
+            const auto val = values[c];
+            if (!std::isnan(val)) {
+                work.buffer.push_back(val);
+            }
+        }
+        values[n] = quickstats::median<Stat_>(work.buffer.size(), work.buffer.data());
+    }
+
+    for (const auto p : tree.nonempty) {
+        const auto& children = tree.children[p];
+        const auto nchildren = children.size();
+        for (I<decltype(nchildren)> c = 0; c < nchildren; ++c) {
+            work.siblings[c] = values[children[c]];
+        }
+        add_pairwise_differences(r, work.siblings.data(), nchildren, work.queues[p]);
+    }
+}
+
+template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Label_>
+HierarchicalMarkers<Markers<include_stat_, Index_, Stat_> > choose_hierarchical_raw(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const std::vector<std::optional<std::size_t> >& parents,
+    const ChooseOptions& options
+) {
+    const auto NC = matrix.ncol();
+    auto group_sizes = tatami_stats::tabulate_groups(label, NC);
+    const auto num_labels = group_sizes.size();
+    auto tree = build_label_tree(parents, num_labels);
+    const auto num_nodes = parents.size();
+    const auto num_sets = tree.children.size();
+
+    // A node is only present if it has at least one sample underneath it, otherwise its value is always NaN.
+    auto present = sanisizer::create<std::vector<unsigned char> >(num_nodes);
+    for (I<decltype(num_labels)> l = 0; l < num_labels; ++l) {
+        present[l] = (group_sizes[l] > 0);
+    }
+    for (const auto n : tree.order) {
+        for (const auto c : tree.children[n]) {
+            present[n] |= present[c];
+        }
+    }
+
+    std::size_t max_children = 0;
+    auto num_keep = sanisizer::create<std::vector<Index_> >(num_sets);
+    for (I<decltype(num_sets)> p = 0; p < num_sets; ++p) {
+        const auto nchildren = tree.children[p].size();
+        max_children = std::max(max_children, nchildren);
+        num_keep[p] = get_num_keep<Index_>(nchildren, options.number);
+    }
+
+    typedef HierarchicalWorkspace<Stat_, Index_> Workspace;
+    auto pqueues = sanisizer::create<std::vector<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > > >(
+        num_sets,
+        sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads)
+    );
+
+    initialize_statistics(options.statistics, options.num_threads);
+    const auto num_used = scan_matrix<Stat_>(
+        matrix,
+        sanisizer::cast<std::size_t>(num_labels),
+        label,
+        group_sizes,
+
+        /* setup = */ [&]() -> Workspace {
+            Workspace work;
+            work.queues.reserve(num_sets);
+            for (I<decltype(num_sets)> p = 0; p < num_sets; ++p) {
+                const auto& children = tree.children[p];
+                auto& curqueues = work.queues.emplace_back(num_keep[p], children.size(), options.keep_ties);
+                std::vector<unsigned char> child_present;
+                child_present.reserve(children.size());
+                for (const auto c : children) {
+                    child_present.push_back(present[c]);
+                }
+                exclude_missing_labels_from_bound(child_present, curqueues);
+                if (options.statistics) {
+                    curqueues.enable_counting();
+                }
+            }
+            sanisizer::resize(work.values, num_nodes);
+            sanisizer::resize(work.siblings, max_children);
+            work.buffer.reserve(max_children);
+            return work;
+        },
+
+        /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, Workspace& work) -> void {
+            add_sibling_differences(r, medians.data(), num_labels, tree, work);
+        },
+
+        /* finalize = */ [&](const int t, Workspace& work) -> void {
+            for (I<decltype(num_sets)> p = 0; p < num_sets; ++p) {
+                if (options.statistics) {
+                    work.queues[p].transfer_counts(options.statistics->threads[t]);
+                }
+                pqueues[p][t] = std::move(work.queues[p]);
+            }
+        },
+
+        create_scan_options(options)
+    );
+
+    finalize_statistics(options.statistics, num_used);
+    HierarchicalMarkers<Markers<include_stat_, Index_, Stat_> > output;
+    output.markers = sanisizer::create<std::vector<Markers<include_stat_, Index_, Stat_> > >(num_sets);
+    time_merge(options.statistics, [&]() -> void {
+        for (I<decltype(num_sets)> p = 0; p < num_sets; ++p) {
+            pqueues[p].resize(num_used);
+            report_best_top_queues<include_stat_>(pqueues[p], tree.children[p].size(), output.markers[p], options.num_threads);
+        }
+    });
+    output.children = std::move(tree.children);
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Choose markers for a tree of labels, where comparisons are only performed between siblings.
+ * This is useful for references with hierarchical labels, e.g., from an ontology, where a classifier only needs to distinguish between the children of each node.
+ *
+ * The tree contains \f$N \ge L\f$ nodes where the first \f$L\f$ nodes correspond to the labels.
+ * For each gene, the value of each label's node is defined as its median across samples, as described in `choose()`.
+ * The value of each other node is defined as the median of its children's values, so that each child is weighted equally.
+ * For each group of siblings, the markers for node \f$A\f$ over node \f$B\f$ are defined as the top genes with the largest positive differences in \f$A\f$'s value over \f$B\f$'s.
+ * Nodes without a parent are treated as siblings of each other.
+ *
+ * The work per gene scales with the sum of the squared number of children for each node, rather than \f$L^2\f$ for `choose()`.
+ * This is much cheaper for references with many labels that are organized into a tree with small fan-out.
+ *
+ * @tparam Stat_ Floating-point type of the differences between values.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param parents Vector of length \f$N\f$, containing the parent of each node in the tree.
+ * This should be empty for nodes without a parent.
+ * All parents should be less than \f$N\f$ and the tree should not contain any cycles.
+ * Labels should be leaves of the tree, i.e., all parents should be no less than \f$L\f$.
+ * @param options Further options.
+ * If `ChooseOptions::number` is not set, the number of markers for each group of siblings is determined from the number of siblings, see `default_number()`.
+ *
+ * @return Top markers for each comparison between siblings.
+ * Each marker is represented by a pair containing the row index in `matrix` and the difference between values.
+ * Each innermost vector is sorted by the differences between values.
+ * All differences are guaranteed to be positive.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+HierarchicalMarkers<std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > > choose_hierarchical(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const std::vector<std::optional<std::size_t> >& parents,
+    const ChooseOptions& options
+) {
+    return choose_hierarchical_raw<true, Stat_>(matrix, label, parents, options);
+}
+
+/**
+ * Variant of `choose_hierarchical()` that only reports the indices of the top markers for each comparison between siblings.
+ * The markers for each group of siblings can be used directly in **singlepp** functions, e.g., to train a classifier at each node of the tree.
+ *
+ * @tparam Stat_ Floating-point type of the differences between values.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param parents Vector containing the parent of each node in the tree, see `choose_hierarchical()`.
+ * @param options Further options.
+ *
+ * @return Top markers for each comparison between siblings.
+ * This is the same as the output for `choose_hierarchical()` except that only the row index is reported in the innermost vector.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+HierarchicalMarkers<std::vector<std::vector<std::vector<Index_> > > > choose_hierarchical_index(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const std::vector<std::optional<std::size_t> >& parents,
+    const ChooseOptions& options
+) {
+    return choose_hierarchical_raw<false, Stat_>(matrix, label, parents, options);
+}
+
+}
+
+#endif
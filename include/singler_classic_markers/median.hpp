@@ -0,0 +1,126 @@
+#ifndef SINGLER_CLASSIC_MARKERS_MEDIAN_HPP
+#define SINGLER_CLASSIC_MARKERS_MEDIAN_HPP
+
+#include <vector>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+#include "quickstats/quickstats.hpp"
+
+namespace singler_classic_markers {
+
+template<typename Value_>
+constexpr bool use_counting_median = std::is_integral<Value_>::value && !std::is_same<Value_, bool>::value;
+
+// Casting back to the unsigned type is necessary to wrap around correctly after integer promotion of small types.
+template<typename Value_>
+typename std::make_unsigned<Value_>::type integer_offset(const Value_ value, const Value_ min) {
+    typedef typename std::make_unsigned<Value_>::type Unsigned;
+    return static_cast<Unsigned>(static_cast<Unsigned>(value) - static_cast<Unsigned>(min));
+}
+
+template<typename Unsigned_, typename Index_>
+bool is_small_range(const Unsigned_ delta, const Index_ n) { // assumes that n > 0.
+    return delta < static_cast<typename std::make_unsigned<Index_>::type>(n);
+}
+
+// Walking through the histogram to find the 'half'-th smallest value and its predecessor in the sorted order.
+// This is equivalent to the median computed by quickstats::median(), i.e., the average of the two middle values for an even number of observations.
+template<typename Stat_, typename Index_, typename Value_>
+Stat_ histogram_median(const Index_ n, const Value_ min, const std::vector<Index_>& histogram, const std::size_t range) {
+    const Index_ half = n / 2;
+    const bool even = (n % 2 == 0);
+
+    Index_ cumulative = 0;
+    std::size_t lower = 0;
+    bool found_lower = false;
+    for (std::size_t h = 0; h < range; ++h) {
+        const auto count = histogram[h];
+        if (count == 0) {
+            continue;
+        }
+        cumulative += count;
+
+        if (even && !found_lower && cumulative >= half) {
+            lower = h;
+            found_lower = true;
+        }
+        if (cumulative > half) {
+            const Stat_ mid = static_cast<Stat_>(min) + static_cast<Stat_>(h);
+            if (!even) {
+                return mid;
+            }
+            const Stat_ other = static_cast<Stat_>(min) + static_cast<Stat_>(lower);
+            return (mid + other) / 2;
+        }
+    }
+
+    return std::numeric_limits<Stat_>::quiet_NaN(); // should be unreachable.
+}
+
+// Median of 'n' values, using a counting histogram for integer values that fall within a small range.
+// We only use the histogram if the range of values is less than the number of observations,
+// which ensures that the counting is no slower than the selection and that the histogram is no larger than the workspace.
+// 'histogram' should be all-zero on input and is restored to all-zero on output.
+template<typename Stat_, typename Index_, typename Value_>
+Stat_ compute_median(const Index_ n, Value_* ptr, std::vector<Index_>& histogram) {
+    if constexpr(use_counting_median<Value_>) {
+        if (n > 0) {
+            const auto mm = std::minmax_element(ptr, ptr + n);
+            const Value_ min = *(mm.first);
+            const auto delta = integer_offset(*(mm.second), min); // well-defined even if the signed difference would overflow.
+
+            if (is_small_range(delta, n)) {
+                const std::size_t range = static_cast<std::size_t>(delta) + 1; // no overflow as delta < n.
+                if (histogram.size() < range) {
+                    histogram.resize(range);
+                }
+                for (Index_ i = 0; i < n; ++i) {
+                    ++histogram[integer_offset(ptr[i], min)];
+                }
+
+                const auto output = histogram_median<Stat_>(n, min, histogram, range);
+                std::fill_n(histogram.begin(), range, 0);
+                return output;
+            }
+        }
+    }
+
+    return quickstats::median<Stat_, Index_, Value_>(n, ptr);
+}
+
+// Same as above but for sparse data, where 'ptr' only contains the 'nnz' non-zero values out of 'total' observations.
+template<typename Stat_, typename Index_, typename Value_>
+Stat_ compute_median(const Index_ total, const Index_ nnz, Value_* ptr, std::vector<Index_>& histogram) {
+    if constexpr(use_counting_median<Value_>) {
+        if (nnz > 0 && nnz >= total - nnz) { // otherwise, the median is trivially zero (or NaN for empty groups), so we let quickstats handle it.
+            const auto mm = std::minmax_element(ptr, ptr + nnz);
+            const Value_ min = std::min<Value_>(*(mm.first), 0);
+            const Value_ max = std::max<Value_>(*(mm.second), 0);
+            const auto delta = integer_offset(max, min);
+
+            if (is_small_range(delta, total)) {
+                const std::size_t range = static_cast<std::size_t>(delta) + 1;
+                if (histogram.size() < range) {
+                    histogram.resize(range);
+                }
+                for (Index_ i = 0; i < nnz; ++i) {
+                    ++histogram[integer_offset(ptr[i], min)];
+                }
+                histogram[integer_offset<Value_>(0, min)] += total - nnz;
+
+                const auto output = histogram_median<Stat_>(total, min, histogram, range);
+                std::fill_n(histogram.begin(), range, 0);
+                return output;
+            }
+        }
+    }
+
+    return quickstats::median<Stat_, Index_, Value_>(total, nnz, ptr);
+}
+
+}
+
+#endif
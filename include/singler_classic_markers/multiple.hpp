@@ -0,0 +1,292 @@
+#ifndef SINGLER_CLASSIC_MARKERS_MULTIPLE_HPP
+#define SINGLER_CLASSIC_MARKERS_MULTIPLE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "queue.hpp"
+#include "scan.hpp"
+#include "statistics.hpp"
+#include "number.hpp"
+#include "choose.hpp"
+#include "blocked.hpp"
+
+/**
+ * @file multiple.hpp
+ * @brief Choose markers for multiple label schemes in a single pass.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @cond
+ */
+// Each scheme has its own range of combos, so that the medians for all schemes can be computed in a single pass over the matrix.
+// For scheme 's', the combos are stored from 'combo_starts[s]' to 'combo_starts[s + 1]'.
+template<bool blocked_, typename Index_, typename Label_, typename Block_>
+std::vector<std::vector<std::size_t> > create_multiple_combinations(
+    const Index_ NC,
+    const std::vector<const Label_*>& labels,
+    const Block_* block,
+    const std::size_t nblocks,
+    std::vector<std::size_t>& ngroups,
+    std::vector<std::size_t>& combo_starts,
+    std::vector<Index_>& combo_sizes
+) {
+    const auto nschemes = labels.size();
+    std::vector<std::vector<std::size_t> > combinations;
+    combinations.reserve(nschemes);
+    ngroups.clear();
+    combo_starts.clear();
+    combo_starts.push_back(0);
+    combo_sizes.clear();
+
+    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+        const auto label = labels[s];
+        const std::size_t curgroups = tatami_stats::total_groups(label, NC);
+        ngroups.push_back(curgroups);
+
+        std::vector<Index_> cursizes;
+        if constexpr(blocked_) {
+            combinations.push_back(create_blocked_combinations(NC, label, block, curgroups, nblocks, cursizes));
+        } else {
+            auto& current = combinations.emplace_back(sanisizer::create<std::vector<std::size_t> >(NC));
+            std::copy_n(label, NC, current.begin());
+            cursizes = tatami_stats::tabulate_groups(label, NC);
+        }
+
+        const auto start = combo_starts.back();
+        if (start) {
+            for (auto& c : combinations.back()) {
+                c += start;
+            }
+        }
+        combo_sizes.insert(combo_sizes.end(), cursizes.begin(), cursizes.end());
+        combo_starts.push_back(sanisizer::sum<std::size_t>(start, cursizes.size()));
+    }
+
+    return combinations;
+}
+
+template<bool include_stat_, bool blocked_, typename Stat_, typename Value_, typename Index_, typename Label_, typename Block_, class Options_>
+std::vector<Markers<include_stat_, Index_, Stat_> > choose_multiple_raw(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::vector<const Label_*>& labels,
+    const Block_* block,
+    const Options_& options
+) {
+    const auto NC = matrix.ncol();
+    const auto nschemes = labels.size();
+    std::size_t nblocks = 1;
+    if constexpr(blocked_) {
+        nblocks = tatami_stats::total_groups(block, NC);
+    }
+
+    std::vector<std::size_t> ngroups, combo_starts;
+    std::vector<Index_> combo_sizes;
+    const auto combinations = create_multiple_combinations<blocked_>(NC, labels, block, nblocks, ngroups, combo_starts, combo_sizes);
+
+    std::vector<const std::size_t*> combo_ptrs;
+    combo_ptrs.reserve(nschemes);
+    std::vector<Index_> num_keep;
+    num_keep.reserve(nschemes);
+    std::vector<SharedBlocks> shared;
+    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+        combo_ptrs.push_back(combinations[s].data());
+        num_keep.push_back(get_num_keep<Index_>(ngroups[s], options.number));
+        if constexpr(blocked_) {
+            const std::vector<Index_> cursizes(combo_sizes.begin() + combo_starts[s], combo_sizes.begin() + combo_starts[s + 1]);
+            shared.push_back(create_shared_blocks(ngroups[s], nblocks, cursizes));
+        }
+    }
+
+    typedef std::vector<PairwiseTopQueues<Stat_, Index_> > SchemeQueues;
+    auto pqueues = sanisizer::create<std::vector<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > > >(
+        nschemes,
+        sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(options.num_threads)
+    );
+
+    initialize_statistics(options.statistics, options.num_threads);
+    const auto num_used = scan_matrix<Stat_>(
+        matrix,
+        combo_sizes.size(),
+        combo_ptrs,
+        combo_sizes,
+
+        /* setup = */ [&]() -> SchemeQueues {
+            SchemeQueues curqueues;
+            curqueues.reserve(nschemes);
+            for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                curqueues.emplace_back(num_keep[s], ngroups[s], options.keep_ties);
+                if constexpr(!blocked_) {
+                    const std::vector<Index_> cursizes(combo_sizes.begin() + combo_starts[s], combo_sizes.begin() + combo_starts[s + 1]);
+                    exclude_missing_labels_from_bound(cursizes, curqueues.back());
+                }
+                if (options.statistics) {
+                    curqueues.back().enable_counting();
+                }
+            }
+            return curqueues;
+        },
+
+        /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, SchemeQueues& curqueues) -> void {
+            for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                const auto ptr = medians.data() + combo_starts[s];
+                if constexpr(blocked_) {
+                    add_shared_blocked_differences(r, ptr, ngroups[s], nblocks, shared[s], options.use_minimum, curqueues[s]);
+                } else {
+                    add_pairwise_differences(r, ptr, ngroups[s], curqueues[s]);
+                }
+            }
+        },
+
+        /* finalize = */ [&](const int t, SchemeQueues& curqueues) -> void {
+            for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                if (options.statistics) {
+                    curqueues[s].transfer_counts(options.statistics->threads[t]);
+                }
+                pqueues[s][t] = std::move(curqueues[s]);
+            }
+        },
+
+        create_scan_options(options)
+    );
+
+    finalize_statistics(options.statistics, num_used);
+    auto output = sanisizer::create<std::vector<Markers<include_stat_, Index_, Stat_> > >(nschemes);
+    time_merge(options.statistics, [&]() -> void {
+        for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+            pqueues[s].resize(num_used);
+            report_best_top_queues<include_stat_>(pqueues[s], ngroups[s], output[s], options.num_threads);
+        }
+    });
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Variant of `choose()` for multiple label schemes on the same reference, e.g., broad and fine labels.
+ * This computes the medians for all schemes in a single pass over `matrix`, which avoids repeated extraction of the same rows.
+ * The results for each scheme are the same as those from calling `choose()` separately.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param labels Vector of pointers, one per scheme.
+ * Each pointer should refer to an array of length equal to the number of columns in `matrix`, containing the label for each column under that scheme.
+ * Values should lie in \f$[0, L_s)\f$ for \f$L_s\f$ unique labels in scheme \f$s\f$.
+ * @param options Further options.
+ *
+ * @return Vector of length equal to `labels.size()`, containing the top markers for each scheme.
+ * Each entry has the same structure as the return value of `choose()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+std::vector<std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > > choose_multiple(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::vector<const Label_*>& labels,
+    const ChooseOptions& options
+) {
+    return choose_multiple_raw<true, false, Stat_>(matrix, labels, static_cast<const int*>(NULL), options);
+}
+
+/**
+ * Variant of `choose_multiple()` that only reports the indices of the top markers for each pairwise comparison in each scheme.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param labels Vector of pointers to the labels for each scheme, see `choose_multiple()`.
+ * @param options Further options.
+ *
+ * @return Vector of length equal to `labels.size()`, containing the top markers for each scheme.
+ * Each entry has the same structure as the return value of `choose_index()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+std::vector<std::vector<std::vector<std::vector<Index_> > > > choose_index_multiple(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::vector<const Label_*>& labels,
+    const ChooseOptions& options
+) {
+    return choose_multiple_raw<false, false, Stat_>(matrix, labels, static_cast<const int*>(NULL), options);
+}
+
+/**
+ * Variant of `choose_blocked()` for multiple label schemes on the same reference, see `choose_multiple()` for details.
+ * The same blocking factor is used for all schemes.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param labels Vector of pointers to the labels for each scheme, see `choose_multiple()`.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ *
+ * @return Vector of length equal to `labels.size()`, containing the top markers for each scheme.
+ * Each entry has the same structure as the return value of `choose_blocked()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+std::vector<std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > > choose_blocked_multiple(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::vector<const Label_*>& labels,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return choose_multiple_raw<true, true, Stat_>(matrix, labels, block, options);
+}
+
+/**
+ * Variant of `choose_blocked_multiple()` that only reports the indices of the top markers for each pairwise comparison in each scheme.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param labels Vector of pointers to the labels for each scheme, see `choose_multiple()`.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ *
+ * @return Vector of length equal to `labels.size()`, containing the top markers for each scheme.
+ * Each entry has the same structure as the return value of `choose_blocked_index()`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+std::vector<std::vector<std::vector<std::vector<Index_> > > > choose_blocked_index_multiple(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::vector<const Label_*>& labels,
+    const Block_* block,
+    const ChooseBlockedOptions& options
+) {
+    return choose_multiple_raw<false, true, Stat_>(matrix, labels, block, options);
+}
+
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef SINGLER_CLASSIC_MARKERS_ONE_VS_REST_HPP
+#define SINGLER_CLASSIC_MARKERS_ONE_VS_REST_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <type_traits>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "queue.hpp"
+#include "scan.hpp"
+#include "statistics.hpp"
+#include "number.hpp"
+#include "choose.hpp"
+
+/**
+ * @file one_vs_rest.hpp
+ * @brief Choose markers by comparing each label to the rest.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @cond
+ */
+// Computes the median of the other labels' medians for each label, ignoring NaNs from empty labels.
+// Removing one value from a sorted sequence only shifts the middle by at most one position,
+// so we only need the order statistics around the middle, which can be obtained in O(L) time without a full sort.
+// For tied values, it doesn't matter which copy is removed as the remaining values are the same.
+template<typename Stat_>
+void compute_rest_medians(const Stat_* medians, const std::size_t ngroups, std::vector<Stat_>& buffer, Stat_* output) {
+    buffer.clear();
+    for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+        if (!std::isnan(medians[g])) {
+            buffer.push_back(medians[g]);
+        }
+    }
+
+    const auto num_present = buffer.size();
+    if (num_present < 2) {
+        std::fill_n(output, ngroups, std::numeric_limits<Stat_>::quiet_NaN());
+        return;
+    }
+
+    const auto bstart = buffer.begin();
+    if (num_present % 2 == 0) {
+        // An odd number of values remain, so the median of the rest is the value at 'mid' if the removed value was after it, and the next value otherwise.
+        const auto mid = num_present / 2 - 1;
+        std::nth_element(bstart, bstart + mid, buffer.end());
+        const auto at_mid = buffer[mid];
+        const auto after_mid = *std::min_element(bstart + mid + 1, buffer.end());
+        for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+            const auto val = medians[g];
+            if (std::isnan(val)) {
+                output[g] = val;
+            } else {
+                output[g] = (val <= at_mid ? after_mid : at_mid);
+            }
+        }
+
+    } else {
+        // An even number of values remain, so the median of the rest is the average of two values around 'mid', depending on where the removed value was.
+        const auto mid = num_present / 2;
+        std::nth_element(bstart, bstart + mid, buffer.end());
+        const auto at_mid = buffer[mid];
+        const auto before_mid = *std::max_element(bstart, bstart + mid);
+        const auto after_mid = *std::min_element(bstart + mid + 1, buffer.end());
+        for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+            const auto val = medians[g];
+            if (std::isnan(val)) {
+                output[g] = val;
+            } else if (val < at_mid) {
+                output[g] = (at_mid + after_mid) / 2;
+            } else if (val == at_mid) {
+                output[g] = (before_mid + after_mid) / 2;
+            } else {
+                output[g] = (before_mid + at_mid) / 2;
+            }
+        }
+    }
+}
+
+template<bool include_stat_, typename Index_, typename Stat_>
+using OneVsRestMarkers = std::vector<std::vector<typename std::conditional<include_stat_, std::pair<Index_, Stat_>, Index_>::type> >;
+
+template<typename Stat_, typename Index_>
+struct OneVsRestWorkspace {
+    OneVsRestWorkspace(const Index_ num_keep, const std::size_t ngroups, const bool keep_ties) : queues(num_keep, ngroups, keep_ties) {
+        buffer.reserve(ngroups);
+    }
+    TopBufferSet<Stat_, Index_> queues;
+    std::vector<Stat_> buffer;
+};
+
+template<typename Stat_, typename Index_>
+void add_one_vs_rest_differences(const Index_ r, const Stat_* medians, const std::size_t ngroups, OneVsRestWorkspace<Stat_, Index_>& work) {
+    auto& curqueues = work.queues;
+
+    // Same pruning as in add_pairwise_differences(), as the median of the rest always lies within the range of the medians.
+    Stat_ lower = std::numeric_limits<Stat_>::infinity(), upper = -lower;
+    std::size_t num_missing = 0;
+    for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+        const auto val = medians[g];
+        if (std::isnan(val)) {
+            ++num_missing;
+        } else {
+            lower = std::min(lower, val);
+            upper = std::max(upper, val);
+        }
+    }
+    if (!(upper - lower >= curqueues.min_threshold())) { // also catches the case where there are fewer than two non-NaN medians.
+        curqueues.skip_candidates(ngroups - num_missing < 2 ? ngroups : num_missing);
+        return;
+    }
+
+    auto candidates = curqueues.candidates();
+    compute_rest_medians(medians, ngroups, work.buffer, candidates);
+    for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+        candidates[g] = medians[g] - candidates[g];
+    }
+    curqueues.add_candidates(r);
+}
+
+template<bool include_stat_, typename Stat_, typename Value_, typename Index_, typename Label_>
+OneVsRestMarkers<include_stat_, Index_, Stat_> choose_one_vs_rest_raw(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options
+) {
+    const auto NC = matrix.ncol();
+    auto group_sizes = tatami_stats::tabulate_groups(label, NC);
+    const auto ngroups = group_sizes.size();
+
+    const auto num_keep = get_num_keep<Index_>(ngroups, options.number);
+    auto pqueues = sanisizer::create<std::vector<std::optional<TopBufferSet<Stat_, Index_> > > >(options.num_threads);
+
+    initialize_statistics(options.statistics, options.num_threads);
+    const auto num_used = scan_matrix<Stat_>(
+        matrix,
+        sanisizer::cast<std::size_t>(ngroups),
+        label,
+        group_sizes,
+
+        /* setup = */ [&]() -> OneVsRestWorkspace<Stat_, Index_> {
+            OneVsRestWorkspace<Stat_, Index_> work(num_keep, ngroups, options.keep_ties);
+            for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+                if (group_sizes[g] == 0) {
+                    work.queues.exclude_from_bound(g);
+                }
+            }
+            if (options.statistics) {
+                work.queues.enable_counting();
+            }
+            return work;
+        },
+
+        /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, OneVsRestWorkspace<Stat_, Index_>& work) -> void {
+            add_one_vs_rest_differences(r, medians.data(), ngroups, work);
+        },
+
+        /* finalize = */ [&](const int t, OneVsRestWorkspace<Stat_, Index_>& work) -> void {
+            if (options.statistics) {
+                work.queues.transfer_counts(options.statistics->threads[t]);
+            }
+            pqueues[t] = std::move(work.queues);
+        },
+
+        create_scan_options(options)
+    );
+
+    pqueues.resize(num_used);
+    finalize_statistics(options.statistics, num_used);
+    auto output = sanisizer::create<OneVsRestMarkers<include_stat_, Index_, Stat_> >(ngroups);
+    time_merge(options.statistics, [&]() -> void {
+        if (num_used == 0) {
+            return;
+        }
+        tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+            for (std::size_t g = start, end = start + length; g < end; ++g) {
+                copy_top_entries<include_stat_>(merge_top_buffers(pqueues, g), output[g]);
+            }
+        }, ngroups, options.num_threads);
+    });
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Choose markers for each label by comparing it to the rest of the labels.
+ * For each gene, we compute the median of each label as described in `choose()`,
+ * and then we compute the difference between the median for label \f$A\f$ and the median of the medians for all other labels.
+ * The top genes with the largest positive differences are used as the markers for \f$A\f$.
+ * Each label is weighted equally in the median of the rest, regardless of the number of samples assigned to it.
+ *
+ * This scales linearly with the number of labels \f$L\f$, whereas `choose()` requires \f$O(L^2)\f$ work and memory per gene.
+ * It is intended for references with hundreds of labels where the pairwise comparisons are not feasible.
+ * The markers for each label can be used in place of the markers for each of its pairwise comparisons, see `expand_one_vs_rest()`.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ * `ChooseOptions::number` is interpreted as the number of markers for each label.
+ *
+ * @return Vector of length \f$L\f$, containing the top markers for each label.
+ * Each marker is represented by a pair containing the row index in `matrix` and the difference between medians.
+ * Each inner vector is sorted by the differences between medians.
+ * All differences are guaranteed to be positive.
+ * Labels with no samples, or references with fewer than two non-empty labels, will have no markers.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+std::vector<std::vector<std::pair<Index_, Stat_> > > choose_one_vs_rest(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options
+) {
+    return choose_one_vs_rest_raw<true, Stat_>(matrix, label, options);
+}
+
+/**
+ * Variant of `choose_one_vs_rest()` that only reports the indices of the top markers for each label.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ *
+ * @return Top markers for each label.
+ * This is the same as the output for `choose_one_vs_rest()` except that only the row index is reported in the inner vector.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+std::vector<std::vector<Index_> > choose_one_vs_rest_index(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ChooseOptions& options
+) {
+    return choose_one_vs_rest_raw<false, Stat_>(matrix, label, options);
+}
+
+/**
+ * Expand the one-vs-rest markers into the pairwise layout used by `choose_index()`, for use in **singlepp** functions that expect markers for each pairwise comparison.
+ * The markers for label \f$A\f$ over any other label are set to the one-vs-rest markers for \f$A\f$.
+ * Note that this requires \f$O(L^2)\f$ memory, so it should only be used if the consumer cannot accept the one-vs-rest markers directly.
+ *
+ * @tparam Marker_ Type of the marker, either an integer row index or a pair containing the index and the difference.
+ *
+ * @param markers Top markers for each label, from `choose_one_vs_rest()` or `choose_one_vs_rest_index()`.
+ *
+ * @return Top markers for each pairwise comparison.
+ * Given the `output`, the vector at `output[i][j]` contains the top markers for label `i` over label `j`, which is just `markers[i]` if `i != j` and empty otherwise.
+ */
+template<typename Marker_>
+std::vector<std::vector<std::vector<Marker_> > > expand_one_vs_rest(const std::vector<std::vector<Marker_> >& markers) {
+    const auto ngroups = markers.size();
+    auto output = sanisizer::create<std::vector<std::vector<std::vector<Marker_> > > >(ngroups);
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        sanisizer::resize(output[g1], ngroups);
+        for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
+            if (g1 != g2) {
+                output[g1][g2] = markers[g1];
+            }
+        }
+    }
+    return output;
+}
+
+}
+
+#endif
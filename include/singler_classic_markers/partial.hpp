@@ -0,0 +1,325 @@
+#ifndef SINGLER_CLASSIC_MARKERS_PARTIAL_HPP
+#define SINGLER_CLASSIC_MARKERS_PARTIAL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <optional>
+#include <utility>
+#include <stdexcept>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+
+#include "flat.hpp"
+#include "queue.hpp"
+#include "choose.hpp"
+#include "blocked.hpp"
+#include "utils.hpp"
+
+/**
+ * @file partial.hpp
+ * @brief Partial marker results for sharded analyses.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Partial markers from a subset of rows.
+ *
+ * This contains the top markers for each pairwise comparison among a contiguous range of rows of the reference matrix.
+ * Partial results for disjoint ranges of rows can be combined with `merge_partial_markers()`,
+ * e.g., to split a large reference across multiple processes or machines and then reduce the results.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ */
+template<typename Index_, typename Stat_>
+struct PartialMarkers {
+    /**
+     * Maximum number of markers to retain for each pairwise comparison, excluding ties.
+     */
+    Index_ num_keep = 0;
+
+    /**
+     * Whether ties at the `num_keep`-th marker are retained.
+     */
+    bool keep_ties = false;
+
+    /**
+     * Top markers for each pairwise comparison, sorted by decreasing difference and then by increasing row index.
+     * Row indices refer to the full reference matrix, not the subset of rows.
+     * The statistics are always present.
+     */
+    FlatMarkers<Index_, Stat_> markers;
+};
+
+/**
+ * @cond
+ */
+// Binary layout of a serialized partial result, where all fields are stored in native byte order:
+//
+// - 4 header words of 64 bits each: the magic number, a byte order mark, the number of markers to keep and the flags.
+// - The markers in the same layout as save_flat_markers().
+constexpr std::uint64_t partial_markers_magic = 0x5452415050434353; // i.e., "SCCPPART" in little-endian order.
+constexpr std::size_t partial_markers_header_words = 4;
+constexpr std::uint64_t partial_markers_flag_keep_ties = 1;
+
+template<typename Index_, typename Stat_>
+PartialMarkers<Index_, Stat_> create_partial_markers(FlatMarkers<Index_, Stat_> markers, const std::size_t ngroups, const std::optional<std::size_t>& number, const bool keep_ties) {
+    PartialMarkers<Index_, Stat_> output;
+    output.num_keep = get_num_keep<Index_>(ngroups, number);
+    output.keep_ties = keep_ties;
+    output.markers = std::move(markers);
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute partial markers from a contiguous range of rows, see `choose()` for details.
+ * The output of `choose()` on the full matrix can be recovered by merging the partial markers for disjoint row ranges that cover all rows.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param start Index of the first row in the range.
+ * @param length Number of rows in the range.
+ * @param options Further options.
+ *
+ * @return Partial markers for the requested rows.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_>
+PartialMarkers<Index_, Stat_> choose_partial(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Index_ start,
+    const Index_ length,
+    const ChooseOptions& options
+) {
+    auto markers = choose_raw<true, Stat_, true>(matrix, label, options, std::pair<std::size_t, std::size_t>(start, length));
+    const auto ngroups = markers.num_labels;
+    return create_partial_markers(std::move(markers), ngroups, options.number, options.keep_ties);
+}
+
+/**
+ * Compute partial markers from a contiguous range of rows in the presence of blocks, see `choose_blocked()` and `choose_partial()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param start Index of the first row in the range.
+ * @param length Number of rows in the range.
+ * @param options Further options.
+ *
+ * @return Partial markers for the requested rows.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+PartialMarkers<Index_, Stat_> choose_blocked_partial(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const Index_ start,
+    const Index_ length,
+    const ChooseBlockedOptions& options
+) {
+    auto markers = choose_blocked_raw<true, Stat_, true>(matrix, label, block, options, std::pair<std::size_t, std::size_t>(start, length));
+    const auto ngroups = markers.num_labels;
+    return create_partial_markers(std::move(markers), ngroups, options.number, options.keep_ties);
+}
+
+/**
+ * Merge two partial results into a single partial result, e.g., for row ranges that were processed in different processes.
+ * This operation is associative and commutative, so partial results can be reduced in any order.
+ * The row ranges used to compute `left` and `right` should not overlap.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param left Partial markers for one set of rows.
+ * @param right Partial markers for another set of rows.
+ * This should have been computed with the same labels and options as `left`.
+ *
+ * @return Partial markers for the union of the rows in `left` and `right`.
+ */
+template<typename Index_, typename Stat_>
+PartialMarkers<Index_, Stat_> merge_partial_markers(const PartialMarkers<Index_, Stat_>& left, const PartialMarkers<Index_, Stat_>& right) {
+    if (left.num_keep != right.num_keep || left.keep_ties != right.keep_ties || left.markers.num_labels != right.markers.num_labels) {
+        throw std::runtime_error("partial markers were computed with different labels or options");
+    }
+
+    if (left.markers.stats.size() != left.markers.indices.size() || right.markers.stats.size() != right.markers.indices.size()) {
+        throw std::runtime_error("partial markers should contain the differences between medians");
+    }
+    const auto lview = view_flat_markers(left.markers);
+    const auto rview = view_flat_markers(right.markers);
+
+    PartialMarkers<Index_, Stat_> output;
+    output.num_keep = left.num_keep;
+    output.keep_ties = left.keep_ties;
+    auto& merged = output.markers;
+    merged.num_labels = left.markers.num_labels;
+    const auto npairs = sanisizer::product<std::size_t>(merged.num_labels, merged.num_labels);
+    merged.offsets.reserve(sanisizer::sum<std::size_t>(npairs, 1));
+    merged.offsets.push_back(0);
+
+    // Each pair is a two-way merge of sorted lists, stopping after the 'num_keep'-th marker and any ties.
+    // This yields the same markers as a single pass over all rows, as the top markers of the union must be among the top markers of either side.
+    const std::size_t num_keep = output.num_keep;
+    for (std::size_t p = 0; p < npairs; ++p) {
+        auto li = lview.offsets[p];
+        const auto lend = lview.offsets[p + 1];
+        auto ri = rview.offsets[p];
+        const auto rend = rview.offsets[p + 1];
+
+        std::size_t kept = 0;
+        Stat_ last = 0;
+        while (li < lend || ri < rend) {
+            bool use_left = (ri == rend);
+            if (!use_left && li < lend) {
+                use_left = TopBuffer<Stat_, Index_>::is_better(
+                    std::make_pair(lview.stats[li], lview.indices[li]),
+                    std::make_pair(rview.stats[ri], rview.indices[ri])
+                );
+            }
+
+            const auto& view = (use_left ? lview : rview);
+            auto& i = (use_left ? li : ri);
+            const Stat_ value = view.stats[i];
+            if (kept >= num_keep && (kept == 0 || !output.keep_ties || value != last)) {
+                break;
+            }
+
+            merged.indices.push_back(view.indices[i]);
+            merged.stats.push_back(value);
+            last = value;
+            ++kept;
+            ++i;
+        }
+
+        merged.offsets.push_back(merged.indices.size());
+    }
+
+    return output;
+}
+
+/**
+ * Serialize partial markers into a compact binary blob, e.g., to transfer them between processes.
+ * Values are stored in native byte order, so the blob should only be deserialized on machines with the same endianness and the same `Index_` and `Stat_` types.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param partial Partial markers to be serialized.
+ *
+ * @return Serialized representation of `partial`, to be used in `deserialize_partial_markers()`.
+ */
+template<typename Index_, typename Stat_>
+std::vector<unsigned char> serialize_partial_markers(const PartialMarkers<Index_, Stat_>& partial) {
+    std::vector<unsigned char> output;
+    const auto append = [&](const void* ptr, const std::size_t n) -> void {
+        const auto bytes = static_cast<const unsigned char*>(ptr);
+        output.insert(output.end(), bytes, bytes + n);
+    };
+
+    const std::uint64_t header[partial_markers_header_words] = {
+        partial_markers_magic,
+        flat_markers_byte_order,
+        static_cast<std::uint64_t>(partial.num_keep),
+        (partial.keep_ties ? partial_markers_flag_keep_ties : 0)
+    };
+    append(header, sizeof(header));
+    write_flat_markers(view_flat_markers(partial.markers), append);
+    return output;
+}
+
+/**
+ * Deserialize partial markers from a blob created by `serialize_partial_markers()`.
+ * The `Index_` and `Stat_` types should be the same as those used to serialize the markers.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param data Pointer to the serialized blob.
+ * This does not need to be aligned.
+ * @param size Size of the blob in bytes.
+ *
+ * @return Partial markers.
+ */
+template<typename Index_, typename Stat_>
+PartialMarkers<Index_, Stat_> deserialize_partial_markers(const unsigned char* data, const std::size_t size) {
+    std::uint64_t header[partial_markers_header_words];
+    if (size < sizeof(header)) {
+        throw std::runtime_error("buffer does not contain partial markers");
+    }
+    std::memcpy(header, data, sizeof(header));
+    if (header[0] != partial_markers_magic) {
+        throw std::runtime_error("buffer does not contain partial markers");
+    }
+    if (header[1] != flat_markers_byte_order) {
+        throw std::runtime_error("partial markers were serialized with a different byte order");
+    }
+
+    PartialMarkers<Index_, Stat_> output;
+    output.num_keep = sanisizer::cast<Index_>(header[2]);
+    output.keep_ties = (header[3] & partial_markers_flag_keep_ties);
+    output.markers = read_flat_markers<Index_, Stat_>(data + sizeof(header), size - sizeof(header));
+    if (output.markers.stats.size() != output.markers.indices.size()) {
+        throw std::runtime_error("partial markers should contain the differences between medians");
+    }
+    return output;
+}
+
+/**
+ * Convert partial markers covering all rows into the final markers.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param partial Partial markers, typically obtained by merging the partial results for all row ranges.
+ *
+ * @return Top markers for each pairwise comparison between labels, in the same structure as the return value of `choose()`.
+ */
+template<typename Index_, typename Stat_>
+std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > finalize_partial_markers(const PartialMarkers<Index_, Stat_>& partial) {
+    return unflatten_markers<true>(partial.markers);
+}
+
+/**
+ * Variant of `finalize_partial_markers()` that only reports the indices of the top markers for each pairwise comparison.
+ *
+ * @tparam Index_ Integer type of the row indices.
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ *
+ * @param partial Partial markers, typically obtained by merging the partial results for all row ranges.
+ *
+ * @return Top markers for each pairwise comparison between labels, in the same structure as the return value of `choose_index()`.
+ */
+template<typename Index_, typename Stat_>
+std::vector<std::vector<std::vector<Index_> > > finalize_partial_markers_index(const PartialMarkers<Index_, Stat_>& partial) {
+    return unflatten_markers<false>(partial.markers);
+}
+
+}
+
+#endif
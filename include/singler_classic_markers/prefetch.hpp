@@ -0,0 +1,168 @@
+#ifndef SINGLER_CLASSIC_MARKERS_PREFETCH_HPP
+#define SINGLER_CLASSIC_MARKERS_PREFETCH_HPP
+
+#include <vector>
+#include <deque>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+
+#include "utils.hpp"
+#include "statistics.hpp"
+
+namespace singler_classic_markers {
+
+template<typename Value_, typename Index_>
+struct RowBatch {
+    Index_ start = 0;
+    Index_ number = 0;
+    std::vector<Value_> values;
+    std::vector<Index_> indices; // only used for sparse extraction.
+    std::vector<std::size_t> offsets; // only used for sparse extraction.
+};
+
+// Extracting batches of rows in a separate producer thread, while the calling thread consumes the previously extracted batches.
+// At most 'depth' batches are extracted ahead of the consumer, which bounds the memory usage to 'depth * batch_size' rows.
+// The time that the consumer spends waiting for the producer is added to 'wait_time'.
+template<bool sparse_, typename Value_, typename Index_, class Consume_>
+void prefetch_rows(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Index_ start,
+    const Index_ length,
+    const std::size_t batch_size,
+    const std::size_t depth,
+    Consume_ consume,
+    PhaseTimer& wait_timer,
+    double& wait_time
+) {
+    const Index_ batch_rows = std::max<Index_>(1, sanisizer::cap<Index_>(batch_size));
+    const std::size_t num_batches = std::max<std::size_t>(1, depth);
+    const auto NC = matrix.ncol();
+
+    std::deque<RowBatch<Value_, Index_> > free_batches(num_batches), ready_batches;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool finished = false, stopped = false;
+    std::exception_ptr producer_error;
+
+    std::thread producer([&]() -> void {
+        try {
+            auto ext = tatami::consecutive_extractor<sparse_>(matrix, true, start, length);
+            auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
+            auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(sparse_ ? NC : 0);
+
+            for (Index_ bstart = start, end = start + length; bstart < end; ) {
+                RowBatch<Value_, Index_> batch;
+                {
+                    std::unique_lock<std::mutex> lck(lock);
+                    cv.wait(lck, [&]() -> bool { return stopped || !free_batches.empty(); });
+                    if (stopped) {
+                        return;
+                    }
+                    batch = std::move(free_batches.front());
+                    free_batches.pop_front();
+                }
+
+                batch.start = bstart;
+                batch.number = std::min<Index_>(batch_rows, end - bstart);
+                if constexpr(sparse_) {
+                    batch.values.clear();
+                    batch.indices.clear();
+                    batch.offsets.clear();
+                    batch.offsets.push_back(0);
+                    for (Index_ i = 0; i < batch.number; ++i) {
+                        const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                        batch.values.insert(batch.values.end(), range.value, range.value + range.number);
+                        batch.indices.insert(batch.indices.end(), range.index, range.index + range.number);
+                        batch.offsets.push_back(batch.values.size());
+                    }
+                } else {
+                    sanisizer::resize(batch.values, sanisizer::product<std::size_t>(batch.number, NC));
+                    for (Index_ i = 0; i < batch.number; ++i) {
+                        const auto optr = batch.values.data() + static_cast<std::size_t>(i) * NC; // product is safe as it was checked above.
+                        const auto ptr = ext->fetch(optr);
+                        tatami::copy_n(ptr, NC, optr);
+                    }
+                }
+                bstart += batch.number;
+
+                {
+                    std::lock_guard<std::mutex> lck(lock);
+                    ready_batches.push_back(std::move(batch));
+                }
+                cv.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lck(lock);
+            producer_error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lck(lock);
+            finished = true;
+        }
+        cv.notify_all();
+    });
+
+    // Making sure that the producer is stopped and joined if the consumer throws.
+    struct Joiner {
+        std::thread& producer;
+        std::mutex& lock;
+        std::condition_variable& cv;
+        bool& stopped;
+        ~Joiner() {
+            {
+                std::lock_guard<std::mutex> lck(lock);
+                stopped = true;
+            }
+            cv.notify_all();
+            producer.join();
+        }
+    };
+    Joiner joiner{ producer, lock, cv, stopped };
+
+    while (1) {
+        RowBatch<Value_, Index_> batch;
+        {
+            wait_timer.start();
+            std::unique_lock<std::mutex> lck(lock);
+            cv.wait(lck, [&]() -> bool { return finished || !ready_batches.empty(); });
+            wait_timer.stop(wait_time);
+            if (ready_batches.empty()) {
+                if (producer_error) {
+                    std::rethrow_exception(producer_error);
+                }
+                break;
+            }
+            batch = std::move(ready_batches.front());
+            ready_batches.pop_front();
+        }
+
+        for (Index_ i = 0; i < batch.number; ++i) {
+            const Index_ r = batch.start + i;
+            if constexpr(sparse_) {
+                const auto offset = batch.offsets[i];
+                const tatami::SparseRange<Value_, Index_> range(batch.offsets[i + 1] - offset, batch.values.data() + offset, batch.indices.data() + offset);
+                consume(r, range);
+            } else {
+                consume(r, batch.values.data() + static_cast<std::size_t>(i) * NC); // product is safe as it was checked by the producer.
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lck(lock);
+            free_batches.push_back(std::move(batch));
+        }
+        cv.notify_all();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,515 @@
+#ifndef SINGLER_CLASSIC_MARKERS_PROFILES_HPP
+#define SINGLER_CLASSIC_MARKERS_PROFILES_HPP
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <stdexcept>
+#include <optional>
+#include <algorithm>
+#include <cmath>
+
+#include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "queue.hpp"
+#include "scan.hpp"
+#include "statistics.hpp"
+#include "progress.hpp"
+#include "number.hpp"
+#include "choose.hpp"
+#include "blocked.hpp"
+
+/**
+ * @file profiles.hpp
+ * @brief Choose markers from precomputed median profiles.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Median profiles for each label.
+ *
+ * @tparam Profile_ Floating-point type of the medians.
+ * This can be set to `float` to halve the memory usage for large references,
+ * though the medians will then be rounded to single precision - see `choose_from_profiles()` for the consequences.
+ * @tparam Index_ Integer type of the row indices.
+ */
+template<typename Profile_, typename Index_>
+struct MedianProfiles {
+    /**
+     * Number of rows (genes) in the reference.
+     */
+    Index_ num_rows = 0;
+
+    /**
+     * Number of labels.
+     */
+    std::size_t num_labels = 0;
+
+    /**
+     * Number of blocks.
+     * This is always 1 for profiles from `compute_median_profiles()`.
+     */
+    std::size_t num_blocks = 1;
+
+    /**
+     * Row-major matrix of medians, where each row corresponds to a gene and each column corresponds to a combination of label and block.
+     * For row \f$r\f$, label \f$l\f$ and block \f$b\f$, the median is stored at \f$(rL + l)B + b\f$ for \f$L\f$ labels and \f$B\f$ blocks.
+     * The median is NaN for any combination of label and block that has no columns in the reference.
+     */
+    std::vector<Profile_> medians;
+
+    /**
+     * Number of columns in the reference for each combination of label and block.
+     * For label \f$l\f$ and block \f$b\f$, the number of columns is stored at \f$lB + b\f$.
+     * This is used by `choose_blocked_from_profiles()` and `add_label_blocked()` to determine the blocks that are shared by each pair of labels.
+     *
+     * This may be empty, e.g., for profiles that were assembled by the caller.
+     * In such cases, a combination is assumed to have no columns if all of its medians are NaN.
+     * This is consistent with `medians` except when a combination has columns but all of its medians are NaN, e.g., due to NaNs in the reference.
+     */
+    std::vector<Index_> combo_sizes;
+};
+
+/**
+ * @brief Options for `compute_median_profiles()` and `compute_blocked_median_profiles()`.
+ */
+struct ComputeMedianProfilesOptions {
+    /**
+     * Number of threads to use.
+     * The parallelization scheme is determined by `tatami::parallelize()`.
+     */
+    int num_threads = 1;
+
+    /**
+     * Whether to dynamically assign rows to threads.
+     * If `true`, each thread repeatedly takes the next chunk of `dynamic_chunk_size` rows until all rows are processed.
+     * This balances the work across threads when the cost of each row is highly variable, e.g., in sparse matrices where highly expressed genes are clustered together.
+     * If `false`, each thread processes a contiguous range of rows of (roughly) equal size, as determined by `tatami::parallelize()`.
+     * The results are the same regardless of the scheduling.
+     */
+    bool dynamic_scheduling = false;
+
+    /**
+     * Number of rows in each chunk when `dynamic_scheduling = true`.
+     * Smaller chunks improve load balancing at the cost of more overhead from creating new extractors for each chunk.
+     */
+    std::size_t dynamic_chunk_size = 1000;
+
+    /**
+     * Whether to extract rows in a separate thread for each worker, so that the extraction of the next batch of rows overlaps with the computation of medians for the current batch.
+     * This is most useful for matrices where extraction is slow, e.g., file-backed matrices.
+     * Only used for matrices that prefer row access, see `column_slab_size` for the alternative.
+     * Ignored if `approximate = true`.
+     */
+    bool pipeline = false;
+
+    /**
+     * Number of rows in each batch when `pipeline = true`.
+     */
+    std::size_t pipeline_batch_size = 100;
+
+    /**
+     * Maximum number of batches that can be extracted ahead of the computation when `pipeline = true`.
+     * Larger values can smooth over variable extraction times at the cost of more memory.
+     */
+    std::size_t pipeline_depth = 2;
+
+    /**
+     * Number of rows to process at once when the matrix prefers column access, see `tatami::Matrix::prefer_rows()`.
+     * For such matrices, each thread extracts a slab of rows from all columns and computes the medians for all rows in the slab, which avoids the cost of row access.
+     * Larger slabs require fewer passes over the columns at the cost of more memory.
+     * If not set, the slab size is chosen so that each thread holds approximately 1 million matrix values.
+     */
+    std::optional<std::size_t> column_slab_size;
+
+    /**
+     * Whether to approximate the median of each group with a quantile sketch.
+     * This bounds the memory usage of each thread regardless of the number of columns in the matrix, which is useful for very large references.
+     * For a group of \f$n\f$ samples and a sketch size of \f$k\f$, the rank of the reported median differs from that of the exact median by no more than \f$(n/k)(1 + \log_2(n/k))\f$.
+     * Medians are exact for groups with no more than \f$k\f$ samples.
+     */
+    bool approximate = false;
+
+    /**
+     * Size of the quantile sketch when `approximate = true`.
+     * Larger values improve the accuracy of the approximation at the cost of more memory and time.
+     */
+    std::size_t approximate_sketch_size = 1024;
+
+    /**
+     * Pointer to a `ChooseStatistics` object in which to store instrumentation statistics, e.g., the time spent in each phase.
+     * If NULL, no statistics are collected.
+     */
+    ChooseStatistics* statistics = NULL;
+
+    /**
+     * Function to report the progress of the scan over the rows of the matrix.
+     * This is called with the number of rows processed so far and the total number of rows.
+     * It may be called from any worker thread but never concurrently, and should return quickly as the calling worker is blocked in the meantime.
+     * Reports are throttled to once every `check_interval` rows per thread, and some reports may be skipped if another thread is already reporting.
+     * If empty, progress is not reported.
+     */
+    std::function<void(std::size_t, std::size_t)> progress;
+
+    /**
+     * Pointer to a flag that can be set by another thread to cancel the marker detection.
+     * Each thread checks this flag every `check_interval` rows, and a `CancelledError` is thrown once it is set.
+     * If NULL, the marker detection cannot be cancelled.
+     */
+    const std::atomic<bool>* cancel = NULL;
+
+    /**
+     * Number of rows processed by each thread between progress reports and checks of the `cancel` flag.
+     * Smaller values improve responsiveness at the cost of more overhead.
+     */
+    std::size_t check_interval = 1000;
+};
+
+/**
+ * @cond
+ */
+template<typename Profile_, typename Value_, typename Index_, typename Combo_>
+void fill_median_profiles(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Combo_* combo,
+    const std::vector<Index_>& combo_sizes,
+    MedianProfiles<Profile_, Index_>& profiles,
+    const ComputeMedianProfilesOptions& options
+) {
+    const auto NR = matrix.nrow();
+    const std::size_t ncombos = combo_sizes.size();
+    profiles.num_rows = NR;
+    profiles.combo_sizes = combo_sizes;
+    sanisizer::resize(profiles.medians, sanisizer::product<std::size_t>(NR, ncombos));
+
+    initialize_statistics(options.statistics, options.num_threads);
+    const auto num_used = scan_matrix<Profile_>(
+        matrix,
+        ncombos,
+        combo,
+        combo_sizes,
+        /* setup = */ [&]() -> bool { return false; },
+        /* fun = */ [&](const Index_ r, const std::vector<Profile_>& medians, bool&) -> void {
+            std::copy(medians.begin(), medians.end(), profiles.medians.begin() + static_cast<std::size_t>(r) * ncombos); // product is safe as it was checked above.
+        },
+        /* finalize = */ [&](const int, bool&) -> void {},
+        create_scan_options(options)
+    );
+    finalize_statistics(options.statistics, num_used);
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute the median of each row for each label, for use in `choose_from_profiles()`.
+ * This allows users to re-choose markers with different parameters (e.g., `ChooseOptions::number`) without repeatedly reading the reference matrix.
+ *
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param options Further options.
+ *
+ * @return Median profiles for each label, with `MedianProfiles::num_blocks` set to 1.
+ */
+template<typename Profile_ = double, typename Value_, typename Index_, typename Label_>
+MedianProfiles<Profile_, Index_> compute_median_profiles(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const ComputeMedianProfilesOptions& options
+) {
+    MedianProfiles<Profile_, Index_> output;
+    const auto group_sizes = tatami_stats::tabulate_groups(label, matrix.ncol());
+    output.num_labels = group_sizes.size();
+    fill_median_profiles(matrix, label, group_sizes, output, options);
+    return output;
+}
+
+/**
+ * Compute the median of each row for each combination of label and block, for use in `choose_blocked_from_profiles()`.
+ *
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Value_ Numeric type of matrix values.
+ * @tparam Index_ Integer type of matrix row/column indices.
+ * @tparam Label_ Integer type of the label identity.
+ * @tparam Block_ Integer type of the block assignment.
+ *
+ * @param matrix Matrix containing a reference dataset.
+ * Each column should correspond to a sample while each row should represent a gene.
+ * @param label Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the label for the corresponding column.
+ * Values should lie in \f$[0, L)\f$ for \f$L\f$ unique labels.
+ * @param block Pointer to an array of length equal to the number of columns in `matrix`.
+ * Each value of the array should specify the block for the corresponding column.
+ * Values should lie in \f$[0, B)\f$ for \f$B\f$ unique blocks.
+ * @param options Further options.
+ *
+ * @return Median profiles for each combination of label and block.
+ */
+template<typename Profile_ = double, typename Value_, typename Index_, typename Label_, typename Block_>
+MedianProfiles<Profile_, Index_> compute_blocked_median_profiles(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Label_* label,
+    const Block_* block,
+    const ComputeMedianProfilesOptions& options
+) {
+    MedianProfiles<Profile_, Index_> output;
+    const auto NC = matrix.ncol();
+    output.num_labels = tatami_stats::total_groups(label, NC);
+    output.num_blocks = tatami_stats::total_groups(block, NC);
+
+    std::vector<Index_> combo_sizes;
+    const auto combinations = create_blocked_combinations(NC, label, block, output.num_labels, output.num_blocks, combo_sizes);
+    fill_median_profiles(matrix, combinations.data(), combo_sizes, output, options);
+    return output;
+}
+
+/**
+ * @cond
+ */
+// Falling back to the medians if the combination sizes were not stored in the profiles, see the comments for MedianProfiles::combo_sizes.
+// Only the non-zero status of each size is used to determine the shared blocks, so we don't need the actual number of columns.
+template<typename Profile_, typename Index_>
+std::vector<Index_> get_profile_combo_sizes(const MedianProfiles<Profile_, Index_>& profiles, const std::size_t ncombos) {
+    if (!profiles.combo_sizes.empty()) {
+        if (profiles.combo_sizes.size() != ncombos) {
+            throw std::runtime_error("inconsistent dimensions for the combination sizes of the median profiles");
+        }
+        return profiles.combo_sizes;
+    }
+
+    auto combo_sizes = sanisizer::create<std::vector<Index_> >(ncombos);
+    for (I<decltype(profiles.num_rows)> r = 0; r < profiles.num_rows; ++r) {
+        const auto ptr = profiles.medians.data() + static_cast<std::size_t>(r) * ncombos; // product is safe as the size of the medians was already checked by the caller.
+        for (I<decltype(ncombos)> c = 0; c < ncombos; ++c) {
+            if (!std::isnan(ptr[c])) {
+                combo_sizes[c] = 1;
+            }
+        }
+    }
+    return combo_sizes;
+}
+
+template<bool include_stat_, typename Stat_, bool flat_ = false, typename Profile_, typename Index_>
+MarkerOutput<include_stat_, flat_, Index_, Stat_> choose_from_profiles_raw(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const std::optional<std::size_t>& number,
+    const bool keep_ties,
+    const std::optional<bool>& use_minimum, // only set for blocked analyses.
+    const int num_threads,
+    ChooseStatistics* statistics
+) {
+    const auto ngroups = profiles.num_labels;
+    const auto nblocks = profiles.num_blocks;
+    const auto ncombos = sanisizer::product<std::size_t>(ngroups, nblocks);
+    if (profiles.medians.size() != sanisizer::product<std::size_t>(profiles.num_rows, ncombos)) {
+        throw std::runtime_error("inconsistent dimensions for the median profiles");
+    }
+
+    // Only considering the blocks shared by each pair of labels, as in choose_blocked().
+    // This ensures that the per-block differences are summed in the same order, so that the results are identical.
+    SharedBlocks shared;
+    if (use_minimum.has_value()) {
+        shared = create_shared_blocks(ngroups, nblocks, get_profile_combo_sizes(profiles, ncombos));
+    }
+
+    const auto num_keep = get_num_keep<Index_>(ngroups, number);
+    auto pqueues = sanisizer::create<std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > > >(num_threads);
+
+    initialize_statistics(statistics, num_threads);
+    const auto num_used = scan_profiles<Stat_>(
+        profiles.num_rows,
+        ncombos,
+        profiles.medians.data(),
+
+        /* setup = */ [&]() -> PairwiseTopQueues<Stat_, Index_> {
+            PairwiseTopQueues<Stat_, Index_> curqueues(num_keep, ngroups, keep_ties);
+            if (statistics) {
+                curqueues.enable_counting();
+            }
+            return curqueues;
+        },
+
+        /* fun = */ [&](const Index_ r, const std::vector<Stat_>& medians, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
+            if (use_minimum.has_value()) {
+                add_shared_blocked_differences(r, medians.data(), ngroups, nblocks, shared, *use_minimum, curqueues);
+            } else {
+                add_pairwise_differences(r, medians.data(), ngroups, curqueues);
+            }
+        },
+
+        /* finalize = */ [&](const int t, PairwiseTopQueues<Stat_, Index_>& curqueues) -> void {
+            if (statistics) {
+                curqueues.transfer_counts(statistics->threads[t]);
+            }
+            pqueues[t] = std::move(curqueues);
+        },
+
+        num_threads,
+        get_thread_statistics(statistics)
+    );
+
+    pqueues.resize(num_used);
+    finalize_statistics(statistics, num_used);
+    MarkerOutput<include_stat_, flat_, Index_, Stat_> output;
+    time_merge(statistics, [&]() -> void {
+        report_best_top_queues<include_stat_>(pqueues, ngroups, output, num_threads);
+    });
+    return output;
+}
+
+template<typename Profile_, typename Index_>
+void check_unblocked_profiles(const MedianProfiles<Profile_, Index_>& profiles) {
+    if (profiles.num_blocks != 1) {
+        throw std::runtime_error("profiles should not contain multiple blocks, use choose_blocked_from_profiles() instead");
+    }
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Variant of `choose()` that uses precomputed median profiles from `compute_median_profiles()`.
+ * This yields the same results as `choose()` on the original reference matrix, provided that `Profile_` has at least the precision of `Stat_`.
+ * Otherwise, the medians are rounded to `Profile_` before their differences are computed,
+ * which changes the reported statistics and may change the ranking of genes with similar differences.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each label.
+ * `MedianProfiles::num_blocks` should be equal to 1.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > choose_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseOptions& options
+) {
+    check_unblocked_profiles(profiles);
+    return choose_from_profiles_raw<true, Stat_>(profiles, options.number, options.keep_ties, {}, options.num_threads, options.statistics);
+}
+
+/**
+ * Variant of `choose_from_profiles()` that only reports the indices of the top markers for each pairwise comparison.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each label.
+ * `MedianProfiles::num_blocks` should be equal to 1.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_index()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+std::vector<std::vector<std::vector<Index_> > > choose_index_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseOptions& options
+) {
+    check_unblocked_profiles(profiles);
+    return choose_from_profiles_raw<false, Stat_>(profiles, options.number, options.keep_ties, {}, options.num_threads, options.statistics);
+}
+
+/**
+ * Variant of `choose_blocked()` that uses precomputed median profiles from `compute_blocked_median_profiles()`.
+ * This yields the same results as `choose_blocked()` on the original reference matrix, provided that `Profile_` has at least the precision of `Stat_`.
+ * Otherwise, the medians are rounded to `Profile_` before their differences are computed, see `choose_from_profiles()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each combination of label and block.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_blocked()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > > choose_blocked_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseBlockedOptions& options
+) {
+    return choose_from_profiles_raw<true, Stat_>(profiles, options.number, options.keep_ties, options.use_minimum, options.num_threads, options.statistics);
+}
+
+/**
+ * Variant of `choose_blocked_from_profiles()` that only reports the indices of the top markers for each pairwise comparison.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each combination of label and block.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_blocked_index()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+std::vector<std::vector<std::vector<Index_> > > choose_blocked_index_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseBlockedOptions& options
+) {
+    return choose_from_profiles_raw<false, Stat_>(profiles, options.number, options.keep_ties, options.use_minimum, options.num_threads, options.statistics);
+}
+
+/**
+ * Variant of `choose_from_profiles()` that reports the markers in a flat layout, see `choose_flat()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each label.
+ * `MedianProfiles::num_blocks` should be equal to 1.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_flat()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+FlatMarkers<Index_, Stat_> choose_flat_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseOptions& options
+) {
+    check_unblocked_profiles(profiles);
+    return choose_from_profiles_raw<true, Stat_, true>(profiles, options.number, options.keep_ties, {}, options.num_threads, options.statistics);
+}
+
+/**
+ * Variant of `choose_blocked_from_profiles()` that reports the markers in a flat layout, see `choose_flat()` for details.
+ *
+ * @tparam Stat_ Floating-point type of the differences between medians.
+ * @tparam Profile_ Floating-point type of the medians.
+ * @tparam Index_ Integer type of the row indices.
+ *
+ * @param profiles Median profiles for each combination of label and block.
+ * @param options Further options.
+ *
+ * @return Top markers for each pairwise comparison between labels, see `choose_blocked_flat()` for details.
+ */
+template<typename Stat_ = double, typename Profile_, typename Index_>
+FlatMarkers<Index_, Stat_> choose_blocked_flat_from_profiles(
+    const MedianProfiles<Profile_, Index_>& profiles,
+    const ChooseBlockedOptions& options
+) {
+    return choose_from_profiles_raw<true, Stat_, true>(profiles, options.number, options.keep_ties, options.use_minimum, options.num_threads, options.statistics);
+}
+
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SINGLER_CLASSIC_MARKERS_PROGRESS_HPP
+#define SINGLER_CLASSIC_MARKERS_PROGRESS_HPP
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+
+/**
+ * @file progress.hpp
+ * @brief Progress reporting and cancellation of the marker detection.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Exception thrown when marker detection is cancelled.
+ *
+ * This is thrown by the marker detection functions after the `cancel` flag in their options is set.
+ * All intermediate results are discarded.
+ */
+class CancelledError : public std::runtime_error {
+public:
+    /**
+     * @cond
+     */
+    CancelledError() : std::runtime_error("marker detection was cancelled") {}
+    /**
+     * @endcond
+     */
+};
+
+/**
+ * @cond
+ */
+// Shared between all workers in a scan.
+// Each worker only touches the atomic counter once every 'interval' rows, so the overhead is negligible.
+// Progress reports are skipped if another worker is already reporting, so that workers never wait on each other.
+class ProgressTracker {
+public:
+    ProgressTracker(const std::function<void(std::size_t, std::size_t)>* progress, const std::atomic<bool>* cancel, const std::size_t total) :
+        my_progress(progress), my_cancel(cancel), my_total(total) {}
+
+private:
+    const std::function<void(std::size_t, std::size_t)>* my_progress;
+    const std::atomic<bool>* my_cancel;
+    std::size_t my_total;
+    std::atomic<std::size_t> my_done{0};
+    std::mutex my_lock;
+
+public:
+    bool active() const {
+        return my_progress != NULL || my_cancel != NULL;
+    }
+
+    void check() const {
+        if (my_cancel && my_cancel->load(std::memory_order_relaxed)) {
+            throw CancelledError();
+        }
+    }
+
+    void add(const std::size_t num_rows) {
+        my_done.fetch_add(num_rows, std::memory_order_relaxed);
+        check();
+        if (my_progress) {
+            std::unique_lock<std::mutex> lck(my_lock, std::try_to_lock);
+            if (lck.owns_lock()) {
+                (*my_progress)(my_done.load(std::memory_order_relaxed), my_total);
+            }
+        }
+    }
+
+    void finish() {
+        if (my_progress) {
+            (*my_progress)(my_total, my_total);
+        }
+    }
+};
+/**
+ * @endcond
+ */
+
+}
+
+#endif
@@ -4,34 +4,308 @@
 #include <vector>
 #include <cstddef>
 #include <optional>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <cmath>
 
-#include "topicks/topicks.hpp"
 #include "sanisizer/sanisizer.hpp"
+#include "tatami/tatami.hpp"
 
 #include "utils.hpp"
+#include "statistics.hpp"
+#include "flat.hpp"
 
 namespace singler_classic_markers {
 
+// Deferred top-k selection for a single pairwise comparison.
+// Rather than maintaining a heap on every insertion, we buffer candidates until we have a chunk's worth,
+// and then we use a partial selection to retain only the top 'num_keep' candidates (plus any ties, if requested).
+// The value of the k-th best candidate is then used as the admission threshold for subsequent candidates.
 template<typename Stat_, typename Index_>
-using PairwiseTopQueues = std::vector<std::vector<topicks::TopQueue<Stat_, Index_> > >;
+class TopBuffer {
+public:
+    TopBuffer(const Index_ num_keep, const bool keep_ties) : my_num_keep(num_keep), my_keep_ties(keep_ties) {
+        // Buffering a chunk of the same size as the number of retained entries, so that compaction is amortized O(1) per candidate.
+        constexpr std::size_t min_chunk = 32;
+        const std::size_t keep = num_keep;
+        my_chunk = std::max(keep, min_chunk);
+        set_capacity(keep);
+    }
+
+private:
+    Index_ my_num_keep;
+    bool my_keep_ties;
+    std::size_t my_chunk;
+    std::size_t my_capacity;
+    std::vector<std::pair<Stat_, Index_> > my_entries;
+    Stat_ my_threshold = 0;
+
+    void set_capacity(const std::size_t retained) {
+        if (retained > std::numeric_limits<std::size_t>::max() - my_chunk) {
+            my_capacity = std::numeric_limits<std::size_t>::max();
+        } else {
+            my_capacity = retained + my_chunk;
+        }
+    }
+
+public:
+    static bool is_better(const std::pair<Stat_, Index_>& left, const std::pair<Stat_, Index_>& right) {
+        // Earlier genes are preferred when breaking ties.
+        return left.first > right.first || (left.first == right.first && left.second < right.second);
+    }
+
+    void emplace(const Stat_ value, const Index_ index) {
+        // This also rejects NaNs and non-positive differences.
+        // Note that ties with the threshold are still admitted as they might be retained in the next compaction.
+        if (value > 0 && value >= my_threshold) {
+            my_entries.emplace_back(value, index);
+            if (my_entries.size() >= my_capacity) {
+                compact();
+            }
+        }
+    }
+
+    Stat_ threshold() const {
+        return my_threshold;
+    }
+
+    std::size_t capacity() const {
+        return my_capacity;
+    }
 
+    void compact() {
+        const std::size_t keep = my_num_keep;
+        if (keep == 0) {
+            my_entries.clear();
+            return;
+        }
+        if (my_entries.size() <= keep) {
+            return;
+        }
+
+        auto kth = my_entries.begin() + (keep - 1);
+        std::nth_element(my_entries.begin(), kth, my_entries.end(), is_better);
+        my_threshold = kth->first;
+
+        if (my_keep_ties) {
+            const auto last = std::partition(kth + 1, my_entries.end(), [&](const std::pair<Stat_, Index_>& x) -> bool { return x.first == my_threshold; });
+            my_entries.erase(last, my_entries.end());
+
+            // If many ties are retained, we need to make room for another chunk of candidates;
+            // otherwise, every subsequent emplace() would trigger another compaction.
+            set_capacity(my_entries.size());
+        } else {
+            my_entries.resize(keep);
+        }
+    }
+
+    void merge(TopBuffer& other) {
+        my_threshold = std::max(my_threshold, other.my_threshold);
+        for (const auto& x : other.my_entries) {
+            emplace(x.first, x.second);
+        }
+        other.my_entries.clear();
+    }
+
+    // Sorts the retained entries from largest to smallest.
+    std::vector<std::pair<Stat_, Index_> >& finalize() {
+        compact();
+        std::sort(my_entries.begin(), my_entries.end(), is_better);
+        return my_entries;
+    }
+
+    // Only meaningful after finalize().
+    const std::vector<std::pair<Stat_, Index_> >& entries() const {
+        return my_entries;
+    }
+};
+
+// A set of top buffers, e.g., one for each pairwise comparison.
+// The admission thresholds for all buffers are kept in a separate contiguous array,
+// so that an entire row's worth of candidates can be checked against the thresholds in a single (vectorizable) pass.
+// Only the candidates that pass this check are actually inserted into their buffers.
 template<typename Stat_, typename Index_>
-void allocate_pairwise_queues(
-    PairwiseTopQueues<Stat_, Index_>& pqueues,
-    const Index_ num_keep,
-    const std::size_t ngroups,
-    const bool keep_ties,
-    const bool check_nan
-) {
-    topicks::TopQueueOptions<Stat_> opt;
-    opt.check_nan = check_nan;
-    opt.keep_ties = keep_ties;
-    opt.bound = 0;
-    sanisizer::resize(pqueues, ngroups);
-    for (auto& x : pqueues) {
-        x.reserve(ngroups);
+class TopBufferSet {
+public:
+    TopBufferSet(const Index_ num_keep, const std::size_t num_buffers, const bool keep_ties) {
+        my_buffers.reserve(num_buffers);
+        for (I<decltype(num_buffers)> p = 0; p < num_buffers; ++p) {
+            my_buffers.emplace_back(num_keep, keep_ties);
+        }
+
+        // Using the smallest positive value as the initial threshold, as all differences must be positive.
+        // NaNs will also fail the comparison so we don't have to check for them separately.
+        sanisizer::resize(my_thresholds, num_buffers, std::numeric_limits<Stat_>::denorm_min());
+        sanisizer::resize(my_candidates, num_buffers);
+        sanisizer::resize(my_admitted, num_buffers);
+        sanisizer::resize(my_bounded, num_buffers, 1);
+    }
+
+private:
+    std::vector<TopBuffer<Stat_, Index_> > my_buffers;
+    std::vector<Stat_> my_thresholds;
+    std::vector<Stat_> my_candidates;
+    std::vector<unsigned char> my_admitted;
+
+    // Lowest threshold across all buffers that can admit candidates, for pruning rows that cannot enter any buffer.
+    // Buffers that never admit candidates (e.g., comparisons of a label to itself) are excluded as their thresholds never increase.
+    std::vector<unsigned char> my_bounded;
+    Stat_ my_min_threshold = std::numeric_limits<Stat_>::denorm_min();
+
+    // Optional counting of the outcomes of each candidate, for instrumentation.
+    bool my_counting = false;
+    std::size_t my_num_accepted = 0, my_num_rejected = 0, my_num_nan = 0, my_num_pruned = 0;
+
+public:
+    std::size_t size() const {
+        return my_buffers.size();
+    }
+
+    TopBuffer<Stat_, Index_>& buffer(const std::size_t i) {
+        return my_buffers[i];
+    }
+
+    void enable_counting() {
+        my_counting = true;
+    }
+
+    void transfer_counts(ThreadStatistics& statistics) const {
+        statistics.num_accepted += my_num_accepted;
+        statistics.num_rejected += my_num_rejected;
+        statistics.num_nan += my_num_nan;
+        statistics.num_pruned += my_num_pruned;
+    }
+
+    // Callers should fill this with the candidate statistic for each buffer, using NaN for invalid comparisons.
+    Stat_* candidates() {
+        return my_candidates.data();
+    }
+
+    // Excluding a buffer from the lower bound, if it is known to never admit any candidates.
+    // This should be called before any candidates are added, while all thresholds are still at their initial values.
+    void exclude_from_bound(const std::size_t i) {
+        my_bounded[i] = 0;
+    }
+
+    // No candidate can be admitted into any buffer if it is less than this value.
+    Stat_ min_threshold() const {
+        return my_min_threshold;
+    }
+
+    // Skipping a row where no candidate can be admitted, i.e., all candidates are less than min_threshold() or NaN.
+    // 'num_nan' should be the number of candidates that would have been NaN, so that only the remaining candidates are counted as pruned.
+    void skip_candidates(const std::size_t num_nan) {
+        if (my_counting) {
+            my_num_nan += num_nan;
+            my_num_pruned += my_candidates.size() - num_nan;
+        }
+    }
+
+private:
+    void update_min_threshold() {
+        Stat_ current = std::numeric_limits<Stat_>::infinity();
+        bool found = false;
+        for (I<decltype(my_thresholds.size())> p = 0, end = my_thresholds.size(); p < end; ++p) {
+            if (my_bounded[p]) {
+                current = std::min(current, my_thresholds[p]);
+                found = true;
+            }
+        }
+        my_min_threshold = (found ? current : std::numeric_limits<Stat_>::denorm_min());
+    }
+
+public:
+
+    void add_candidates(const Index_ index) {
+        const auto num_buffers = my_candidates.size();
+        const auto cptr = my_candidates.data();
+        const auto tptr = my_thresholds.data();
+        const auto aptr = my_admitted.data();
+
+        std::size_t num_admitted = 0;
+        for (I<decltype(num_buffers)> p = 0; p < num_buffers; ++p) {
+            const unsigned char admit = cptr[p] >= tptr[p];
+            aptr[p] = admit;
+            num_admitted += admit;
+        }
+
+        if (my_counting) {
+            std::size_t num_nan = 0;
+            for (I<decltype(num_buffers)> p = 0; p < num_buffers; ++p) {
+                num_nan += std::isnan(cptr[p]);
+            }
+            my_num_accepted += num_admitted;
+            my_num_nan += num_nan;
+            my_num_rejected += num_buffers - num_admitted - num_nan;
+        }
+
+        if (num_admitted == 0) {
+            return;
+        }
+
+        // The lower bound only needs to be recomputed if one of the buffers at the bound has raised its threshold.
+        bool at_bound = false;
+        for (I<decltype(num_buffers)> p = 0; p < num_buffers; ++p) {
+            if (aptr[p]) {
+                auto& buffer = my_buffers[p];
+                buffer.emplace(cptr[p], index);
+                const auto old = tptr[p];
+                tptr[p] = std::max(old, buffer.threshold());
+                at_bound |= (old == my_min_threshold && tptr[p] != old && my_bounded[p]);
+            }
+        }
+        if (at_bound) {
+            update_min_threshold();
+        }
+    }
+};
+
+// All pairwise queues are stored in a flat set where the comparison of 'g1' over 'g2' is at 'g1 * ngroups + g2'.
+template<typename Stat_, typename Index_>
+class PairwiseTopQueues : public TopBufferSet<Stat_, Index_> {
+public:
+    PairwiseTopQueues(const Index_ num_keep, const std::size_t ngroups, const bool keep_ties) :
+        TopBufferSet<Stat_, Index_>(num_keep, sanisizer::product<std::size_t>(ngroups, ngroups), keep_ties),
+        my_ngroups(ngroups)
+    {
+        // The difference between a label and itself is always zero and is never admitted.
         for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
-            x.emplace_back(num_keep, true, opt);
+            this->exclude_from_bound(g * ngroups + g);
+        }
+    }
+
+private:
+    std::size_t my_ngroups;
+
+public:
+    std::size_t num_groups() const {
+        return my_ngroups;
+    }
+
+    TopBuffer<Stat_, Index_>& get(const std::size_t g1, const std::size_t g2) {
+        return this->buffer(g1 * my_ngroups + g2); // product is known to be safe from the constructor.
+    }
+};
+
+// Consolidating the i-th buffer from each thread-specific set into the first set, and returning the sorted entries.
+template<class BufferSet_>
+auto& merge_top_buffers(std::vector<std::optional<BufferSet_> >& sets, const std::size_t i) {
+    auto& current = sets.front()->buffer(i);
+    for (I<decltype(sets.size())> t = 1, end = sets.size(); t < end; ++t) {
+        current.merge(sets[t]->buffer(i));
+    }
+    return current.finalize(); // earliest element should have the strongest effect sizes.
+}
+
+template<bool include_stat_, typename Stat_, typename Index_, typename Marker_>
+void copy_top_entries(const std::vector<std::pair<Stat_, Index_> >& best, std::vector<Marker_>& output) {
+    output.reserve(best.size());
+    for (const auto& b : best) {
+        if constexpr(include_stat_) { 
+            output.emplace_back(b.second, b.first);
+        } else {
+            output.emplace_back(b.second);
         }
     }
 }
@@ -40,58 +314,91 @@ template<bool include_stat_, typename Stat_, typename Index_>
 void report_best_top_queues(
     std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > >& pqueues,
     const std::size_t ngroups,
-    Markers<include_stat_, Index_, Stat_>& output
+    Markers<include_stat_, Index_, Stat_>& output,
+    const int num_threads
 ) {
+    sanisizer::resize(output, ngroups);
+    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
+        sanisizer::resize(output[g1], ngroups);
+    }
+
     // We know it fits into an 'int' as this is what we got originally.
     const int num_available = pqueues.size();
     if (num_available == 0) {
-        sanisizer::resize(output, ngroups);
-        for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
-            sanisizer::resize(output[g1], ngroups);
-        }
         return;
     }
 
-    // Consolidating all of the thread-specific queues into a single queue.
-    auto& true_pqueue = *(pqueues.front());
-    for (int t = 1; t < num_available; ++t) {
-        auto& current_pqueue = *(pqueues[t]);
-        for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
-            for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
-                auto& current_in = current_pqueue[g1][g2];
-                auto& current_out = true_pqueue[g1][g2];
-                while (!current_in.empty()) {
-                    current_out.push(current_in.top());
-                    current_in.pop();
-                }
+    // Each pair is independent of the others, so we can consolidate the thread-specific queues and fill the output in parallel.
+    // The pairs are partitioned across threads so each output vector is only ever touched by a single thread.
+    const auto npairs = sanisizer::product<std::size_t>(ngroups, ngroups);
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t p = start, end = start + length; p < end; ++p) {
+            const std::size_t g1 = p / ngroups, g2 = p % ngroups;
+            if (g1 == g2) {
+                continue;
             }
+            copy_top_entries<include_stat_>(merge_top_buffers(pqueues, p), output[g1][g2]);
         }
+    }, npairs, num_threads);
+}
+
+// Flat output where all pairs are stored in a single set of arrays.
+// We first merge the thread-specific queues for each pair in parallel, which tells us the number of markers for each pair and thus the offsets.
+// Each pair is then copied into its own slice of the output arrays, again in parallel.
+template<bool include_stat_, typename Stat_, typename Index_>
+void report_best_top_queues(
+    std::vector<std::optional<PairwiseTopQueues<Stat_, Index_> > >& pqueues,
+    const std::size_t ngroups,
+    FlatMarkers<Index_, Stat_>& output,
+    const int num_threads
+) {
+    output.num_labels = ngroups;
+    const auto npairs = sanisizer::product<std::size_t>(ngroups, ngroups);
+    output.offsets = sanisizer::create<std::vector<std::size_t> >(sanisizer::sum<std::size_t>(npairs, 1));
+    output.indices.clear();
+    output.stats.clear();
+
+    if (pqueues.empty()) {
+        return;
     }
 
-    // Now spilling them out into a single vector.
-    sanisizer::resize(output, ngroups);
-    for (I<decltype(ngroups)> g1 = 0; g1 < ngroups; ++g1) {
-        sanisizer::resize(output[g1], ngroups);
-        for (I<decltype(ngroups)> g2 = 0; g2 < ngroups; ++g2) {
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t p = start, end = start + length; p < end; ++p) {
+            const std::size_t g1 = p / ngroups, g2 = p % ngroups;
             if (g1 == g2) {
                 continue;
             }
-            auto& current_in = true_pqueue[g1][g2];
-            auto& current_out = output[g1][g2];
-            while (!current_in.empty()) {
-                const auto& best = current_in.top();
-                if constexpr(include_stat_) { 
-                    current_out.emplace_back(best.second, best.first);
-                } else {
-                    current_out.emplace_back(best.second);
+            output.offsets[p + 1] = merge_top_buffers(pqueues, p).size();
+        }
+    }, npairs, num_threads);
+
+    for (std::size_t p = 0; p < npairs; ++p) {
+        output.offsets[p + 1] = sanisizer::sum<std::size_t>(output.offsets[p + 1], output.offsets[p]);
+    }
+    const auto total = output.offsets[npairs];
+    sanisizer::resize(output.indices, total);
+    if constexpr(include_stat_) {
+        sanisizer::resize(output.stats, total);
+    }
+
+    auto& merged = *(pqueues.front());
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t p = start, end = start + length; p < end; ++p) {
+            const auto& best = merged.buffer(p).entries();
+            const auto offset = output.offsets[p];
+            for (I<decltype(best.size())> i = 0, nbest = best.size(); i < nbest; ++i) {
+                output.indices[offset + i] = best[i].second;
+                if constexpr(include_stat_) {
+                    output.stats[offset + i] = best[i].first;
                 }
-                current_in.pop();
             }
-            std::reverse(current_out.begin(), current_out.end()); // earliest element should have the strongest effect sizes.
         }
-    }
+    }, npairs, num_threads);
 }
 
+template<bool include_stat_, bool flat_, typename Index_, typename Stat_>
+using MarkerOutput = typename std::conditional<flat_, FlatMarkers<Index_, Stat_>, Markers<include_stat_, Index_, Stat_> >::type;
+
 }
 
 #endif
@@ -3,78 +3,729 @@
 
 #include <vector>
 #include <cstddef>
+#include <limits>
+#include <algorithm>
+#include <optional>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <stdexcept>
 
 #include "sanisizer/sanisizer.hpp"
 #include "tatami/tatami.hpp"
-#include "quickstats/quickstats.hpp"
+
+#include "prefetch.hpp"
+#include "median.hpp"
+#include "sketch.hpp"
+#include "statistics.hpp"
+#include "progress.hpp"
+#include "utils.hpp"
 
 namespace singler_classic_markers {
 
-template<typename Stat_, typename Value_, typename Index_, typename Combo_, class Setup_, class Function_, class Finalize_>
-int scan_matrix(
+struct ScanOptions {
+    int num_threads = 1;
+    bool pipeline = false;
+    std::size_t pipeline_batch_size = 100;
+    std::size_t pipeline_depth = 2;
+    std::optional<std::size_t> column_slab_size;
+    std::optional<std::size_t> sketch_size; // only set for approximate medians.
+    std::vector<ThreadStatistics>* statistics = NULL; // only set for instrumentation, should have length equal to 'num_threads'.
+    std::optional<std::size_t> dynamic_chunk_size; // only set for dynamic scheduling.
+    std::optional<std::pair<std::size_t, std::size_t> > rows; // only set to scan a contiguous subset of rows, as (start, length).
+    const std::function<void(std::size_t, std::size_t)>* progress = NULL; // only set for progress reporting.
+    const std::atomic<bool>* cancel = NULL; // only set for cancellation.
+    std::size_t check_interval = 1000;
+};
+
+template<class Options_>
+ScanOptions create_scan_options(const Options_& options) {
+    ScanOptions output;
+    output.num_threads = options.num_threads;
+    output.pipeline = options.pipeline;
+    output.pipeline_batch_size = options.pipeline_batch_size;
+    output.pipeline_depth = options.pipeline_depth;
+    output.column_slab_size = options.column_slab_size;
+    if (options.approximate) {
+        output.sketch_size = options.approximate_sketch_size;
+    }
+    output.statistics = get_thread_statistics(options.statistics);
+    if (options.dynamic_scheduling) {
+        output.dynamic_chunk_size = options.dynamic_chunk_size;
+    }
+    if (options.progress) {
+        output.progress = &(options.progress);
+    }
+    output.cancel = options.cancel;
+    output.check_interval = options.check_interval;
+    return output;
+}
+
+// Number of rows in each slab, given the maximum number of values to be held in memory for each row of the slab.
+template<typename Index_>
+Index_ choose_slab_size(const ScanOptions& options, const Index_ length, const std::size_t values_per_row) {
+    Index_ slab_size;
+    if (options.column_slab_size.has_value()) {
+        slab_size = sanisizer::cap<Index_>(std::max<std::size_t>(1, *(options.column_slab_size)));
+    } else {
+        constexpr std::size_t default_slab_budget = 1000000; // number of values to hold in the workspace at once.
+        slab_size = sanisizer::cap<Index_>(std::max<std::size_t>(1, default_slab_budget / std::max<std::size_t>(1, values_per_row)));
+    }
+    return std::min(slab_size, length);
+}
+
+// Layout of the workspace for a single row, where the values for each combo are stored contiguously in a single arena.
+// Each column is assigned to one combo in each of 'num_schemes' schemes, e.g., for different labellings of the same reference.
+// For column 'j' and scheme 's', the combo is 'combos[j * num_schemes + s]'; this is stored in the layout so that the engines don't need to look up each scheme's array.
+// Each combo starts at 'offsets[c]' and each column is assigned to a 'slot' within its combo for each scheme, such that its position in the arena is 'offsets[c] + slots[j * num_schemes + s]'.
+// We also store the combos with at least one column, as there is no need to compute the medians for empty combos; these are always NaN.
+template<typename Index_>
+struct ComboLayout {
+    std::size_t num_schemes = 1;
+    std::size_t arena_size = 0;
+    std::vector<std::size_t> combos;
+    std::vector<std::size_t> offsets;
+    std::vector<Index_> slots;
+    std::vector<std::size_t> positions;
+    std::vector<std::size_t> nonempty;
+};
+
+// Each scheme's combo array should use a disjoint range of combo indices, and the combo sizes for each scheme should sum to NC.
+template<typename Index_, typename Combo_>
+ComboLayout<Index_> create_combo_layout(const Index_ NC, const std::size_t ncombos, const std::vector<const Combo_*>& combos, const std::vector<Index_>& combo_sizes) {
+    ComboLayout<Index_> layout;
+    layout.num_schemes = combos.size();
+    layout.arena_size = sanisizer::product<std::size_t>(NC, layout.num_schemes);
+
+    layout.offsets.reserve(ncombos);
+    std::size_t offset = 0;
+    for (std::size_t c = 0; c < ncombos; ++c) {
+        layout.offsets.push_back(offset);
+        offset += combo_sizes[c]; // no overflow is possible as the combo sizes sum to NC * num_schemes.
+        if (combo_sizes[c]) {
+            layout.nonempty.push_back(c);
+        }
+    }
+
+    layout.combos = sanisizer::create<std::vector<std::size_t> >(layout.arena_size);
+    layout.slots = sanisizer::create<std::vector<Index_> >(layout.arena_size);
+    layout.positions = sanisizer::create<std::vector<std::size_t> >(layout.arena_size);
+    auto filled = sanisizer::create<std::vector<Index_> >(ncombos);
+    for (Index_ j = 0; j < NC; ++j) {
+        for (std::size_t s = 0; s < layout.num_schemes; ++s) {
+            const auto i = static_cast<std::size_t>(j) * layout.num_schemes + s; // no overflow as this is less than arena_size.
+            const std::size_t c = combos[s][j];
+            auto& f = filled[c];
+            layout.combos[i] = c;
+            layout.slots[i] = f;
+            layout.positions[i] = layout.offsets[c] + f;
+            ++f;
+        }
+    }
+
+    return layout;
+}
+
+// For matrices that prefer row access, we extract each row and copy its values into the arena.
+// The medians for each combo are then computed in place on its contiguous slice of the arena.
+template<typename Stat_, typename Value_, typename Index_, class Function_, class Custom_>
+void scan_matrix_by_row(
     const tatami::Matrix<Value_, Index_>& matrix,
+    const Index_ start,
+    const Index_ length,
     const std::size_t ncombos,
-    const Combo_* combo,
     const std::vector<Index_>& combo_sizes,
-    Setup_ setup,
-    Function_ fun,
-    Finalize_ finalize,
-    const int num_threads
+    const ComboLayout<Index_>& layout,
+    Function_& fun,
+    Custom_& customwork,
+    std::vector<Stat_>& medians,
+    const ScanOptions& options,
+    PhaseTimer& extraction_timer,
+    PhaseTimer& median_timer,
+    ThreadStatistics& statistics
 ) {
-    const auto NR = matrix.nrow();
     const auto NC = matrix.ncol();
+    std::vector<Index_> histogram; // only used for integer values, see compute_median().
+    const auto nschemes = layout.num_schemes;
+    auto arena = sanisizer::create<std::vector<Value_> >(layout.arena_size);
 
-    return tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
-        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
-        auto customwork = setup();
-
-        auto medians = sanisizer::create<std::vector<Stat_> >(ncombos);
-        auto workspace = sanisizer::create<std::vector<std::vector<Value_> > >(ncombos);
+    if (matrix.is_sparse()) {
+        // For the sparse case, most combos usually have fewer non-zeros than half their size, so their median is known to be zero.
+        // We count the non-zeros in each combo first so that we only copy values into the arena and run the selection when necessary.
+        // The medians for all other combos are left at their default values, i.e., zero (or NaN for empty combos).
+        auto default_medians = sanisizer::create<std::vector<Stat_> >(ncombos);
+        Index_ min_combo_size = std::numeric_limits<Index_>::max();
         for (std::size_t c = 0; c < ncombos; ++c) {
-            workspace[c].reserve(combo_sizes[c]);
+            if (combo_sizes[c] == 0) {
+                default_medians[c] = std::numeric_limits<Stat_>::quiet_NaN();
+            } else {
+                min_combo_size = std::min(min_combo_size, combo_sizes[c]);
+            }
         }
+        medians = default_medians;
+
+        auto num_nonzero = sanisizer::create<std::vector<Index_> >(ncombos);
+        auto num_filled = sanisizer::create<std::vector<Index_> >(ncombos);
+        std::vector<std::size_t> touched, selected;
+        touched.reserve(ncombos);
+        selected.reserve(ncombos);
+
+        const auto process = [&](const Index_ r, const tatami::SparseRange<Value_, Index_>& range) -> void {
+            median_timer.start();
+            // Shortcut if there are so few non-zeros that no combo could possibly need a selection.
+            if (range.number >= min_combo_size || range.number >= min_combo_size - range.number) {
+                for (Index_ j = 0; j < range.number; ++j) {
+                    const auto cptr = layout.combos.data() + static_cast<std::size_t>(range.index[j]) * nschemes; // product is safe as it was checked in create_combo_layout().
+                    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                        const auto c = cptr[s];
+                        if (num_nonzero[c] == 0) {
+                            touched.push_back(c);
+                        }
+                        ++num_nonzero[c];
+                    }
+                }
+
+                for (auto c : touched) {
+                    if (num_nonzero[c] >= combo_sizes[c] - num_nonzero[c]) { // i.e., at least half of the combo is non-zero.
+                        selected.push_back(c);
+                    }
+                }
+
+                if (!selected.empty()) {
+                    for (Index_ j = 0; j < range.number; ++j) {
+                        const auto cptr = layout.combos.data() + static_cast<std::size_t>(range.index[j]) * nschemes;
+                        for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                            const auto c = cptr[s];
+                            if (num_nonzero[c] >= combo_sizes[c] - num_nonzero[c]) {
+                                auto& f = num_filled[c];
+                                arena[layout.offsets[c] + f] = range.value[j];
+                                ++f;
+                            }
+                        }
+                    }
+
+                    for (auto c : selected) {
+                        medians[c] = compute_median<Stat_>(combo_sizes[c], num_nonzero[c], arena.data() + layout.offsets[c], histogram);
+                        num_filled[c] = 0;
+                    }
+                }
+            }
+            median_timer.stop(statistics.median_time);
+
+            fun(r, medians, customwork);
+
+            for (auto c : selected) {
+                medians[c] = default_medians[c];
+            }
+            for (auto c : touched) {
+                num_nonzero[c] = 0;
+            }
+            touched.clear();
+            selected.clear();
+        };
 
-        if (matrix.is_sparse()) {
+        if (options.pipeline) {
+            prefetch_rows<true>(matrix, start, length, options.pipeline_batch_size, options.pipeline_depth, process, extraction_timer, statistics.extraction_time);
+        } else {
+            auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
             auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(NC);
             auto ext = tatami::consecutive_extractor<true>(matrix, true, start, length);
-            auto tmp_index = sanisizer::create<std::vector<Index_> >(ncombos);
-
             for (Index_ r = start, end = start + length; r < end; ++r) {
+                extraction_timer.start();
                 const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
-                for (Index_ j = 0; j < range.number; ++j) {
-                    workspace[combo[range.index[j]]].push_back(range.value[j]);
-                }
+                extraction_timer.stop(statistics.extraction_time);
+                process(r, range);
+            }
+        }
 
-                for (std::size_t c = 0; c < ncombos; ++c) {
-                    auto& w = workspace[c];
-                    medians[c] = quickstats::median<Stat_, Index_, Value_>(combo_sizes[c], w.size(), w.data());
-                    w.clear();
+    } else {
+        const auto process = [&](const Index_ r, const Value_* ptr) -> void {
+            median_timer.start();
+            const auto pptr = layout.positions.data();
+            const auto aptr = arena.data();
+            if (nschemes == 1) {
+                for (Index_ j = 0; j < NC; ++j) {
+                    aptr[pptr[j]] = ptr[j];
+                }
+            } else {
+                for (Index_ j = 0; j < NC; ++j) {
+                    const auto val = ptr[j];
+                    const auto jptr = pptr + static_cast<std::size_t>(j) * nschemes; // product is safe as it was checked in create_combo_layout().
+                    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                        aptr[jptr[s]] = val;
+                    }
                 }
+            }
 
-                fun(r, medians, customwork);
+            for (auto c : layout.nonempty) {
+                medians[c] = compute_median<Stat_>(combo_sizes[c], aptr + layout.offsets[c], histogram);
             }
+            median_timer.stop(statistics.median_time);
+
+            fun(r, medians, customwork);
+        };
 
+        if (options.pipeline) {
+            prefetch_rows<false>(matrix, start, length, options.pipeline_batch_size, options.pipeline_depth, process, extraction_timer, statistics.extraction_time);
         } else {
+            auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
             auto ext = tatami::consecutive_extractor<false>(matrix, true, start, length);
-
             for (Index_ r = start, end = start + length; r < end; ++r) {
+                extraction_timer.start();
                 const auto ptr = ext->fetch(vbuffer.data());
-                for (Index_ j = 0; j < NC; ++j) {
-                    workspace[combo[j]].push_back(ptr[j]);
+                extraction_timer.stop(statistics.extraction_time);
+                process(r, ptr);
+            }
+        }
+    }
+}
+
+// For matrices that prefer column access, we extract a slab of consecutive rows from each column and scatter the values into a workspace.
+// Each combo occupies a contiguous region of the workspace where each row of the slab has 'combo_sizes[c]' consecutive slots,
+// so that the medians for all rows in the slab can be computed in place once all columns have been visited.
+template<typename Stat_, typename Value_, typename Index_, class Function_, class Custom_>
+void scan_matrix_by_column(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Index_ start,
+    const Index_ length,
+    const std::size_t ncombos,
+    const std::vector<Index_>& combo_sizes,
+    const ComboLayout<Index_>& layout,
+    Function_& fun,
+    Custom_& customwork,
+    std::vector<Stat_>& medians,
+    const ScanOptions& options,
+    PhaseTimer& extraction_timer,
+    PhaseTimer& median_timer,
+    ThreadStatistics& statistics
+) {
+    const auto NC = matrix.ncol();
+    if (length == 0) {
+        return;
+    }
+
+    const auto nschemes = layout.num_schemes;
+    const auto slab_size = choose_slab_size(options, length, layout.arena_size);
+
+    auto workspace = sanisizer::create<std::vector<Value_> >(sanisizer::product<std::size_t>(slab_size, layout.arena_size));
+    const bool sparse = matrix.is_sparse();
+    auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(slab_size);
+    auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(sparse ? slab_size : 0);
+    auto num_nonzero = sanisizer::create<std::vector<Index_> >(sparse ? sanisizer::product<std::size_t>(slab_size, ncombos) : 0);
+    std::vector<Index_> histogram;
+
+    for (Index_ slab_start = start, end = start + length; slab_start < end; slab_start += slab_size) {
+        const Index_ slab_length = std::min<Index_>(slab_size, end - slab_start);
+        const auto slot_start = [&](const std::size_t c, const Index_ i) -> std::size_t {
+            // All products are safe as the workspace was allocated with 'slab_size * arena_size' elements.
+            return layout.offsets[c] * static_cast<std::size_t>(slab_length) + static_cast<std::size_t>(i) * static_cast<std::size_t>(combo_sizes[c]);
+        };
+
+        if (sparse) {
+            auto ext = tatami::consecutive_extractor<true>(matrix, false, static_cast<Index_>(0), NC, slab_start, slab_length);
+            for (Index_ j = 0; j < NC; ++j) {
+                extraction_timer.start();
+                const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                    const auto c = layout.combos[static_cast<std::size_t>(j) * nschemes + s];
+                    for (Index_ k = 0; k < range.number; ++k) {
+                        const Index_ i = range.index[k] - slab_start;
+                        auto& nnz = num_nonzero[static_cast<std::size_t>(i) * ncombos + c];
+                        workspace[slot_start(c, i) + nnz] = range.value[k];
+                        ++nnz;
+                    }
                 }
+                median_timer.stop(statistics.median_time);
+            }
+        } else {
+            auto ext = tatami::consecutive_extractor<false>(matrix, false, static_cast<Index_>(0), NC, slab_start, slab_length);
+            for (Index_ j = 0; j < NC; ++j) {
+                extraction_timer.start();
+                const auto ptr = ext->fetch(vbuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                    const auto js = static_cast<std::size_t>(j) * nschemes + s;
+                    const auto c = layout.combos[js];
+                    const auto slot = layout.slots[js];
+                    for (Index_ i = 0; i < slab_length; ++i) {
+                        workspace[slot_start(c, i) + slot] = ptr[i];
+                    }
+                }
+                median_timer.stop(statistics.median_time);
+            }
+        }
 
-                for (std::size_t c = 0; c < ncombos; ++c) {
-                    auto& w = workspace[c];
-                    medians[c] = quickstats::median<Stat_, Index_, Value_>(w.size(), w.data());
-                    w.clear();
+        for (Index_ i = 0; i < slab_length; ++i) {
+            median_timer.start();
+            for (auto c : layout.nonempty) {
+                const auto wptr = workspace.data() + slot_start(c, i);
+                if (sparse) {
+                    auto& nnz = num_nonzero[static_cast<std::size_t>(i) * ncombos + c];
+                    medians[c] = compute_median<Stat_>(combo_sizes[c], nnz, wptr, histogram);
+                    nnz = 0;
+                } else {
+                    medians[c] = compute_median<Stat_>(combo_sizes[c], wptr, histogram);
                 }
+            }
+            median_timer.stop(statistics.median_time);
+            fun(slab_start + i, medians, customwork);
+        }
+    }
+}
+
+// Approximate medians from a quantile sketch for each combo, see QuantileSketch for details.
+// For matrices that prefer row access, we extract each row in chunks of columns so that memory usage does not scale with the number of columns.
+template<typename Stat_, typename Value_, typename Index_, class Function_, class Custom_>
+void scan_matrix_approximate_by_row(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Index_ start,
+    const Index_ length,
+    const std::size_t ncombos,
+    const std::vector<Index_>& combo_sizes,
+    const ComboLayout<Index_>& layout,
+    Function_& fun,
+    Custom_& customwork,
+    std::vector<Stat_>& medians,
+    const ScanOptions& options,
+    PhaseTimer& extraction_timer,
+    PhaseTimer& median_timer,
+    ThreadStatistics& statistics
+) {
+    const auto NC = matrix.ncol();
+    if (length == 0) {
+        return;
+    }
+
+    const auto nschemes = layout.num_schemes;
+    constexpr std::size_t max_chunk_size = 65536;
+    const Index_ chunk_size = std::max<Index_>(1, std::min(NC, sanisizer::cap<Index_>(max_chunk_size)));
+    const bool sparse = matrix.is_sparse();
+    auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(chunk_size);
+    auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(sparse ? chunk_size : 0);
+    auto num_nonzero = sanisizer::create<std::vector<Index_> >(sparse ? ncombos : 0);
+    auto sketches = sanisizer::create<std::vector<QuantileSketch<Value_> > >(ncombos, QuantileSketch<Value_>(*(options.sketch_size)));
 
-                fun(r, medians, customwork);
+    const auto finish_row = [&](const Index_ r) -> void {
+        median_timer.start();
+        for (auto c : layout.nonempty) {
+            auto& sketch = sketches[c];
+            if (sparse) {
+                sketch.add_repeated(0, combo_sizes[c] - num_nonzero[c]);
+                num_nonzero[c] = 0;
+            }
+            medians[c] = sketch.template median<Stat_>();
+            sketch.clear();
+        }
+        median_timer.stop(statistics.median_time);
+        fun(r, medians, customwork);
+    };
+
+    if (sparse) {
+        std::vector<decltype(tatami::consecutive_extractor<true>(matrix, true, start, length, start, length))> extractors;
+        for (Index_ cstart = 0; cstart < NC; cstart += std::min<Index_>(chunk_size, NC - cstart)) {
+            extractors.push_back(tatami::consecutive_extractor<true>(matrix, true, start, length, cstart, std::min<Index_>(chunk_size, NC - cstart)));
+        }
+        for (Index_ r = start, end = start + length; r < end; ++r) {
+            for (auto& ext : extractors) {
+                extraction_timer.start();
+                const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                for (Index_ k = 0; k < range.number; ++k) {
+                    const auto cptr = layout.combos.data() + static_cast<std::size_t>(range.index[k]) * nschemes; // product is safe as it was checked in create_combo_layout().
+                    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                        const auto c = cptr[s];
+                        sketches[c].add(range.value[k]);
+                        ++num_nonzero[c];
+                    }
+                }
+                median_timer.stop(statistics.median_time);
             }
+            finish_row(r);
+        }
+
+    } else {
+        std::vector<decltype(tatami::consecutive_extractor<false>(matrix, true, start, length, start, length))> extractors;
+        for (Index_ cstart = 0; cstart < NC; cstart += std::min<Index_>(chunk_size, NC - cstart)) {
+            extractors.push_back(tatami::consecutive_extractor<false>(matrix, true, start, length, cstart, std::min<Index_>(chunk_size, NC - cstart)));
+        }
+        for (Index_ r = start, end = start + length; r < end; ++r) {
+            Index_ cstart = 0;
+            for (auto& ext : extractors) {
+                const Index_ clen = std::min<Index_>(chunk_size, NC - cstart);
+                extraction_timer.start();
+                const auto ptr = ext->fetch(vbuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                const auto cptr = layout.combos.data() + static_cast<std::size_t>(cstart) * nschemes;
+                for (Index_ j = 0; j < clen; ++j) {
+                    for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                        sketches[cptr[static_cast<std::size_t>(j) * nschemes + s]].add(ptr[j]);
+                    }
+                }
+                median_timer.stop(statistics.median_time);
+                cstart += clen;
+            }
+            finish_row(r);
+        }
+    }
+}
+
+// For matrices that prefer column access, we use a separate sketch for each row and combo in the slab.
+// The default slab size accounts for the maximum size of the sketches, which does not scale with the number of columns.
+template<typename Stat_, typename Value_, typename Index_, class Function_, class Custom_>
+void scan_matrix_approximate_by_column(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const Index_ start,
+    const Index_ length,
+    const std::size_t ncombos,
+    const std::vector<Index_>& combo_sizes,
+    const ComboLayout<Index_>& layout,
+    Function_& fun,
+    Custom_& customwork,
+    std::vector<Stat_>& medians,
+    const ScanOptions& options,
+    PhaseTimer& extraction_timer,
+    PhaseTimer& median_timer,
+    ThreadStatistics& statistics
+) {
+    const auto NC = matrix.ncol();
+    if (length == 0) {
+        return;
+    }
+
+    const auto nschemes = layout.num_schemes;
+    const auto sketch_size = *(options.sketch_size);
+    const auto slab_size = choose_slab_size(options, length, std::min<std::size_t>(layout.arena_size, sanisizer::product<std::size_t>(ncombos, sketch_size)));
+    const bool sparse = matrix.is_sparse();
+    auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(slab_size);
+    auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(sparse ? slab_size : 0);
+    const auto nsketches = sanisizer::product<std::size_t>(slab_size, ncombos);
+    auto num_nonzero = sanisizer::create<std::vector<Index_> >(sparse ? nsketches : 0);
+    auto sketches = sanisizer::create<std::vector<QuantileSketch<Value_> > >(nsketches, QuantileSketch<Value_>(sketch_size));
+
+    for (Index_ slab_start = start, end = start + length; slab_start < end; slab_start += slab_size) {
+        const Index_ slab_length = std::min<Index_>(slab_size, end - slab_start);
+
+        if (sparse) {
+            auto ext = tatami::consecutive_extractor<true>(matrix, false, static_cast<Index_>(0), NC, slab_start, slab_length);
+            for (Index_ j = 0; j < NC; ++j) {
+                extraction_timer.start();
+                const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                    const auto c = layout.combos[static_cast<std::size_t>(j) * nschemes + s];
+                    for (Index_ k = 0; k < range.number; ++k) {
+                        const auto offset = static_cast<std::size_t>(range.index[k] - slab_start) * ncombos + c; // product is safe as it was checked above.
+                        sketches[offset].add(range.value[k]);
+                        ++num_nonzero[offset];
+                    }
+                }
+                median_timer.stop(statistics.median_time);
+            }
+        } else {
+            auto ext = tatami::consecutive_extractor<false>(matrix, false, static_cast<Index_>(0), NC, slab_start, slab_length);
+            for (Index_ j = 0; j < NC; ++j) {
+                extraction_timer.start();
+                const auto ptr = ext->fetch(vbuffer.data());
+                extraction_timer.stop(statistics.extraction_time);
+                median_timer.start();
+                for (I<decltype(nschemes)> s = 0; s < nschemes; ++s) {
+                    const auto c = layout.combos[static_cast<std::size_t>(j) * nschemes + s];
+                    for (Index_ i = 0; i < slab_length; ++i) {
+                        sketches[static_cast<std::size_t>(i) * ncombos + c].add(ptr[i]);
+                    }
+                }
+                median_timer.stop(statistics.median_time);
+            }
+        }
+
+        for (Index_ i = 0; i < slab_length; ++i) {
+            median_timer.start();
+            for (auto c : layout.nonempty) {
+                const auto offset = static_cast<std::size_t>(i) * ncombos + c;
+                auto& sketch = sketches[offset];
+                if (sparse) {
+                    sketch.add_repeated(0, combo_sizes[c] - num_nonzero[offset]);
+                    num_nonzero[offset] = 0;
+                }
+                medians[c] = sketch.template median<Stat_>();
+                sketch.clear();
+            }
+            median_timer.stop(statistics.median_time);
+            fun(slab_start + i, medians, customwork);
+        }
+    }
+}
+
+// Each entry of 'combos' assigns the columns to combos for one scheme, see create_combo_layout() for details.
+template<typename Stat_, typename Value_, typename Index_, typename Combo_, class Setup_, class Function_, class Finalize_>
+int scan_matrix(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::size_t ncombos,
+    const std::vector<const Combo_*>& combos,
+    const std::vector<Index_>& combo_sizes,
+    Setup_ setup,
+    Function_ fun,
+    Finalize_ finalize,
+    const ScanOptions& options
+) {
+    const auto NC = matrix.ncol();
+    Index_ first_row = 0, NR = matrix.nrow();
+    if (options.rows.has_value()) {
+        const auto& rows = *(options.rows);
+        if (rows.first > static_cast<std::size_t>(NR) || rows.second > static_cast<std::size_t>(NR) - rows.first) {
+            throw std::runtime_error("requested range of rows is out of bounds");
+        }
+        first_row = rows.first;
+        NR = rows.second;
+    }
+
+    const bool by_row = matrix.prefer_rows();
+    const auto layout = create_combo_layout(NC, ncombos, combos, combo_sizes);
+    ProgressTracker tracker(options.progress, options.cancel, NR);
+    const bool tracked = tracker.active();
+    const std::size_t check_interval = std::max<std::size_t>(1, options.check_interval);
+
+    // Each worker calls 'for_each_range' with a function that processes a contiguous range of rows.
+    // This allows us to use the same worker for both static and dynamic scheduling.
+    const auto worker = [&](const int t, auto for_each_range) -> void {
+        auto customwork = setup();
+
+        // Each phase is timed directly by the engines, so that any overhead from the pipeline synchronization is not attributed to the medians.
+        ThreadStatistics statistics;
+        const bool instrumented = (options.statistics != NULL);
+        PhaseTimer extraction_timer(instrumented), median_timer(instrumented), queue_timer(instrumented);
+        // Progress and cancellation are only checked every 'check_interval' rows to keep them off the hot path.
+        // If cancelled, the exception unwinds through the engines so that all per-thread workspaces are released.
+        std::size_t since_check = 0;
+        const auto instrumented_fun = [&](const Index_ r, const std::vector<Stat_>& medians, auto& work) -> void {
+            queue_timer.start();
+            fun(r, medians, work);
+            queue_timer.stop(statistics.queue_time);
+            ++statistics.num_rows;
+            if (tracked) {
+                ++since_check;
+                if (since_check == check_interval) {
+                    tracker.add(since_check);
+                    since_check = 0;
+                }
+            }
+        };
+
+        // Medians for empty combos are never touched by the engines.
+        auto medians = sanisizer::create<std::vector<Stat_> >(ncombos, std::numeric_limits<Stat_>::quiet_NaN());
+        for_each_range([&](const Index_ start, const Index_ length) -> void {
+            if (tracked) {
+                tracker.check();
+            }
+            if (options.sketch_size.has_value()) {
+                if (by_row) {
+                    scan_matrix_approximate_by_row(matrix, start, length, ncombos, combo_sizes, layout, instrumented_fun, customwork, medians, options, extraction_timer, median_timer, statistics);
+                } else {
+                    scan_matrix_approximate_by_column(matrix, start, length, ncombos, combo_sizes, layout, instrumented_fun, customwork, medians, options, extraction_timer, median_timer, statistics);
+                }
+            } else if (by_row) {
+                scan_matrix_by_row(matrix, start, length, ncombos, combo_sizes, layout, instrumented_fun, customwork, medians, options, extraction_timer, median_timer, statistics);
+            } else {
+                scan_matrix_by_column(matrix, start, length, ncombos, combo_sizes, layout, instrumented_fun, customwork, medians, options, extraction_timer, median_timer, statistics);
+            }
+        });
+
+        if (instrumented) {
+            (*(options.statistics))[t] = statistics;
+        }
+
+        finalize(t, customwork);
+    };
+
+    if (!options.dynamic_chunk_size.has_value()) {
+        const int num_used = tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+            worker(t, [&](auto process_range) -> void { process_range(first_row + start, length); });
+        }, NR, options.num_threads);
+        tracker.finish();
+        return num_used;
+    }
+
+    // For dynamic scheduling, each worker repeatedly takes the next chunk of rows until all chunks are processed.
+    // This avoids stragglers when the cost per row is highly variable, e.g., for sparse matrices with clusters of highly expressed genes.
+    // The results are not affected as the queues from all workers are merged in a manner that does not depend on which worker processed each row.
+    const std::size_t chunk_size = std::max<std::size_t>(1, *(options.dynamic_chunk_size));
+    const std::size_t num_chunks = static_cast<std::size_t>(NR) / chunk_size + (static_cast<std::size_t>(NR) % chunk_size > 0);
+    const int num_workers = std::min<std::size_t>(std::max(1, options.num_threads), num_chunks); // cast is safe as it's no greater than num_threads.
+    std::atomic<std::size_t> next_chunk(0);
+
+    const int num_used = tatami::parallelize([&](const int t, const int, const int) -> void {
+        worker(t, [&](auto process_range) -> void {
+            while (1) {
+                const auto chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+                if (chunk >= num_chunks) {
+                    break;
+                }
+                const auto start = chunk * chunk_size; // no overflow as this is less than NR.
+                process_range(first_row + static_cast<Index_>(start), static_cast<Index_>(std::min<std::size_t>(chunk_size, static_cast<std::size_t>(NR) - start)));
+            }
+        });
+    }, num_workers, num_workers);
+    tracker.finish();
+    return num_used;
+}
+
+// Overload for the usual case of a single scheme.
+template<typename Stat_, typename Value_, typename Index_, typename Combo_, class Setup_, class Function_, class Finalize_>
+int scan_matrix(
+    const tatami::Matrix<Value_, Index_>& matrix,
+    const std::size_t ncombos,
+    const Combo_* combo,
+    const std::vector<Index_>& combo_sizes,
+    Setup_ setup,
+    Function_ fun,
+    Finalize_ finalize,
+    const ScanOptions& options
+) {
+    return scan_matrix<Stat_>(matrix, ncombos, std::vector<const Combo_*>{ combo }, combo_sizes, std::move(setup), std::move(fun), std::move(finalize), options);
+}
+
+// Same as scan_matrix() but for precomputed medians in a row-major array, e.g., from compute_median_profiles().
+template<typename Stat_, typename Index_, typename Profile_, class Setup_, class Function_, class Finalize_>
+int scan_profiles(
+    const Index_ nrow,
+    const std::size_t ncombos,
+    const Profile_* profiles,
+    Setup_ setup,
+    Function_ fun,
+    Finalize_ finalize,
+    const int num_threads,
+    std::vector<ThreadStatistics>* statistics
+) {
+    return tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+        auto customwork = setup();
+
+        // There is no extraction or computation of medians here, so only the queue time is reported.
+        ThreadStatistics curstatistics;
+        const bool instrumented = (statistics != NULL);
+        PhaseTimer queue_timer(instrumented);
+
+        auto medians = sanisizer::create<std::vector<Stat_> >(ncombos);
+        for (Index_ r = start, end = start + length; r < end; ++r) {
+            const auto ptr = profiles + static_cast<std::size_t>(r) * ncombos; // product is safe as the profiles must have been allocated.
+            std::copy_n(ptr, ncombos, medians.begin());
+            queue_timer.start();
+            fun(r, medians, customwork);
+            queue_timer.stop(curstatistics.queue_time);
+        }
+
+        if (instrumented) {
+            curstatistics.num_rows = length;
+            (*statistics)[t] = curstatistics;
         }
 
         finalize(t, customwork);
-    }, NR, num_threads);
+    }, nrow, num_threads);
 }
 
 }
@@ -4,6 +4,16 @@
 #include "number.hpp"
 #include "choose.hpp"
 #include "blocked.hpp"
+#include "profiles.hpp"
+#include "add_label.hpp"
+#include "statistics.hpp"
+#include "flat.hpp"
+#include "cache.hpp"
+#include "multiple.hpp"
+#include "partial.hpp"
+#include "progress.hpp"
+#include "one_vs_rest.hpp"
+#include "hierarchical.hpp"
 
 /**
  * @file singler_classic_markers.hpp
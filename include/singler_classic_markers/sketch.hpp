@@ -0,0 +1,135 @@
+#ifndef SINGLER_CLASSIC_MARKERS_SKETCH_HPP
+#define SINGLER_CLASSIC_MARKERS_SKETCH_HPP
+
+#include <vector>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <utility>
+
+namespace singler_classic_markers {
+
+// Deterministic merge-reduce sketch for approximating the median of a stream of values.
+// Each level holds values with a weight of 2^level; once a level fills up to 'capacity', it is sorted and every second value is promoted to the next level.
+// The offset of the promoted values alternates between compactions at each level so that the errors tend to cancel out.
+//
+// Each compaction at level 'i' shifts the rank of any value by no more than 2^i, and there are no more than n / (capacity * 2^i) such compactions.
+// Thus, the rank error of the reported median is no greater than (n / capacity) * (1 + log2(n / capacity)) for n observations.
+// The median is exact if n <= capacity, as no compactions are performed.
+// Memory usage is bounded by approximately capacity * (1 + log2(n / capacity)) values.
+template<typename Value_>
+class QuantileSketch {
+public:
+    QuantileSketch(const std::size_t capacity) : my_capacity(std::max<std::size_t>(2, capacity + capacity % 2)) {}
+
+public:
+    void add(const Value_ value) {
+        if constexpr(std::is_floating_point<Value_>::value) {
+            if (std::isnan(value)) {
+                return;
+            }
+        }
+        add_to_level(value, 0);
+    }
+
+    // Adding a value with a multiplicity of 'count', by inserting it directly into the levels corresponding to the set bits of 'count'.
+    template<typename Count_>
+    void add_repeated(const Value_ value, Count_ count) {
+        std::size_t level = 0;
+        while (count > 0) {
+            if (count & 1) {
+                add_to_level(value, level);
+            }
+            count >>= 1;
+            ++level;
+        }
+    }
+
+    template<typename Stat_>
+    Stat_ median() {
+        if (my_total == 0) {
+            return std::numeric_limits<Stat_>::quiet_NaN();
+        }
+
+        my_collected.clear();
+        for (std::size_t l = 0, nlevels = my_levels.size(); l < nlevels; ++l) {
+            const std::size_t weight = static_cast<std::size_t>(1) << l;
+            for (const auto& x : my_levels[l]) {
+                my_collected.emplace_back(x, weight);
+            }
+        }
+        std::sort(my_collected.begin(), my_collected.end());
+
+        // Same approach as histogram_median(), where the weights are equivalent to the histogram counts.
+        const std::size_t half = my_total / 2;
+        const bool even = (my_total % 2 == 0);
+        std::size_t cumulative = 0;
+        Value_ lower = 0;
+        bool found_lower = false;
+        for (const auto& x : my_collected) {
+            cumulative += x.second;
+            if (even && !found_lower && cumulative >= half) {
+                lower = x.first;
+                found_lower = true;
+            }
+            if (cumulative > half) {
+                const Stat_ mid = x.first;
+                if (!even) {
+                    return mid;
+                }
+                return (mid + static_cast<Stat_>(lower)) / 2;
+            }
+        }
+
+        return std::numeric_limits<Stat_>::quiet_NaN(); // should be unreachable.
+    }
+
+    void clear() {
+        for (auto& l : my_levels) {
+            l.clear();
+        }
+        std::fill(my_offsets.begin(), my_offsets.end(), 0); // so that the result only depends on the values since the last clear().
+        my_total = 0;
+    }
+
+private:
+    std::size_t my_capacity;
+    std::size_t my_total = 0;
+    std::vector<std::vector<Value_> > my_levels;
+    std::vector<unsigned char> my_offsets;
+    std::vector<std::pair<Value_, std::size_t> > my_collected;
+
+    void add_to_level(const Value_ value, std::size_t level) {
+        my_total += static_cast<std::size_t>(1) << level;
+        ensure_level(level);
+        my_levels[level].push_back(value);
+
+        while (my_levels[level].size() >= my_capacity) {
+            ensure_level(level + 1);
+            auto& current = my_levels[level];
+            auto& next = my_levels[level + 1];
+            std::sort(current.begin(), current.end());
+
+            auto& offset = my_offsets[level];
+            for (std::size_t i = offset, end = current.size(); i < end; i += 2) {
+                next.push_back(current[i]);
+            }
+            offset = !offset;
+            current.clear();
+            ++level;
+        }
+    }
+
+    void ensure_level(const std::size_t level) {
+        if (my_levels.size() <= level) {
+            my_levels.resize(level + 1);
+            my_offsets.resize(level + 1);
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef SINGLER_CLASSIC_MARKERS_STATISTICS_HPP
+#define SINGLER_CLASSIC_MARKERS_STATISTICS_HPP
+
+#include <cstddef>
+#include <vector>
+#include <chrono>
+
+/**
+ * @file statistics.hpp
+ * @brief Instrumentation of the marker detection.
+ */
+
+namespace singler_classic_markers {
+
+/**
+ * @brief Statistics for a single thread.
+ *
+ * All times are reported in seconds of wall time.
+ */
+struct ThreadStatistics {
+    /**
+     * Time spent extracting rows or columns from the matrix.
+     * If `pipeline = true`, this is the time spent waiting for the extraction thread.
+     */
+    double extraction_time = 0;
+
+    /**
+     * Time spent computing the medians for each row, including the copying of values into the workspace.
+     * This is always zero for functions that use precomputed medians, e.g., `choose_from_profiles()`.
+     */
+    double median_time = 0;
+
+    /**
+     * Time spent computing the differences between medians and adding them to the queues.
+     */
+    double queue_time = 0;
+
+    /**
+     * Number of rows processed by this thread.
+     */
+    std::size_t num_rows = 0;
+
+    /**
+     * Number of candidate differences that were inserted into the queues.
+     * Each row contributes one candidate for each comparison that is evaluated, which is counted in exactly one of `num_accepted`, `num_rejected`, `num_nan` or `num_pruned`.
+     * For `choose()`, there is one comparison for each ordered pair of labels, including pairs involving the same label.
+     * Other functions may evaluate a different number of comparisons per row,
+     * e.g., one per label for `choose_one_vs_rest()`, or one per ordered pair for each of the mean and minimum markers in `choose_blocked_both()`.
+     */
+    std::size_t num_accepted = 0;
+
+    /**
+     * Number of candidate differences that were not inserted into the queues,
+     * e.g., because they were not positive or they were lower than the current threshold of the queue.
+     * This does not include the NaN or pruned candidates.
+     */
+    std::size_t num_rejected = 0;
+
+    /**
+     * Number of candidate differences that were skipped because they were NaN, e.g., due to missing medians.
+     */
+    std::size_t num_nan = 0;
+
+    /**
+     * Number of candidate differences that were never computed because their row was pruned,
+     * i.e., the range of the medians for that row was less than the lowest threshold across all queues.
+     * These candidates would have been rejected if they were computed.
+     * This does not include the NaN candidates.
+     */
+    std::size_t num_pruned = 0;
+};
+
+/**
+ * @brief Statistics for a single call to a marker detection function.
+ *
+ * This can be passed to the `statistics` field of `ChooseOptions`, `ChooseBlockedOptions` or `ComputeMedianProfilesOptions`.
+ * All existing contents are overwritten by each call.
+ */
+struct ChooseStatistics {
+    /**
+     * Statistics for each thread.
+     * The length of this vector is equal to the number of threads that were actually used.
+     */
+    std::vector<ThreadStatistics> threads;
+
+    /**
+     * Time spent merging the per-thread queues and reporting the markers, in seconds of wall time.
+     */
+    double merge_time = 0;
+};
+
+/**
+ * @cond
+ */
+// Only recording the time if statistics are requested, so that there is no overhead beyond a single branch when they are disabled.
+class PhaseTimer {
+public:
+    PhaseTimer(const bool enabled) : my_enabled(enabled) {}
+
+    void start() {
+        if (my_enabled) {
+            my_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    void stop(double& total) {
+        if (my_enabled) {
+            total += std::chrono::duration<double>(std::chrono::steady_clock::now() - my_start).count();
+        }
+    }
+
+private:
+    bool my_enabled;
+    std::chrono::steady_clock::time_point my_start;
+};
+
+inline void initialize_statistics(ChooseStatistics* statistics, const int num_threads) {
+    if (statistics) {
+        statistics->threads.clear();
+        statistics->threads.resize(num_threads > 0 ? num_threads : 1);
+        statistics->merge_time = 0;
+    }
+}
+
+inline void finalize_statistics(ChooseStatistics* statistics, const int num_used) {
+    if (statistics) {
+        statistics->threads.resize(num_used);
+    }
+}
+
+template<class Function_>
+void time_merge(ChooseStatistics* statistics, Function_ fun) {
+    PhaseTimer timer(statistics != NULL);
+    timer.start();
+    fun();
+    if (statistics) {
+        timer.stop(statistics->merge_time);
+    }
+}
+
+inline std::vector<ThreadStatistics>* get_thread_statistics(ChooseStatistics* statistics) {
+    if (statistics) {
+        return &(statistics->threads);
+    } else {
+        return NULL;
+    }
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
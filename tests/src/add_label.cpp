@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <memory>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/add_label.hpp"
+
+#include "tatami/tatami.hpp"
+
+class AddLabelTest : public ::testing::TestWithParam<int> {
+protected:
+    static std::pair<std::shared_ptr<tatami::Matrix<double, int> >, std::shared_ptr<tatami::Matrix<double, int> > > split_matrix(
+        const std::shared_ptr<tatami::Matrix<double, int> >& mat,
+        const std::vector<int>& labels,
+        int chosen,
+        std::vector<int>& old_columns,
+        std::vector<int>& new_columns
+    ) {
+        std::vector<int> old_subset, new_subset;
+        for (int c = 0, end = labels.size(); c < end; ++c) {
+            if (labels[c] == chosen) {
+                new_subset.push_back(c);
+            } else {
+                old_subset.push_back(c);
+            }
+        }
+        old_columns = old_subset;
+        new_columns = new_subset;
+        return std::make_pair(
+            tatami::make_DelayedSubset<double, int>(mat, std::move(old_subset), false),
+            tatami::make_DelayedSubset<double, int>(mat, std::move(new_subset), false)
+        );
+    }
+};
+
+TEST_P(AddLabelTest, Basic) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1357 * requested, /* density = */ 0.5);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2468 * requested);
+
+    std::vector<int> old_columns, new_columns;
+    auto split = split_matrix(mat, labels, nlabels - 1, old_columns, new_columns);
+    std::vector<int> old_labels;
+    for (auto c : old_columns) {
+        old_labels.push_back(labels[c]);
+    }
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto expected = singler_classic_markers::choose(*mat, labels.data(), mopt);
+
+    {
+        auto profiles = singler_classic_markers::compute_median_profiles(*(split.first), old_labels.data(), {});
+        auto existing = singler_classic_markers::choose_from_profiles(profiles, mopt);
+        auto added = singler_classic_markers::add_label(existing, profiles, *(split.second), mopt);
+        EXPECT_EQ(added, expected);
+
+        // Profiles are updated correctly.
+        auto full_profiles = singler_classic_markers::compute_median_profiles(*mat, labels.data(), {});
+        EXPECT_EQ(profiles.num_labels, nlabels);
+        EXPECT_EQ(profiles.medians, full_profiles.medians);
+    }
+
+    // Works with indices only, and in parallel.
+    {
+        auto profiles = singler_classic_markers::compute_median_profiles(*(split.first), old_labels.data(), {});
+        auto existing = singler_classic_markers::choose_index_from_profiles(profiles, mopt);
+        mopt.num_threads = 3;
+        auto added = singler_classic_markers::add_label_index(existing, profiles, *(split.second), mopt);
+        EXPECT_EQ(added, strip_to_indices(expected));
+    }
+}
+
+TEST_P(AddLabelTest, Blocked) {
+    size_t ngenes = 500;
+    size_t nsamples = 80;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 9753 * requested, /* density = */ 0.8);
+    size_t nlabels = 4, nblocks = 3;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8642 * requested);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 1212 * requested);
+
+    std::vector<int> old_columns, new_columns;
+    auto split = split_matrix(mat, labels, nlabels - 1, old_columns, new_columns);
+    std::vector<int> old_labels, old_blocks, new_blocks;
+    for (auto c : old_columns) {
+        old_labels.push_back(labels[c]);
+        old_blocks.push_back(blocks[c]);
+    }
+    for (auto c : new_columns) {
+        new_blocks.push_back(blocks[c]);
+    }
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto expected = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+
+        auto profiles = singler_classic_markers::compute_blocked_median_profiles(*(split.first), old_labels.data(), old_blocks.data(), {});
+        auto existing = singler_classic_markers::choose_blocked_from_profiles(profiles, bopt);
+        auto added = singler_classic_markers::add_label_blocked(existing, profiles, *(split.second), new_blocks.data(), bopt);
+        EXPECT_EQ(added, expected);
+
+        auto iprofiles = singler_classic_markers::compute_blocked_median_profiles(*(split.first), old_labels.data(), old_blocks.data(), {});
+        auto iexisting = singler_classic_markers::choose_blocked_index_from_profiles(iprofiles, bopt);
+        auto iadded = singler_classic_markers::add_label_blocked_index(iexisting, iprofiles, *(split.second), new_blocks.data(), bopt);
+        EXPECT_EQ(iadded, strip_to_indices(expected));
+    }
+}
+
+TEST_P(AddLabelTest, BlockedPartlyShared) {
+    size_t ngenes = 500;
+    size_t nsamples = 150;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 3579 * requested, /* density = */ 0.8);
+    size_t nlabels = 4, nblocks = 8;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2468 * requested);
+
+    // With this offset, the new label is the only one in block 6 but no block is only present in the new label.
+    auto blocks = spawn_partly_shared_blocks(labels, nblocks, /* span = */ 5, /* offset = */ 7, /* seed = */ 1313 * requested);
+
+    std::vector<int> old_columns, new_columns;
+    auto split = split_matrix(mat, labels, nlabels - 1, old_columns, new_columns);
+    std::vector<int> old_labels, old_blocks, new_blocks;
+    for (auto c : old_columns) {
+        old_labels.push_back(labels[c]);
+        old_blocks.push_back(blocks[c]);
+    }
+    for (auto c : new_columns) {
+        new_blocks.push_back(blocks[c]);
+    }
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto expected = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+
+        auto profiles = singler_classic_markers::compute_blocked_median_profiles(*(split.first), old_labels.data(), old_blocks.data(), {});
+        auto existing = singler_classic_markers::choose_blocked_from_profiles(profiles, bopt);
+        auto added = singler_classic_markers::add_label_blocked(existing, profiles, *(split.second), new_blocks.data(), bopt);
+        EXPECT_EQ(added, expected);
+
+        // Combination sizes are updated so that the profiles can be re-used.
+        auto full_profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), {});
+        EXPECT_EQ(profiles.combo_sizes, full_profiles.combo_sizes);
+        EXPECT_EQ(singler_classic_markers::choose_blocked_from_profiles(profiles, bopt), expected);
+
+        // Same results if the combination sizes need to be inferred from the medians, in which case they are not updated.
+        auto uprofiles = singler_classic_markers::compute_blocked_median_profiles(*(split.first), old_labels.data(), old_blocks.data(), {});
+        uprofiles.combo_sizes.clear();
+        auto uadded = singler_classic_markers::add_label_blocked(existing, uprofiles, *(split.second), new_blocks.data(), bopt);
+        EXPECT_EQ(uadded, expected);
+        EXPECT_TRUE(uprofiles.combo_sizes.empty());
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AddLabel,
+    AddLabelTest,
+    ::testing::Values(1, 20, 50, 1000) // number of top genes.
+);
+
+TEST(AddLabel, Errors) {
+    auto mat = spawn_matrix(20, 10, /* seed = */ 100, /* density = */ 0.5);
+    auto labels = spawn_labels(10, 3, /* seed = */ 200);
+    auto profiles = singler_classic_markers::compute_median_profiles(*mat, labels.data(), {});
+    auto existing = singler_classic_markers::choose_from_profiles(profiles, {});
+
+    auto other = spawn_matrix(10, 5, /* seed = */ 300, /* density = */ 0.5);
+    EXPECT_ANY_THROW(singler_classic_markers::add_label(existing, profiles, *other, {}));
+
+    existing.pop_back();
+    EXPECT_ANY_THROW(singler_classic_markers::add_label(existing, profiles, *mat, {}));
+}
@@ -3,12 +3,15 @@
 #include <cmath>
 #include <vector>
 #include <cstddef>
+#include <random>
+#include <algorithm>
 
 #include "utils.h"
 #include "spawn_matrix.h"
 
 #include "singler_classic_markers/blocked.hpp"
 #include "singler_classic_markers/choose.hpp"
+#include "singler_classic_markers/profiles.hpp"
 
 #include "tatami/tatami.hpp"
 #include "tatami_stats/tatami_stats.hpp"
@@ -135,6 +138,11 @@ TEST_P(BlockedTest, Multiple) {
     bopt.num_threads = 3;
     auto blockedp = singler_classic_markers::choose_blocked(combined, labels.data(), blocks.data(), bopt);
     EXPECT_EQ(mean_blocked, blockedp);
+
+    // Same result with sparse.
+    auto scombined = tatami::convert_to_compressed_sparse<double, int>(combined, true, {});
+    auto sblocked = singler_classic_markers::choose_blocked(*scombined, labels.data(), blocks.data(), bopt);
+    EXPECT_EQ(mean_blocked, sblocked);
 }
 
 TEST_P(BlockedTest, Overlap) { 
@@ -274,6 +282,204 @@ TEST_P(BlockedTest, Impossible) {
     }
 }
 
+TEST_P(BlockedTest, EmptyLast) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 2468 * requested, /* density = */ 0.3);
+    size_t nlabels = 3;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 1357 * requested);
+
+    // The last label only occurs in the first block, so the last label/block combination is empty.
+    std::vector<int> blocks(nsamples);
+    for (size_t i = 0; i < nsamples; ++i) {
+        blocks[i] = (labels[i] == 2 ? 0 : i % 2);
+    }
+
+    singler_classic_markers::ChooseBlockedOptions bopt;
+    bopt.number = requested;
+    auto blocked = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+
+    // Same results if the blocks are swapped so that the empty combination is no longer last.
+    auto swapped = blocks;
+    for (auto& b : swapped) {
+        b = 1 - b;
+    }
+    EXPECT_EQ(blocked, singler_classic_markers::choose_blocked(*mat, labels.data(), swapped.data(), bopt));
+
+    bopt.use_minimum = true;
+    EXPECT_EQ(
+        singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt),
+        singler_classic_markers::choose_blocked(*mat, labels.data(), swapped.data(), bopt)
+    );
+}
+
+TEST_P(BlockedTest, ManyBlocks) { 
+    size_t ngenes = 200;
+    size_t nsamples = 120;
+    int requested = GetParam();
+
+    // Rounding to quarters so that the sums across blocks are exact regardless of the order of addition.
+    std::mt19937_64 rng(requested * 42);
+    std::normal_distribution<> ndist;
+    std::vector<double> contents(ngenes * nsamples);
+    for (auto& x : contents) {
+        x = std::round(ndist(rng) * 4) / 4;
+    }
+    std::shared_ptr<tatami::Matrix<double, int> > mat(new tatami::DenseColumnMatrix<double, int>(ngenes, nsamples, std::move(contents)));
+
+    size_t nlabels = 4, nblocks = 7;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 1357 * requested);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 2468 * requested);
+
+    std::vector<std::vector<std::vector<double> > > medians; // block, label, gene.
+    for (size_t b = 0; b < nblocks; ++b) {
+        std::vector<int> subset, sublabels;
+        for (size_t c = 0; c < nsamples; ++c) {
+            if (static_cast<size_t>(blocks[c]) == b) {
+                subset.push_back(c);
+                sublabels.push_back(labels[c]);
+            }
+        }
+        auto submat = tatami::make_DelayedSubset<double, int>(mat, std::move(subset), false);
+        auto curmed = tatami_stats::grouped_medians::by_row(*submat, sublabels.data(), {});
+        curmed.resize(nlabels, std::vector<double>(ngenes, std::numeric_limits<double>::quiet_NaN()));
+        medians.push_back(std::move(curmed));
+    }
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto blocked = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+
+        // Same result with pipelined extraction.
+        auto pbopt = bopt;
+        pbopt.pipeline = true;
+        pbopt.pipeline_batch_size = 9;
+        pbopt.num_threads = 2;
+        auto pblocked = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), pbopt);
+        EXPECT_EQ(blocked, pblocked);
+
+        std::vector<double> buffer(ngenes);
+        for (size_t l = 0; l < nlabels; ++l) {
+            for (size_t l2 = 0; l2 < nlabels; ++l2) {
+                for (size_t r = 0; r < ngenes; ++r) {
+                    double sum = 0, count = 0, min = std::numeric_limits<double>::infinity();
+                    for (size_t b = 0; b < nblocks; ++b) {
+                        double delta = medians[b][l][r] - medians[b][l2][r];
+                        if (!std::isnan(delta)) {
+                            sum += delta;
+                            ++count;
+                            min = std::min(min, delta);
+                        }
+                    }
+                    buffer[r] = (use_minimum ? min : sum / count);
+                }
+
+                topicks::PickTopGenesOptions<double> opt;
+                opt.bound = 0;
+                auto keep = topicks::pick_top_genes_index<int>(ngenes, buffer.data(), requested, true, opt);
+                std::vector<std::pair<int, double> > expected;
+                for (auto k : keep) {
+                    expected.emplace_back(k, buffer[k]);
+                }
+                std::sort(expected.begin(), expected.end(), [](const std::pair<int, double>& left, const std::pair<int, double>& right) -> bool {
+                    if (left.second == right.second) {
+                        return left.first < right.first;
+                    } else {
+                        return left.second > right.second;
+                    }
+                });
+
+                EXPECT_EQ(blocked[l][l2], expected);
+            }
+        }
+    }
+}
+
+TEST_P(BlockedTest, AbsentBlocks) { 
+    size_t ngenes = 200;
+    size_t nsamples = 150;
+    int requested = GetParam();
+
+    // Rounding to quarters so that the sums across blocks are exact regardless of the order of addition.
+    std::mt19937_64 rng(requested * 24);
+    std::normal_distribution<> ndist;
+    std::uniform_real_distribution<> udist;
+    std::vector<double> contents(ngenes * nsamples);
+    for (auto& x : contents) {
+        x = (udist(rng) < 0.5 ? std::round(ndist(rng) * 4) / 4 : 0);
+    }
+    std::shared_ptr<tatami::Matrix<double, int> > mat(new tatami::DenseColumnMatrix<double, int>(ngenes, nsamples, std::move(contents)));
+
+    // Each label is only present in two of the blocks, so some pairs of labels share one block while others share none.
+    size_t nlabels = 6, nblocks = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 9753 * requested);
+    std::vector<int> blocks(nsamples);
+    for (size_t c = 0; c < nsamples; ++c) {
+        blocks[c] = (labels[c] + (rng() % 2) * 2) % nblocks;
+    }
+
+    auto profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), {});
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto blocked = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+
+        // Same result as iterating over all blocks.
+        EXPECT_EQ(blocked, singler_classic_markers::choose_blocked_from_profiles(profiles, bopt));
+        EXPECT_EQ(blocked, singler_classic_markers::choose_blocked(*smat, labels.data(), blocks.data(), bopt));
+
+        // Labels that share no blocks have no markers.
+        EXPECT_TRUE(blocked[0][1].empty());
+        EXPECT_TRUE(blocked[1][0].empty());
+        EXPECT_FALSE(blocked[0][2].empty());
+    }
+}
+
+TEST_P(BlockedTest, Both) { 
+    size_t ngenes = 500;
+    size_t nsamples = 90;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 4321 * requested, /* density = */ 0.3);
+    size_t nlabels = 5, nblocks = 3;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8765 * requested);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 2109 * requested);
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+
+    singler_classic_markers::ChooseBlockedOptions bopt;
+    bopt.number = requested;
+    auto mean_ref = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+    auto min_bopt = bopt;
+    min_bopt.use_minimum = true;
+    auto min_ref = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), min_bopt);
+
+    auto both = singler_classic_markers::choose_blocked_both(*mat, labels.data(), blocks.data(), bopt);
+    EXPECT_EQ(both.mean, mean_ref);
+    EXPECT_EQ(both.minimum, min_ref);
+
+    // use_minimum is ignored.
+    auto min_both = singler_classic_markers::choose_blocked_both(*smat, labels.data(), blocks.data(), min_bopt);
+    EXPECT_EQ(min_both.mean, mean_ref);
+    EXPECT_EQ(min_both.minimum, min_ref);
+
+    auto iboth = singler_classic_markers::choose_blocked_index_both(*smat, labels.data(), blocks.data(), bopt);
+    EXPECT_EQ(iboth.mean, strip_to_indices(mean_ref));
+    EXPECT_EQ(iboth.minimum, strip_to_indices(min_ref));
+
+    // Same result when parallelized.
+    bopt.num_threads = 3;
+    auto pboth = singler_classic_markers::choose_blocked_both(*mat, labels.data(), blocks.data(), bopt);
+    EXPECT_EQ(pboth.mean, mean_ref);
+    EXPECT_EQ(pboth.minimum, min_ref);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     Blocked,
     BlockedTest,
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/cache.hpp"
+
+class CacheTest : public ::testing::Test {
+protected:
+    std::string directory;
+
+    void SetUp() {
+        directory = testing::TempDir() + "/singler_classic_markers_cache_test";
+        std::filesystem::remove_all(directory);
+    }
+
+    void TearDown() {
+        std::filesystem::remove_all(directory);
+    }
+
+    std::size_t count_files() const {
+        std::size_t count = 0;
+        for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator(directory)) {
+            ++count;
+        }
+        return count;
+    }
+};
+
+TEST_F(CacheTest, Basic) {
+    auto mat = spawn_matrix(300, 40, /* seed = */ 123, /* density = */ 0.5);
+    auto labels = spawn_labels(40, 4, /* seed = */ 321);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = 15;
+    singler_classic_markers::CacheOptions copt;
+    copt.directory = directory;
+
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+    auto cached = singler_classic_markers::choose_flat_cached(*mat, labels.data(), opt, copt);
+    auto flattened = singler_classic_markers::flatten_markers(ref);
+    EXPECT_EQ(cached.offsets, flattened.offsets);
+    EXPECT_EQ(cached.indices, flattened.indices);
+    EXPECT_EQ(cached.stats, flattened.stats);
+    EXPECT_EQ(count_files(), 1);
+
+    // Same result when loading from the cache.
+    auto reloaded = singler_classic_markers::choose_flat_cached(*mat, labels.data(), opt, copt);
+    EXPECT_EQ(reloaded.offsets, flattened.offsets);
+    EXPECT_EQ(reloaded.indices, flattened.indices);
+    EXPECT_EQ(reloaded.stats, flattened.stats);
+    EXPECT_EQ(singler_classic_markers::choose_index_cached(*mat, labels.data(), opt, copt), strip_to_indices(ref));
+    EXPECT_EQ(count_files(), 1);
+
+    // Options that don't affect the results use the same cache entry.
+    auto popt = opt;
+    popt.num_threads = 2;
+    singler_classic_markers::choose_flat_cached(*mat, labels.data(), popt, copt);
+    EXPECT_EQ(count_files(), 1);
+
+    // Changing the options, labels or matrix creates a new entry.
+    auto nopt = opt;
+    nopt.number = 10;
+    EXPECT_EQ(singler_classic_markers::choose_index_cached(*mat, labels.data(), nopt, copt), singler_classic_markers::choose_index(*mat, labels.data(), nopt));
+    EXPECT_EQ(count_files(), 2);
+
+    auto labels2 = labels;
+    std::swap(labels2.front(), labels2.back());
+    singler_classic_markers::choose_flat_cached(*mat, labels2.data(), opt, copt);
+    EXPECT_EQ(count_files(), 3);
+
+    auto mat2 = spawn_matrix(300, 40, /* seed = */ 1234, /* density = */ 0.5);
+    singler_classic_markers::choose_flat_cached(*mat2, labels.data(), opt, copt);
+    EXPECT_EQ(count_files(), 4);
+}
+
+TEST_F(CacheTest, Hit) {
+    auto mat = spawn_matrix(300, 40, /* seed = */ 456, /* density = */ 0.5);
+    auto labels = spawn_labels(40, 3, /* seed = */ 654);
+    singler_classic_markers::ChooseOptions opt;
+    singler_classic_markers::CacheOptions copt;
+    copt.directory = directory;
+    copt.num_sampled_rows.reset();
+
+    auto cached = singler_classic_markers::choose_flat_cached(*mat, labels.data(), opt, copt);
+    ASSERT_EQ(count_files(), 1);
+    const auto path = std::filesystem::directory_iterator(directory)->path().string();
+
+    // Replacing the cached file to check that it is used directly without recomputation.
+    auto modified = cached;
+    for (auto& x : modified.stats) {
+        x *= 2;
+    }
+    singler_classic_markers::save_flat_markers(modified, path);
+    auto reloaded = singler_classic_markers::choose_flat_cached(*mat, labels.data(), opt, copt);
+    EXPECT_EQ(reloaded.stats, modified.stats);
+
+    // Corrupted files are recomputed and replaced.
+    {
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        output << "foobar";
+    }
+    auto recomputed = singler_classic_markers::choose_flat_cached(*mat, labels.data(), opt, copt);
+    EXPECT_EQ(recomputed.stats, cached.stats);
+    auto reloaded2 = singler_classic_markers::load_flat_markers<int, double>(path);
+    EXPECT_EQ(reloaded2.stats, cached.stats);
+}
+
+TEST_F(CacheTest, Blocked) {
+    auto mat = spawn_matrix(300, 60, /* seed = */ 789, /* density = */ 0.5);
+    auto labels = spawn_labels(60, 4, /* seed = */ 987);
+    auto blocks = spawn_labels(60, 3, /* seed = */ 879);
+
+    singler_classic_markers::ChooseBlockedOptions opt;
+    opt.number = 20;
+    singler_classic_markers::CacheOptions copt;
+    copt.directory = directory;
+
+    auto ref = singler_classic_markers::choose_blocked_index(*mat, labels.data(), blocks.data(), opt);
+    EXPECT_EQ(singler_classic_markers::choose_blocked_index_cached(*mat, labels.data(), blocks.data(), opt, copt), ref);
+    EXPECT_EQ(singler_classic_markers::choose_blocked_index_cached(*mat, labels.data(), blocks.data(), opt, copt), ref);
+    EXPECT_EQ(count_files(), 1);
+
+    opt.use_minimum = true;
+    auto min_ref = singler_classic_markers::choose_blocked_index(*mat, labels.data(), blocks.data(), opt);
+    EXPECT_EQ(singler_classic_markers::choose_blocked_index_cached(*mat, labels.data(), blocks.data(), opt, copt), min_ref);
+    EXPECT_EQ(count_files(), 2);
+
+    // Unblocked and blocked analyses don't share entries.
+    singler_classic_markers::ChooseOptions uopt;
+    uopt.number = 20;
+    singler_classic_markers::choose_index_cached(*mat, labels.data(), uopt, copt);
+    EXPECT_EQ(count_files(), 3);
+}
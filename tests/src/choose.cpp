@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 
+#include <vector>
+#include <random>
+
 #include "utils.h"
 #include "spawn_matrix.h"
 
@@ -117,6 +120,245 @@ TEST_P(ChooseTest, Missing) {
     }
 }
 
+TEST_P(ChooseTest, Sparse) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 5555 * requested);
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+
+    // Checking that the sparse shortcuts for the medians are correct at a variety of densities.
+    for (double density : { 0.05, 0.2, 0.5, 0.8, 1.0 }) {
+        auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1111 * requested + density * 100, density);
+        auto output = singler_classic_markers::choose(*mat, labels.data(), mopt);
+        auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+        auto soutput = singler_classic_markers::choose(*smat, labels.data(), mopt);
+        EXPECT_EQ(output, soutput);
+    }
+}
+
+TEST_P(ChooseTest, Pipeline) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 2222 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 3333 * requested);
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), mopt);
+
+    // Checking a variety of batch sizes, including those that don't divide evenly into the number of rows.
+    mopt.pipeline = true;
+    for (std::size_t batch_size : { 1, 7, 100, 1000 }) {
+        mopt.pipeline_batch_size = batch_size;
+        for (int nthreads : { 1, 3 }) {
+            mopt.num_threads = nthreads;
+            auto output = singler_classic_markers::choose(*mat, labels.data(), mopt);
+            EXPECT_EQ(output, ref);
+            auto soutput = singler_classic_markers::choose(*smat, labels.data(), mopt);
+            EXPECT_EQ(soutput, ref);
+        }
+    }
+}
+
+TEST_P(ChooseTest, ColumnAccess) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 4444 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 7777 * requested);
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto rmat = tatami::convert_to_dense<double, int>(*mat, true, {});
+    EXPECT_TRUE(rmat->prefer_rows());
+    auto ref = singler_classic_markers::choose(*rmat, labels.data(), mopt);
+
+    // Checking a variety of slab sizes, including those that don't divide evenly into the number of rows.
+    auto csmat = tatami::convert_to_compressed_sparse<double, int>(*mat, false, {});
+    EXPECT_FALSE(mat->prefer_rows());
+    EXPECT_FALSE(csmat->prefer_rows());
+    for (std::size_t slab_size : { 1, 7, 100, 1000 }) {
+        mopt.column_slab_size = slab_size;
+        for (int nthreads : { 1, 3 }) {
+            mopt.num_threads = nthreads;
+            auto output = singler_classic_markers::choose(*mat, labels.data(), mopt);
+            EXPECT_EQ(output, ref);
+            auto soutput = singler_classic_markers::choose(*csmat, labels.data(), mopt);
+            EXPECT_EQ(soutput, ref);
+        }
+    }
+}
+
+TEST_P(ChooseTest, Integer) { 
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    // Mimicking count data with a mix of small and large ranges, to check that the counting medians are correct.
+    std::mt19937_64 rng(requested * 13);
+    std::vector<int> icontents(ngenes * nsamples);
+    for (size_t i = 0; i < ngenes; ++i) {
+        std::poisson_distribution<int> pdist(i % 2 ? 2.0 : 1000.0);
+        for (size_t j = 0; j < nsamples; ++j) {
+            icontents[i + j * ngenes] = pdist(rng);
+        }
+    }
+    std::vector<double> dcontents(icontents.begin(), icontents.end());
+    tatami::DenseColumnMatrix<int, int> imat(ngenes, nsamples, std::move(icontents));
+    tatami::DenseColumnMatrix<double, int> dmat(ngenes, nsamples, std::move(dcontents));
+
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8888 * requested);
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto ref = singler_classic_markers::choose(dmat, labels.data(), mopt);
+    EXPECT_EQ(singler_classic_markers::choose(imat, labels.data(), mopt), ref);
+
+    auto rimat = tatami::convert_to_dense<int, int>(imat, true, {});
+    EXPECT_EQ(singler_classic_markers::choose(*rimat, labels.data(), mopt), ref);
+    auto simat = tatami::convert_to_compressed_sparse<int, int>(imat, true, {});
+    EXPECT_EQ(singler_classic_markers::choose(*simat, labels.data(), mopt), ref);
+    auto csimat = tatami::convert_to_compressed_sparse<int, int>(imat, false, {});
+    EXPECT_EQ(singler_classic_markers::choose(*csimat, labels.data(), mopt), ref);
+}
+
+TEST_P(ChooseTest, Approximate) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 9999 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 1212 * requested);
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), mopt);
+
+    // Sketches are exact if they are larger than each group.
+    mopt.approximate = true;
+    std::vector<std::shared_ptr<tatami::Matrix<double, int> > > matrices {
+        mat,
+        tatami::convert_to_dense<double, int>(*mat, true, {}),
+        tatami::convert_to_compressed_sparse<double, int>(*mat, true, {}),
+        tatami::convert_to_compressed_sparse<double, int>(*mat, false, {})
+    };
+    for (const auto& m : matrices) {
+        auto output = singler_classic_markers::choose(*m, labels.data(), mopt);
+        EXPECT_EQ(output, ref);
+    }
+
+    // Small sketches are deterministic and unaffected by parallelization or slab size.
+    mopt.approximate_sketch_size = 4;
+    for (const auto& m : matrices) {
+        auto output = singler_classic_markers::choose(*m, labels.data(), mopt);
+        auto copt = mopt;
+        copt.num_threads = 3;
+        copt.column_slab_size = 7;
+        auto poutput = singler_classic_markers::choose(*m, labels.data(), copt);
+        EXPECT_EQ(output, poutput);
+    }
+}
+
+TEST_P(ChooseTest, DynamicScheduling) { 
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 3131 * requested, /* density = */ 0.2);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 4141 * requested);
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), mopt);
+
+    std::vector<std::shared_ptr<tatami::Matrix<double, int> > > matrices {
+        mat,
+        tatami::convert_to_dense<double, int>(*mat, true, {}),
+        tatami::convert_to_compressed_sparse<double, int>(*mat, true, {}),
+        tatami::convert_to_compressed_sparse<double, int>(*mat, false, {})
+    };
+
+    mopt.dynamic_scheduling = true;
+    for (std::size_t chunk_size : { 1, 7, 100, 1000 }) {
+        mopt.dynamic_chunk_size = chunk_size;
+        for (int nthreads : { 1, 3 }) {
+            mopt.num_threads = nthreads;
+            for (const auto& m : matrices) {
+                auto output = singler_classic_markers::choose(*m, labels.data(), mopt);
+                EXPECT_EQ(output, ref);
+            }
+        }
+    }
+}
+
+TEST_P(ChooseTest, Pruning) { 
+    size_t ngenes = 1000;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    // Most genes have small differences between labels, so they should be skipped once the queues are filled by the informative genes.
+    std::mt19937_64 rng(4242 * requested);
+    std::normal_distribution<> dist;
+    std::vector<double> contents(ngenes * nsamples);
+    for (size_t r = 0; r < ngenes; ++r) {
+        const double scale = (r % 10 == 0 ? 10 : 0.01);
+        for (size_t c = 0; c < nsamples; ++c) {
+            contents[r * nsamples + c] = dist(rng) * scale;
+        }
+    }
+    tatami::DenseRowMatrix<double, int> mat(ngenes, nsamples, std::move(contents));
+
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2424 * requested);
+
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    mopt.keep_ties = false;
+    auto output = singler_classic_markers::choose(mat, labels.data(), mopt);
+    EXPECT_EQ(output, reference(mat, labels.data(), requested));
+
+    // Pruned rows skip the computation of their differences.
+    singler_classic_markers::ChooseStatistics stats;
+    mopt.statistics = &stats;
+    EXPECT_EQ(singler_classic_markers::choose(mat, labels.data(), mopt), output);
+    std::size_t ncomputed = 0, npruned = 0;
+    for (const auto& t : stats.threads) {
+        ncomputed += t.num_accepted + t.num_rejected + t.num_nan;
+        npruned += t.num_pruned;
+    }
+    EXPECT_EQ(ncomputed + npruned, ngenes * nlabels * nlabels);
+    if (static_cast<std::size_t>(requested) < ngenes) {
+        EXPECT_GT(npruned, 0);
+        EXPECT_LT(ncomputed, ngenes * nlabels * nlabels);
+    } else {
+        EXPECT_EQ(npruned, 0); // queues are never filled, so no row can be pruned.
+    }
+    mopt.statistics = NULL;
+
+    // Pruning is still exact with missing labels, whose comparisons do not contribute to the bound.
+    for (auto& l : labels) {
+        ++l;
+    }
+    auto output2 = singler_classic_markers::choose(mat, labels.data(), mopt);
+    for (std::size_t l = 1; l <= nlabels; ++l) {
+        for (std::size_t l2 = 1; l2 <= nlabels; ++l2) {
+            EXPECT_EQ(output[l-1][l2-1], output2[l][l2]);
+        }
+    }
+}
+
 INSTANTIATE_TEST_SUITE_P(
     Choose,
     ChooseTest,
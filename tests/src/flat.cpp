@@ -0,0 +1,244 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <iterator>
+#include <cstddef>
+#include <algorithm>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/flat.hpp"
+#include "singler_classic_markers/choose.hpp"
+#include "singler_classic_markers/blocked.hpp"
+#include "singler_classic_markers/profiles.hpp"
+
+template<typename Index_, typename Stat_>
+void compare_flat(const singler_classic_markers::FlatMarkersView<Index_, Stat_>& flat, const std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > >& nested) {
+    ASSERT_EQ(flat.num_labels, nested.size());
+    std::size_t total = 0;
+    for (std::size_t l = 0; l < nested.size(); ++l) {
+        for (std::size_t l2 = 0; l2 < nested.size(); ++l2) {
+            const auto& expected = nested[l][l2];
+            const auto pair = flat.get(l, l2);
+            ASSERT_EQ(pair.number, expected.size());
+            ASSERT_TRUE(pair.stats != NULL);
+            for (std::size_t i = 0; i < expected.size(); ++i) {
+                EXPECT_EQ(pair.indices[i], expected[i].first);
+                EXPECT_EQ(pair.stats[i], expected[i].second);
+            }
+            total += expected.size();
+        }
+    }
+    EXPECT_EQ(flat.total(), total);
+}
+
+class FlatTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(FlatTest, Choose) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1357 * requested, /* density = */ 0.5);
+    size_t nlabels = 6;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2468 * requested);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+
+    auto flat = singler_classic_markers::choose_flat(*mat, labels.data(), opt);
+    compare_flat(singler_classic_markers::view_flat_markers(flat), ref);
+
+    auto flattened = singler_classic_markers::flatten_markers(ref);
+    EXPECT_EQ(flat.offsets, flattened.offsets);
+    EXPECT_EQ(flat.indices, flattened.indices);
+    EXPECT_EQ(flat.stats, flattened.stats);
+
+    // Same result when parallelized.
+    opt.num_threads = 3;
+    auto pflat = singler_classic_markers::choose_flat(*mat, labels.data(), opt);
+    EXPECT_EQ(flat.offsets, pflat.offsets);
+    EXPECT_EQ(flat.indices, pflat.indices);
+    EXPECT_EQ(flat.stats, pflat.stats);
+
+    // Same result from the profiles.
+    auto profiles = singler_classic_markers::compute_median_profiles(*mat, labels.data(), {});
+    auto prof_flat = singler_classic_markers::choose_flat_from_profiles(profiles, opt);
+    EXPECT_EQ(flat.offsets, prof_flat.offsets);
+    EXPECT_EQ(flat.indices, prof_flat.indices);
+    EXPECT_EQ(flat.stats, prof_flat.stats);
+
+    // Flattening the indices only.
+    auto iflat = singler_classic_markers::flatten_markers(strip_to_indices(ref));
+    EXPECT_EQ(flat.offsets, iflat.offsets);
+    EXPECT_EQ(flat.indices, iflat.indices);
+    EXPECT_TRUE(iflat.stats.empty());
+    auto iview = singler_classic_markers::view_flat_markers(iflat);
+    EXPECT_TRUE(iview.stats == NULL);
+    EXPECT_TRUE(iview.get(1, 0).stats == NULL);
+}
+
+TEST_P(FlatTest, Blocked) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 9753 * requested, /* density = */ 0.5);
+    size_t nlabels = 4, nblocks = 3;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8642 * requested);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 1111 * requested);
+    auto profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), {});
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions opt;
+        opt.number = requested;
+        opt.use_minimum = use_minimum;
+        auto ref = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), opt);
+
+        auto flat = singler_classic_markers::choose_blocked_flat(*mat, labels.data(), blocks.data(), opt);
+        compare_flat(singler_classic_markers::view_flat_markers(flat), ref);
+
+        auto prof_flat = singler_classic_markers::choose_blocked_flat_from_profiles(profiles, opt);
+        compare_flat(singler_classic_markers::view_flat_markers(prof_flat), ref);
+    }
+}
+
+TEST_P(FlatTest, Union) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 5555 * requested, /* density = */ 0.5);
+    auto labels = spawn_labels(nsamples, 5, /* seed = */ 6666 * requested);
+    auto blocks = spawn_labels(nsamples, 2, /* seed = */ 7777 * requested);
+
+    auto check = [&](const singler_classic_markers::UnionMarkers<int, double>& res, const std::vector<std::vector<std::vector<int> > >& ref) -> void {
+        std::vector<int> expected;
+        for (const auto& x : ref) {
+            for (const auto& y : x) {
+                expected.insert(expected.end(), y.begin(), y.end());
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+        expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+        EXPECT_EQ(res.features, expected);
+
+        auto remapped = singler_classic_markers::flatten_markers(ref);
+        EXPECT_EQ(res.markers.offsets, remapped.offsets);
+        EXPECT_TRUE(res.markers.stats.empty());
+        ASSERT_EQ(res.markers.indices.size(), remapped.indices.size());
+        for (size_t i = 0; i < remapped.indices.size(); ++i) {
+            EXPECT_EQ(res.features[res.markers.indices[i]], remapped.indices[i]);
+        }
+    };
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    check(singler_classic_markers::choose_union(*mat, labels.data(), opt), singler_classic_markers::choose_index(*mat, labels.data(), opt));
+
+    singler_classic_markers::ChooseBlockedOptions bopt;
+    bopt.number = requested;
+    check(singler_classic_markers::choose_blocked_union(*mat, labels.data(), blocks.data(), bopt), singler_classic_markers::choose_blocked_index(*mat, labels.data(), blocks.data(), bopt));
+
+    // Stats are carried through if they were present in the input.
+    auto full = singler_classic_markers::choose_flat(*mat, labels.data(), opt);
+    auto fullunion = singler_classic_markers::union_markers(full, static_cast<int>(ngenes));
+    EXPECT_EQ(fullunion.markers.stats, full.stats);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Flat,
+    FlatTest,
+    ::testing::Values(1, 20, 1000) // number of top genes.
+);
+
+TEST(Flat, Empty) {
+    tatami::DenseColumnMatrix<double, int> mat(0, 4, std::vector<double>());
+    std::vector<int> grouping { 0, 1, 0, 2 };
+    auto flat = singler_classic_markers::choose_flat(mat, grouping.data(), {});
+    EXPECT_EQ(flat.num_labels, 3);
+    EXPECT_EQ(flat.offsets, std::vector<std::size_t>(10));
+    EXPECT_TRUE(flat.indices.empty());
+    EXPECT_TRUE(flat.stats.empty());
+    EXPECT_EQ(singler_classic_markers::view_flat_markers(flat).get(2, 1).number, 0);
+}
+
+TEST(Flat, Inconsistent) {
+    std::vector<std::vector<std::vector<int> > > nested(2);
+    nested[0].resize(2);
+    nested[1].resize(3);
+    EXPECT_ANY_THROW(singler_classic_markers::flatten_markers(nested));
+}
+
+TEST(Flat, Serialization) {
+    auto mat = spawn_matrix(200, 40, /* seed = */ 42, /* density = */ 0.5);
+    auto labels = spawn_labels(40, 5, /* seed = */ 24);
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = 13;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+    auto flat = singler_classic_markers::choose_flat(*mat, labels.data(), opt);
+
+    const std::string path = testing::TempDir() + "/singler_classic_markers_flat_test.bin";
+    singler_classic_markers::save_flat_markers(flat, path);
+
+    {
+        auto loaded = singler_classic_markers::load_flat_markers<int, double>(path);
+        EXPECT_EQ(loaded.num_labels, flat.num_labels);
+        EXPECT_EQ(loaded.offsets, flat.offsets);
+        EXPECT_EQ(loaded.indices, flat.indices);
+        EXPECT_EQ(loaded.stats, flat.stats);
+    }
+
+    {
+        singler_classic_markers::MappedFlatMarkers<int, double> mapped(path);
+        compare_flat(mapped.view(), ref);
+    }
+
+    // Mismatched types are not allowed.
+    EXPECT_ANY_THROW((singler_classic_markers::load_flat_markers<int, float>(path)));
+    EXPECT_ANY_THROW((singler_classic_markers::load_flat_markers<unsigned int, double>(path)));
+    EXPECT_ANY_THROW((singler_classic_markers::MappedFlatMarkers<long, double>(path)));
+
+    // Works without the statistics.
+    auto iflat = singler_classic_markers::flatten_markers(strip_to_indices(ref));
+    singler_classic_markers::save_flat_markers(iflat, path);
+    {
+        auto loaded = singler_classic_markers::load_flat_markers<int, double>(path);
+        EXPECT_EQ(loaded.offsets, iflat.offsets);
+        EXPECT_EQ(loaded.indices, iflat.indices);
+        EXPECT_TRUE(loaded.stats.empty());
+
+        singler_classic_markers::MappedFlatMarkers<int, double> mapped(path);
+        const auto& view = mapped.view();
+        EXPECT_TRUE(view.stats == NULL);
+        EXPECT_EQ(view.total(), iflat.indices.size());
+        const auto pair = view.get(2, 4);
+        EXPECT_EQ(std::vector<int>(pair.indices, pair.indices + pair.number), strip_to_indices(ref)[2][4]);
+    }
+
+    // Truncated files are not allowed.
+    {
+        std::ifstream input(path, std::ios::binary);
+        std::vector<char> contents((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        output.write(contents.data(), contents.size() - 4);
+    }
+    EXPECT_ANY_THROW((singler_classic_markers::load_flat_markers<int, double>(path)));
+    EXPECT_ANY_THROW((singler_classic_markers::MappedFlatMarkers<int, double>(path)));
+
+    {
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        output << "foobar";
+    }
+    EXPECT_ANY_THROW((singler_classic_markers::load_flat_markers<int, double>(path)));
+    EXPECT_ANY_THROW((singler_classic_markers::MappedFlatMarkers<int, double>(path)));
+
+    std::remove(path.c_str());
+    EXPECT_ANY_THROW((singler_classic_markers::load_flat_markers<int, double>(path)));
+    EXPECT_ANY_THROW((singler_classic_markers::MappedFlatMarkers<int, double>(path)));
+}
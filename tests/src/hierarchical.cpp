@@ -0,0 +1,243 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cstddef>
+#include <optional>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/hierarchical.hpp"
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+class HierarchicalTest : public ::testing::TestWithParam<int> {
+protected:
+    static std::vector<std::pair<int, double> > top_markers(const std::vector<double>& left, const std::vector<double>& right, std::size_t num_keep) {
+        std::vector<std::pair<int, double> > output;
+        for (int r = 0, end = left.size(); r < end; ++r) {
+            const double diff = left[r] - right[r];
+            if (diff > 0) {
+                output.emplace_back(r, diff);
+            }
+        }
+        std::sort(output.begin(), output.end(), [](const std::pair<int, double>& l, const std::pair<int, double>& r) -> bool {
+            if (l.second == r.second) {
+                return l.first < r.first;
+            } else {
+                return l.second > r.second;
+            }
+        });
+        if (output.size() > num_keep) {
+            output.resize(num_keep);
+        }
+        return output;
+    }
+};
+
+TEST_P(HierarchicalTest, Flat) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1212 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 3434 * requested);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+
+    // All labels are roots, so this is the same as the pairwise comparisons.
+    std::vector<std::optional<std::size_t> > parents(nlabels);
+    auto output = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt);
+    ASSERT_EQ(output.children.size(), nlabels + 1);
+    ASSERT_EQ(output.markers.size(), nlabels + 1);
+    for (size_t l = 0; l < nlabels; ++l) {
+        EXPECT_TRUE(output.children[l].empty());
+        EXPECT_TRUE(output.markers[l].empty());
+    }
+    std::vector<std::size_t> expected_children(nlabels);
+    std::iota(expected_children.begin(), expected_children.end(), 0);
+    EXPECT_EQ(output.children[nlabels], expected_children);
+    EXPECT_EQ(output.markers[nlabels], ref);
+
+    // Same for a single root above all labels.
+    parents.resize(nlabels + 1);
+    for (size_t l = 0; l < nlabels; ++l) {
+        parents[l] = nlabels;
+    }
+    auto output2 = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt);
+    ASSERT_EQ(output2.markers.size(), nlabels + 2);
+    EXPECT_EQ(output2.children[nlabels], expected_children);
+    EXPECT_EQ(output2.markers[nlabels], ref);
+    EXPECT_EQ(output2.children[nlabels + 1], std::vector<std::size_t>{ nlabels });
+    ASSERT_EQ(output2.markers[nlabels + 1].size(), 1);
+    ASSERT_EQ(output2.markers[nlabels + 1][0].size(), 1);
+    EXPECT_TRUE(output2.markers[nlabels + 1][0][0].empty());
+}
+
+TEST_P(HierarchicalTest, Tree) {
+    size_t ngenes = 500;
+    size_t nsamples = 80;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 5656 * requested, /* density = */ 0.3);
+    size_t nlabels = 7;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 7878 * requested);
+
+    // Nodes 7 and 8 are the parents of labels 0-2 and 3-6, respectively, and are children of the root node 9.
+    std::vector<std::optional<std::size_t> > parents{ 7, 7, 7, 8, 8, 8, 8, 9, 9, std::nullopt };
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto output = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt);
+    ASSERT_EQ(output.children.size(), 11);
+    EXPECT_EQ(output.children[7], std::vector<std::size_t>({ 0, 1, 2 }));
+    EXPECT_EQ(output.children[8], std::vector<std::size_t>({ 3, 4, 5, 6 }));
+    EXPECT_EQ(output.children[9], std::vector<std::size_t>({ 7, 8 }));
+    EXPECT_EQ(output.children[10], std::vector<std::size_t>{ 9 });
+
+    // Comparisons between labels are the same as the pairwise comparisons.
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            EXPECT_EQ(output.markers[7][i][j], ref[i][j]);
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            EXPECT_EQ(output.markers[8][i][j], ref[i + 3][j + 3]);
+        }
+    }
+
+    // Comparisons between the internal nodes use the median of the labels' medians.
+    auto medians = tatami_stats::grouped_medians::by_row(*mat, labels.data(), {});
+    std::vector<double> left(ngenes), right(ngenes);
+    for (size_t r = 0; r < ngenes; ++r) {
+        left[r] = simple_median({ medians[0][r], medians[1][r], medians[2][r] });
+        right[r] = simple_median({ medians[3][r], medians[4][r], medians[5][r], medians[6][r] });
+    }
+    ASSERT_EQ(output.markers[9].size(), 2);
+    EXPECT_EQ(output.markers[9][0][1], top_markers(left, right, requested));
+    EXPECT_EQ(output.markers[9][1][0], top_markers(right, left, requested));
+    EXPECT_TRUE(output.markers[9][0][0].empty());
+    EXPECT_TRUE(output.markers[9][1][1].empty());
+
+    auto ioutput = singler_classic_markers::choose_hierarchical_index(*mat, labels.data(), parents, opt);
+    EXPECT_EQ(ioutput.children, output.children);
+    ASSERT_EQ(ioutput.markers.size(), output.markers.size());
+    for (size_t p = 0; p < output.markers.size(); ++p) {
+        EXPECT_EQ(ioutput.markers[p], strip_to_indices(output.markers[p]));
+    }
+
+    // Same results for other matrix representations and when parallelized.
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    EXPECT_EQ(singler_classic_markers::choose_hierarchical(*smat, labels.data(), parents, opt).markers, output.markers);
+    opt.num_threads = 3;
+    EXPECT_EQ(singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt).markers, output.markers);
+    EXPECT_EQ(singler_classic_markers::choose_hierarchical(*smat, labels.data(), parents, opt).markers, output.markers);
+}
+
+TEST_P(HierarchicalTest, Missing) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 9090 * requested, /* density = */ 0.3);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 1010 * requested);
+    std::vector<std::optional<std::size_t> > parents{ 4, 4, 5, 5, std::nullopt, std::nullopt };
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto output = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt);
+
+    // Adding an empty label under one node, as well as an empty internal node at the root.
+    for (auto& l : labels) {
+        if (l >= 2) {
+            ++l;
+        }
+    }
+    std::vector<std::optional<std::size_t> > parents2{ 6, 6, 6, 7, 7, std::nullopt, std::nullopt, std::nullopt };
+    auto output2 = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents2, opt);
+
+    ASSERT_EQ(output2.children[6], std::vector<std::size_t>({ 0, 1, 2 }));
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            if (i == 2 || j == 2) {
+                EXPECT_TRUE(output2.markers[6][i][j].empty());
+            } else {
+                EXPECT_EQ(output2.markers[6][i][j], output.markers[4][i][j]);
+            }
+        }
+    }
+    EXPECT_EQ(output2.markers[7], output.markers[5]);
+
+    ASSERT_EQ(output2.children[8], std::vector<std::size_t>({ 5, 6, 7 }));
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            if (i == 0 || j == 0) {
+                EXPECT_TRUE(output2.markers[8][i][j].empty());
+            } else {
+                EXPECT_EQ(output2.markers[8][i][j], output.markers[6][i - 1][j - 1]);
+            }
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Hierarchical,
+    HierarchicalTest,
+    ::testing::Values(5, 10, 100) // number of top genes.
+);
+
+TEST(Hierarchical, Statistics) {
+    size_t ngenes = 200;
+    size_t nsamples = 40;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 2323, /* density = */ 0.3);
+    auto labels = spawn_labels(nsamples, 5, /* seed = */ 3232);
+    std::vector<std::optional<std::size_t> > parents{ 5, 5, 6, 6, 6, std::nullopt, std::nullopt };
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = 10;
+    opt.num_threads = 2;
+    auto ref = singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt);
+
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    EXPECT_EQ(singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, opt).markers, ref.markers);
+
+    std::size_t nrows = 0, ntotal = 0;
+    for (const auto& t : stats.threads) {
+        nrows += t.num_rows;
+        ntotal += t.num_accepted + t.num_rejected + t.num_nan + t.num_pruned;
+    }
+    EXPECT_EQ(nrows, ngenes);
+    EXPECT_EQ(ntotal, ngenes * (2 * 2 + 3 * 3 + 2 * 2));
+}
+
+TEST(Hierarchical, Errors) {
+    auto mat = spawn_matrix(10, 6, /* seed = */ 4545, /* density = */ 0.3);
+    auto labels = spawn_labels(6, 3, /* seed = */ 5454);
+
+    auto check_error = [&](const std::vector<std::optional<std::size_t> >& parents, const std::string& msg) -> void {
+        try {
+            singler_classic_markers::choose_hierarchical(*mat, labels.data(), parents, {});
+            FAIL() << "expected an error";
+        } catch (std::exception& e) {
+            EXPECT_TRUE(std::string(e.what()).find(msg) != std::string::npos);
+        }
+    };
+
+    check_error({ std::nullopt, std::nullopt }, "node for each label");
+    check_error({ 3, 3, 10, std::nullopt }, "less than the number of nodes");
+    check_error({ 3, 3, 4, 4, 3 }, "cycles");
+    check_error({ 0, 1, 2 }, "labels should not have any children");
+    check_error({ 3, 0, 3, std::nullopt }, "labels should not have any children");
+}
@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <cmath>
+
+#include "singler_classic_markers/median.hpp"
+#include "quickstats/quickstats.hpp"
+
+class CountingMedianTest : public ::testing::TestWithParam<int> {
+protected:
+    template<typename Value_>
+    static std::vector<Value_> simulate(int n, int lower, int upper, int seed) {
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<int> dist(lower, upper);
+        std::vector<Value_> output(n);
+        for (auto& x : output) {
+            x = dist(rng);
+        }
+        return output;
+    }
+};
+
+TEST_P(CountingMedianTest, Dense) {
+    int n = GetParam();
+    std::vector<int> histogram;
+
+    // Checking a mix of small ranges (using the histogram) and large ranges (using the fallback).
+    for (int upper : { 0, 3, 10, 1000 }) {
+        for (int lower : { 0, -5 }) {
+            auto vals = simulate<int>(n, lower, upper, n * 100 + upper + lower);
+            auto copy = vals;
+            double expected = quickstats::median<double>(n, copy.data());
+            copy = vals;
+            double observed = singler_classic_markers::compute_median<double>(n, copy.data(), histogram);
+            EXPECT_EQ(expected, observed);
+            for (auto h : histogram) {
+                EXPECT_EQ(h, 0);
+            }
+        }
+    }
+}
+
+TEST_P(CountingMedianTest, Sparse) {
+    int n = GetParam();
+    std::vector<int> histogram;
+
+    for (int nnz : { n / 3, n / 2, n }) {
+        for (int lower : { 1, -3 }) {
+            auto vals = simulate<int>(nnz, lower, 5, n * 10 + nnz + lower);
+            for (auto& v : vals) {
+                v += (v == 0); // all values should be non-zero.
+            }
+            auto copy = vals;
+            double expected = quickstats::median<double>(n, nnz, copy.data());
+            copy = vals;
+            double observed = singler_classic_markers::compute_median<double>(n, nnz, copy.data(), histogram);
+            EXPECT_EQ(expected, observed);
+            for (auto h : histogram) {
+                EXPECT_EQ(h, 0);
+            }
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    CountingMedian,
+    CountingMedianTest,
+    ::testing::Values(1, 2, 11, 50, 101) // number of observations.
+);
+
+TEST(CountingMedian, SmallTypes) {
+    std::vector<int> histogram;
+
+    // Checking that offsets wrap around correctly after integer promotion.
+    std::vector<std::int8_t> svals { -100, 100, 50, -50, 0 };
+    auto scopy = svals;
+    EXPECT_EQ(singler_classic_markers::compute_median<double>(5, scopy.data(), histogram), 0);
+
+    std::vector<std::int8_t> dvals(300);
+    for (std::size_t i = 0; i < dvals.size(); ++i) {
+        dvals[i] = static_cast<int>(i % 256) - 128;
+    }
+    auto dcopy = dvals;
+    double expected = quickstats::median<double>(static_cast<int>(dvals.size()), dcopy.data());
+    dcopy = dvals;
+    EXPECT_EQ(singler_classic_markers::compute_median<double>(static_cast<int>(dvals.size()), dcopy.data(), histogram), expected);
+
+    std::vector<std::uint16_t> uvals { 65535, 65534, 65535, 65533 };
+    auto ucopy = uvals;
+    EXPECT_EQ(singler_classic_markers::compute_median<double>(4, ucopy.data(), histogram), 65534.5);
+
+    std::vector<int> empty;
+    EXPECT_TRUE(std::isnan(singler_classic_markers::compute_median<double>(0, empty.data(), histogram)));
+}
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cstddef>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/multiple.hpp"
+
+#include "tatami/tatami.hpp"
+
+class MultipleTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(MultipleTest, Choose) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1928 * requested, /* density = */ 0.3);
+    auto labels1 = spawn_labels(nsamples, 3, /* seed = */ 3746 * requested);
+    auto labels2 = spawn_labels(nsamples, 7, /* seed = */ 5564 * requested);
+    std::vector<const int*> labels{ labels1.data(), labels2.data() };
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto ref1 = singler_classic_markers::choose(*mat, labels1.data(), opt);
+    auto ref2 = singler_classic_markers::choose(*mat, labels2.data(), opt);
+
+    auto multi = singler_classic_markers::choose_multiple(*mat, labels, opt);
+    ASSERT_EQ(multi.size(), 2);
+    EXPECT_EQ(multi[0], ref1);
+    EXPECT_EQ(multi[1], ref2);
+
+    auto imulti = singler_classic_markers::choose_index_multiple(*mat, labels, opt);
+    ASSERT_EQ(imulti.size(), 2);
+    EXPECT_EQ(imulti[0], strip_to_indices(ref1));
+    EXPECT_EQ(imulti[1], strip_to_indices(ref2));
+
+    // Same results for other matrix representations.
+    auto rmat = tatami::convert_to_dense<double, int>(*mat, true, {});
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    auto csmat = tatami::convert_to_compressed_sparse<double, int>(*mat, false, {});
+    EXPECT_EQ(singler_classic_markers::choose_multiple(*rmat, labels, opt), multi);
+    EXPECT_EQ(singler_classic_markers::choose_multiple(*smat, labels, opt), multi);
+    EXPECT_EQ(singler_classic_markers::choose_multiple(*csmat, labels, opt), multi);
+
+    // Same results when parallelized.
+    opt.num_threads = 3;
+    EXPECT_EQ(singler_classic_markers::choose_multiple(*mat, labels, opt), multi);
+    EXPECT_EQ(singler_classic_markers::choose_multiple(*smat, labels, opt), multi);
+}
+
+TEST_P(MultipleTest, Blocked) {
+    size_t ngenes = 500;
+    size_t nsamples = 80;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 7531 * requested, /* density = */ 0.3);
+    auto labels1 = spawn_labels(nsamples, 4, /* seed = */ 8642 * requested);
+    auto labels2 = spawn_labels(nsamples, 6, /* seed = */ 9753 * requested);
+    auto blocks = spawn_labels(nsamples, 3, /* seed = */ 1357 * requested);
+    std::vector<const int*> labels{ labels1.data(), labels2.data() };
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions opt;
+        opt.number = requested;
+        opt.use_minimum = use_minimum;
+        auto ref1 = singler_classic_markers::choose_blocked(*mat, labels1.data(), blocks.data(), opt);
+        auto ref2 = singler_classic_markers::choose_blocked(*mat, labels2.data(), blocks.data(), opt);
+
+        auto multi = singler_classic_markers::choose_blocked_multiple(*mat, labels, blocks.data(), opt);
+        ASSERT_EQ(multi.size(), 2);
+        EXPECT_EQ(multi[0], ref1);
+        EXPECT_EQ(multi[1], ref2);
+
+        auto imulti = singler_classic_markers::choose_blocked_index_multiple(*smat, labels, blocks.data(), opt);
+        ASSERT_EQ(imulti.size(), 2);
+        EXPECT_EQ(imulti[0], strip_to_indices(ref1));
+        EXPECT_EQ(imulti[1], strip_to_indices(ref2));
+
+        opt.num_threads = 3;
+        EXPECT_EQ(singler_classic_markers::choose_blocked_multiple(*smat, labels, blocks.data(), opt), multi);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Multiple,
+    MultipleTest,
+    ::testing::Values(1, 10, 1000) // number of top genes.
+);
+
+TEST(Multiple, Empty) {
+    auto mat = spawn_matrix(100, 20, /* seed = */ 42, /* density = */ 0.5);
+    std::vector<const int*> labels;
+    EXPECT_TRUE(singler_classic_markers::choose_multiple(*mat, labels, {}).empty());
+}
@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/one_vs_rest.hpp"
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+class OneVsRestTest : public ::testing::TestWithParam<int> {
+protected:
+    static std::vector<std::vector<std::pair<int, double> > > reference(const tatami::Matrix<double, int>& matrix, const int* label, std::size_t num_keep) {
+        auto medians = tatami_stats::grouped_medians::by_row(matrix, label, {});
+        const std::size_t nlabels = medians.size();
+        const int NR = matrix.nrow();
+        std::vector<std::vector<std::pair<int, double> > > output(nlabels);
+
+        for (std::size_t l = 0; l < nlabels; ++l) {
+            auto& current = output[l];
+            for (int r = 0; r < NR; ++r) {
+                if (std::isnan(medians[l][r])) {
+                    continue;
+                }
+                std::vector<double> others;
+                for (std::size_t l2 = 0; l2 < nlabels; ++l2) {
+                    if (l2 != l && !std::isnan(medians[l2][r])) {
+                        others.push_back(medians[l2][r]);
+                    }
+                }
+                if (others.empty()) {
+                    continue;
+                }
+                const double diff = medians[l][r] - simple_median(std::move(others));
+                if (diff > 0) {
+                    current.emplace_back(r, diff);
+                }
+            }
+
+            std::sort(current.begin(), current.end(), [](const std::pair<int, double>& left, const std::pair<int, double>& right) -> bool {
+                if (left.second == right.second) {
+                    return left.first < right.first;
+                } else {
+                    return left.second > right.second;
+                }
+            });
+            if (current.size() > num_keep) {
+                current.resize(num_keep);
+            }
+        }
+
+        return output;
+    }
+};
+
+TEST_P(OneVsRestTest, Basic) {
+    size_t ngenes = 500;
+    size_t nsamples = 60;
+    int requested = GetParam();
+
+    // Using a variety of label numbers to check both odd and even numbers of remaining labels.
+    for (size_t nlabels = 2; nlabels <= 7; ++nlabels) {
+        auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1357 * requested + nlabels, /* density = */ 0.3);
+        auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2468 * requested + nlabels);
+
+        singler_classic_markers::ChooseOptions opt;
+        opt.number = requested;
+        auto output = singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt);
+        EXPECT_EQ(output, reference(*mat, labels.data(), requested));
+
+        auto ioutput = singler_classic_markers::choose_one_vs_rest_index(*mat, labels.data(), opt);
+        ASSERT_EQ(ioutput.size(), nlabels);
+        for (size_t l = 0; l < nlabels; ++l) {
+            ASSERT_EQ(ioutput[l].size(), output[l].size());
+            for (size_t i = 0; i < ioutput[l].size(); ++i) {
+                EXPECT_EQ(ioutput[l][i], output[l][i].first);
+            }
+        }
+
+        // Same results for other matrix representations.
+        auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+        auto csmat = tatami::convert_to_compressed_sparse<double, int>(*mat, false, {});
+        EXPECT_EQ(singler_classic_markers::choose_one_vs_rest(*smat, labels.data(), opt), output);
+        EXPECT_EQ(singler_classic_markers::choose_one_vs_rest(*csmat, labels.data(), opt), output);
+
+        // Same results when parallelized.
+        opt.num_threads = 3;
+        EXPECT_EQ(singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt), output);
+    }
+}
+
+TEST_P(OneVsRestTest, Ties) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    // Integer data has lots of tied medians, which checks that the choice of the removed label doesn't matter.
+    std::mt19937_64 rng(9753 * requested);
+    std::vector<double> contents(ngenes * nsamples);
+    for (auto& c : contents) {
+        c = rng() % 4;
+    }
+    tatami::DenseColumnMatrix<double, int> imat(ngenes, nsamples, std::move(contents));
+
+    for (size_t nlabels = 3; nlabels <= 6; ++nlabels) {
+        auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8642 * requested + nlabels);
+        singler_classic_markers::ChooseOptions opt;
+        opt.number = requested;
+        EXPECT_EQ(singler_classic_markers::choose_one_vs_rest(imat, labels.data(), opt), reference(imat, labels.data(), requested));
+    }
+}
+
+TEST_P(OneVsRestTest, Missing) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1122 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 3344 * requested);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    auto output = singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt);
+
+    // Empty labels are ignored when computing the median of the rest.
+    for (auto& l : labels) {
+        l *= 2;
+    }
+    auto output2 = singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt);
+    ASSERT_EQ(output2.size(), nlabels * 2 - 1);
+    for (size_t l = 0; l < output2.size(); ++l) {
+        if (l % 2 == 1) {
+            EXPECT_TRUE(output2[l].empty());
+        } else {
+            EXPECT_EQ(output2[l], output[l / 2]);
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    OneVsRest,
+    OneVsRestTest,
+    ::testing::Values(5, 10, 100) // number of top genes.
+);
+
+TEST(OneVsRest, Statistics) {
+    size_t ngenes = 200;
+    size_t nsamples = 40;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 5555, /* density = */ 0.3);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 6666);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = 10;
+    opt.num_threads = 2;
+    auto ref = singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt);
+
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    EXPECT_EQ(singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), opt), ref);
+
+    std::size_t nrows = 0, ntotal = 0;
+    for (const auto& t : stats.threads) {
+        nrows += t.num_rows;
+        ntotal += t.num_accepted + t.num_rejected + t.num_nan + t.num_pruned;
+    }
+    EXPECT_EQ(nrows, ngenes);
+    EXPECT_EQ(ntotal, ngenes * nlabels);
+}
+
+TEST(OneVsRest, Degenerate) {
+    size_t ngenes = 100;
+    size_t nsamples = 20;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 7777, /* density = */ 0.3);
+
+    // No comparisons are possible with only one label.
+    std::vector<int> labels(nsamples);
+    auto output = singler_classic_markers::choose_one_vs_rest(*mat, labels.data(), {});
+    ASSERT_EQ(output.size(), 1);
+    EXPECT_TRUE(output[0].empty());
+
+    auto empty = singler_classic_markers::choose_one_vs_rest(tatami::DenseColumnMatrix<double, int>(10, 0, std::vector<double>()), static_cast<int*>(NULL), {});
+    EXPECT_TRUE(empty.empty());
+}
+
+TEST(OneVsRest, Expand) {
+    std::vector<std::vector<int> > markers{ { 1, 2 }, {}, { 3 } };
+    auto expanded = singler_classic_markers::expand_one_vs_rest(markers);
+    ASSERT_EQ(expanded.size(), 3);
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(expanded[i].size(), 3);
+        for (size_t j = 0; j < 3; ++j) {
+            if (i == j) {
+                EXPECT_TRUE(expanded[i][j].empty());
+            } else {
+                EXPECT_EQ(expanded[i][j], markers[i]);
+            }
+        }
+    }
+}
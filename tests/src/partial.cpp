@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cstddef>
+#include <cmath>
+#include <random>
+#include <tuple>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/partial.hpp"
+
+#include "tatami/tatami.hpp"
+
+template<typename Index_, typename Stat_>
+singler_classic_markers::PartialMarkers<Index_, Stat_> roundtrip(const singler_classic_markers::PartialMarkers<Index_, Stat_>& partial) {
+    auto blob = singler_classic_markers::serialize_partial_markers(partial);
+    return singler_classic_markers::deserialize_partial_markers<Index_, Stat_>(blob.data(), blob.size());
+}
+
+class PartialTest : public ::testing::TestWithParam<std::tuple<int, bool> > {};
+
+TEST_P(PartialTest, Choose) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    auto param = GetParam();
+    int requested = std::get<0>(param);
+
+    // Quantizing the values so that there are plenty of ties.
+    std::mt19937_64 rng(requested * 69);
+    std::normal_distribution<> ndist;
+    std::vector<double> contents(ngenes * nsamples);
+    for (auto& x : contents) {
+        x = std::round(ndist(rng) * 2);
+    }
+    tatami::DenseRowMatrix<double, int> qmat(ngenes, nsamples, std::move(contents));
+
+    auto labels = spawn_labels(nsamples, 5, /* seed = */ 9696 * requested);
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = requested;
+    opt.keep_ties = std::get<1>(param);
+    auto ref = singler_classic_markers::choose(qmat, labels.data(), opt);
+
+    auto part1 = singler_classic_markers::choose_partial(qmat, labels.data(), 0, 123, opt);
+    auto part2 = singler_classic_markers::choose_partial(qmat, labels.data(), 123, 200, opt);
+    auto part3 = singler_classic_markers::choose_partial(qmat, labels.data(), 323, 177, opt);
+
+    auto left = singler_classic_markers::merge_partial_markers(singler_classic_markers::merge_partial_markers(part1, part2), part3);
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers(left), ref);
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers_index(left), strip_to_indices(ref));
+
+    // Order of the merges doesn't matter.
+    auto right = singler_classic_markers::merge_partial_markers(part3, singler_classic_markers::merge_partial_markers(part2, part1));
+    EXPECT_EQ(right.markers.offsets, left.markers.offsets);
+    EXPECT_EQ(right.markers.indices, left.markers.indices);
+    EXPECT_EQ(right.markers.stats, left.markers.stats);
+
+    // Same result after serialization.
+    auto sleft = singler_classic_markers::merge_partial_markers(roundtrip(part1), roundtrip(singler_classic_markers::merge_partial_markers(roundtrip(part2), roundtrip(part3))));
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers(sleft), ref);
+
+    // Same result with multiple threads.
+    opt.num_threads = 3;
+    auto ppart1 = singler_classic_markers::choose_partial(qmat, labels.data(), 0, 250, opt);
+    auto ppart2 = singler_classic_markers::choose_partial(qmat, labels.data(), 250, 250, opt);
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers(singler_classic_markers::merge_partial_markers(ppart1, ppart2)), ref);
+
+    // A single range covering all rows is the same as the full result.
+    auto full = singler_classic_markers::choose_partial(qmat, labels.data(), 0, static_cast<int>(ngenes), opt);
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers(full), ref);
+}
+
+TEST_P(PartialTest, Blocked) {
+    size_t ngenes = 400;
+    size_t nsamples = 60;
+    auto param = GetParam();
+    int requested = std::get<0>(param);
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 4242 * requested, /* density = */ 0.3);
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    auto labels = spawn_labels(nsamples, 4, /* seed = */ 2424 * requested);
+    auto blocks = spawn_labels(nsamples, 3, /* seed = */ 4422 * requested);
+
+    singler_classic_markers::ChooseBlockedOptions opt;
+    opt.number = requested;
+    opt.keep_ties = std::get<1>(param);
+    auto ref = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), opt);
+
+    auto part1 = singler_classic_markers::choose_blocked_partial(*smat, labels.data(), blocks.data(), 0, 150, opt);
+    auto part2 = singler_classic_markers::choose_blocked_partial(*mat, labels.data(), blocks.data(), 150, 250, opt);
+    EXPECT_EQ(singler_classic_markers::finalize_partial_markers(singler_classic_markers::merge_partial_markers(roundtrip(part2), roundtrip(part1))), ref);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Partial,
+    PartialTest,
+    ::testing::Combine(
+        ::testing::Values(1, 10, 1000), // number of top genes.
+        ::testing::Values(false, true) // whether to keep ties.
+    )
+);
+
+TEST(Partial, Errors) {
+    auto mat = spawn_matrix(100, 20, /* seed = */ 77, /* density = */ 0.5);
+    auto labels = spawn_labels(20, 3, /* seed = */ 88);
+    singler_classic_markers::ChooseOptions opt;
+    opt.number = 5;
+
+    EXPECT_ANY_THROW(singler_classic_markers::choose_partial(*mat, labels.data(), 50, 51, opt));
+    EXPECT_ANY_THROW(singler_classic_markers::choose_partial(*mat, labels.data(), 101, 0, opt));
+    auto empty = singler_classic_markers::choose_partial(*mat, labels.data(), 100, 0, opt);
+    EXPECT_TRUE(empty.markers.indices.empty());
+
+    // Merging with an empty partial result has no effect.
+    auto part = singler_classic_markers::choose_partial(*mat, labels.data(), 0, 100, opt);
+    auto merged = singler_classic_markers::merge_partial_markers(empty, part);
+    EXPECT_EQ(merged.markers.indices, part.markers.indices);
+    EXPECT_EQ(merged.markers.stats, part.markers.stats);
+
+    // Incompatible options are not allowed.
+    auto opt2 = opt;
+    opt2.number = 10;
+    auto part2 = singler_classic_markers::choose_partial(*mat, labels.data(), 0, 100, opt2);
+    EXPECT_ANY_THROW(singler_classic_markers::merge_partial_markers(part, part2));
+
+    // Invalid blobs are not allowed.
+    auto blob = singler_classic_markers::serialize_partial_markers(part);
+    EXPECT_ANY_THROW((singler_classic_markers::deserialize_partial_markers<int, double>(blob.data(), blob.size() - 1)));
+    EXPECT_ANY_THROW((singler_classic_markers::deserialize_partial_markers<int, float>(blob.data(), blob.size())));
+    EXPECT_ANY_THROW((singler_classic_markers::deserialize_partial_markers<int, double>(blob.data(), 10)));
+    blob[0] = 0;
+    EXPECT_ANY_THROW((singler_classic_markers::deserialize_partial_markers<int, double>(blob.data(), blob.size())));
+}
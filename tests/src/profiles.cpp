@@ -0,0 +1,171 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cmath>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/profiles.hpp"
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+class ProfilesTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(ProfilesTest, Basic) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1234 * requested, /* density = */ 0.3);
+    size_t nlabels = 5;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 6789 * requested);
+
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    auto profiles = singler_classic_markers::compute_median_profiles(*mat, labels.data(), popt);
+    EXPECT_EQ(profiles.num_rows, ngenes);
+    EXPECT_EQ(profiles.num_labels, nlabels);
+    EXPECT_EQ(profiles.num_blocks, 1);
+
+    auto ref = tatami_stats::grouped_medians::by_row(*mat, labels.data(), {});
+    for (size_t r = 0; r < ngenes; ++r) {
+        for (size_t l = 0; l < nlabels; ++l) {
+            EXPECT_EQ(profiles.medians[r * nlabels + l], ref[l][r]);
+        }
+    }
+
+    // Same results with multiple threads.
+    popt.num_threads = 3;
+    auto profilesp = singler_classic_markers::compute_median_profiles(*mat, labels.data(), popt);
+    EXPECT_EQ(profiles.medians, profilesp.medians);
+
+    // Same results as choose().
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto expected = singler_classic_markers::choose(*mat, labels.data(), mopt);
+    EXPECT_EQ(singler_classic_markers::choose_from_profiles(profiles, mopt), expected);
+    EXPECT_EQ(singler_classic_markers::choose_index_from_profiles(profiles, mopt), strip_to_indices(expected));
+
+    mopt.num_threads = 3;
+    EXPECT_EQ(singler_classic_markers::choose_from_profiles(profiles, mopt), expected);
+
+    // Re-choosing with different settings.
+    mopt.number = requested * 2;
+    mopt.keep_ties = true;
+    EXPECT_EQ(singler_classic_markers::choose_from_profiles(profiles, mopt), singler_classic_markers::choose(*mat, labels.data(), mopt));
+}
+
+TEST_P(ProfilesTest, Blocked) {
+    size_t ngenes = 500;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 4321 * requested, /* density = */ 0.8);
+    size_t nlabels = 5, nblocks = 3;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 9876 * requested);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 1111 * requested);
+
+    auto profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), {});
+    EXPECT_EQ(profiles.num_rows, ngenes);
+    EXPECT_EQ(profiles.num_labels, nlabels);
+    EXPECT_EQ(profiles.num_blocks, nblocks);
+    EXPECT_EQ(profiles.medians.size(), ngenes * nlabels * nblocks);
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto expected = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+        EXPECT_EQ(singler_classic_markers::choose_blocked_from_profiles(profiles, bopt), expected);
+        EXPECT_EQ(singler_classic_markers::choose_blocked_index_from_profiles(profiles, bopt), strip_to_indices(expected));
+    }
+
+    EXPECT_ANY_THROW(singler_classic_markers::choose_from_profiles(profiles, {}));
+
+    std::vector<int> combo_sizes(nlabels * nblocks);
+    for (size_t c = 0; c < nsamples; ++c) {
+        ++combo_sizes[labels[c] * nblocks + blocks[c]];
+    }
+    EXPECT_EQ(profiles.combo_sizes, combo_sizes);
+}
+
+TEST_P(ProfilesTest, BlockedPartlyShared) {
+    size_t ngenes = 500;
+    size_t nsamples = 150;
+    int requested = GetParam();
+
+    // No rounding is performed, so the results will only be identical to choose_blocked() if the per-block differences are summed in the same order.
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 5678 * requested, /* density = */ 0.8);
+    size_t nlabels = 4, nblocks = 8;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 8765 * requested);
+    auto blocks = spawn_partly_shared_blocks(labels, nblocks, /* span = */ 5, /* offset = */ 0, /* seed = */ 2222 * requested);
+
+    auto profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), {});
+    auto unsized = profiles;
+    unsized.combo_sizes.clear();
+
+    for (bool use_minimum : { false, true }) {
+        singler_classic_markers::ChooseBlockedOptions bopt;
+        bopt.number = requested;
+        bopt.use_minimum = use_minimum;
+        auto expected = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt);
+        EXPECT_EQ(singler_classic_markers::choose_blocked_from_profiles(profiles, bopt), expected);
+
+        // Same results if the combination sizes need to be inferred from the medians.
+        EXPECT_EQ(singler_classic_markers::choose_blocked_from_profiles(unsized, bopt), expected);
+    }
+
+    // Complaints if the combination sizes are inconsistent.
+    profiles.combo_sizes.pop_back();
+    EXPECT_ANY_THROW(singler_classic_markers::choose_blocked_from_profiles(profiles, {}));
+}
+
+TEST_P(ProfilesTest, Float) {
+    size_t ngenes = 200;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1000 * requested, /* density = */ 0.5);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 2000 * requested);
+
+    auto profiles = singler_classic_markers::compute_median_profiles<float>(*mat, labels.data(), {});
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    EXPECT_EQ(singler_classic_markers::choose_from_profiles<float>(profiles, mopt), singler_classic_markers::choose<float>(*mat, labels.data(), mopt));
+}
+
+TEST_P(ProfilesTest, LowerPrecision) {
+    size_t ngenes = 200;
+    size_t nsamples = 50;
+    int requested = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 3000 * requested, /* density = */ 0.5);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 4000 * requested);
+
+    auto fprofiles = singler_classic_markers::compute_median_profiles<float>(*mat, labels.data(), {});
+    singler_classic_markers::ChooseOptions mopt;
+    mopt.number = requested;
+    auto fres = singler_classic_markers::choose_from_profiles<double>(fprofiles, mopt);
+
+    // The differences are computed in double precision from the single-precision medians.
+    for (size_t l1 = 0; l1 < nlabels; ++l1) {
+        for (size_t l2 = 0; l2 < nlabels; ++l2) {
+            for (const auto& x : fres[l1][l2]) {
+                const auto offset = static_cast<size_t>(x.first) * nlabels;
+                EXPECT_EQ(x.second, static_cast<double>(fprofiles.medians[offset + l1]) - static_cast<double>(fprofiles.medians[offset + l2]));
+            }
+        }
+    }
+
+    // So the results are not the same as choose(), which uses the double-precision medians.
+    EXPECT_NE(fres, singler_classic_markers::choose<double>(*mat, labels.data(), mopt));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Profiles,
+    ProfilesTest,
+    ::testing::Values(1, 20, 50, 1000) // number of top genes.
+);
@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/choose.hpp"
+#include "singler_classic_markers/blocked.hpp"
+#include "singler_classic_markers/profiles.hpp"
+#include "singler_classic_markers/progress.hpp"
+
+#include "tatami/tatami.hpp"
+
+class ProgressTest : public ::testing::TestWithParam<std::tuple<bool, int, bool> > {};
+
+TEST_P(ProgressTest, Report) {
+    auto param = GetParam();
+    size_t ngenes = 1000;
+    size_t nsamples = 40;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 1212, /* density = */ 0.3);
+    if (std::get<0>(param)) {
+        mat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    }
+    auto labels = spawn_labels(nsamples, 4, /* seed = */ 2121);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.num_threads = std::get<1>(param);
+    opt.dynamic_scheduling = std::get<2>(param);
+    opt.dynamic_chunk_size = 100;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+
+    std::mutex lock;
+    std::vector<std::pair<std::size_t, std::size_t> > reports;
+    opt.progress = [&](std::size_t done, std::size_t total) -> void {
+        std::lock_guard<std::mutex> lck(lock);
+        reports.emplace_back(done, total);
+    };
+    opt.check_interval = 50;
+    EXPECT_EQ(singler_classic_markers::choose(*mat, labels.data(), opt), ref);
+
+    ASSERT_FALSE(reports.empty());
+    EXPECT_LE(reports.size(), ngenes / opt.check_interval + 1);
+    EXPECT_EQ(reports.back(), std::make_pair(ngenes, ngenes));
+    for (const auto& r : reports) {
+        EXPECT_LE(r.first, ngenes);
+        EXPECT_EQ(r.second, ngenes);
+    }
+}
+
+TEST_P(ProgressTest, Cancel) {
+    auto param = GetParam();
+    size_t ngenes = 1000;
+    size_t nsamples = 40;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 3434, /* density = */ 0.3);
+    if (std::get<0>(param)) {
+        mat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    }
+    auto labels = spawn_labels(nsamples, 4, /* seed = */ 4343);
+    auto blocks = spawn_labels(nsamples, 2, /* seed = */ 3443);
+
+    std::atomic<bool> cancel(true);
+    singler_classic_markers::ChooseOptions opt;
+    opt.num_threads = std::get<1>(param);
+    opt.dynamic_scheduling = std::get<2>(param);
+    opt.cancel = &cancel;
+    EXPECT_THROW(singler_classic_markers::choose(*mat, labels.data(), opt), singler_classic_markers::CancelledError);
+
+    singler_classic_markers::ChooseBlockedOptions bopt;
+    bopt.num_threads = std::get<1>(param);
+    bopt.cancel = &cancel;
+    EXPECT_THROW(singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), bopt), singler_classic_markers::CancelledError);
+
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    popt.num_threads = std::get<1>(param);
+    popt.cancel = &cancel;
+    EXPECT_THROW(singler_classic_markers::compute_median_profiles(*mat, labels.data(), popt), singler_classic_markers::CancelledError);
+
+    // Cancelling partway through the scan.
+    cancel = false;
+    std::size_t last = 0;
+    opt.check_interval = 10;
+    opt.progress = [&](std::size_t done, std::size_t) -> void {
+        last = done;
+        cancel = true;
+    };
+    EXPECT_THROW(singler_classic_markers::choose(*mat, labels.data(), opt), singler_classic_markers::CancelledError);
+    EXPECT_LT(last, ngenes);
+
+    // Works as usual if the flag is not set.
+    cancel = false;
+    opt.progress = nullptr;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), singler_classic_markers::ChooseOptions());
+    EXPECT_EQ(singler_classic_markers::choose(*mat, labels.data(), opt), ref);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Progress,
+    ProgressTest,
+    ::testing::Combine(
+        ::testing::Values(false, true), // whether to use a sparse matrix.
+        ::testing::Values(1, 3), // number of threads.
+        ::testing::Values(false, true) // whether to use dynamic scheduling.
+    )
+);
+
+TEST(Progress, Pipeline) {
+    size_t ngenes = 500;
+    size_t nsamples = 30;
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 5656, /* density = */ 0.3);
+    auto rmat = tatami::convert_to_dense<double, int>(*mat, true, {});
+    auto labels = spawn_labels(nsamples, 3, /* seed = */ 6565);
+
+    // Cancellation stops the extraction thread as well.
+    std::atomic<bool> cancel(false);
+    singler_classic_markers::ChooseOptions opt;
+    opt.pipeline = true;
+    opt.pipeline_batch_size = 20;
+    opt.check_interval = 20;
+    opt.cancel = &cancel;
+    opt.progress = [&](std::size_t, std::size_t) -> void {
+        cancel = true;
+    };
+    EXPECT_THROW(singler_classic_markers::choose(*rmat, labels.data(), opt), singler_classic_markers::CancelledError);
+}
@@ -0,0 +1,169 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include "singler_classic_markers/queue.hpp"
+
+class TopBufferTest : public ::testing::TestWithParam<int> {
+protected:
+    static std::vector<std::pair<double, int> > reference(const std::vector<double>& values, int num_keep, bool keep_ties) {
+        std::vector<std::pair<double, int> > collected;
+        for (int i = 0, end = values.size(); i < end; ++i) {
+            if (values[i] > 0) {
+                collected.emplace_back(values[i], i);
+            }
+        }
+        std::sort(collected.begin(), collected.end(), singler_classic_markers::TopBuffer<double, int>::is_better);
+
+        if (collected.size() > static_cast<std::size_t>(num_keep)) {
+            if (keep_ties && num_keep > 0) {
+                const double last = collected[num_keep - 1].first;
+                std::size_t counter = num_keep;
+                while (counter < collected.size() && collected[counter].first == last) {
+                    ++counter;
+                }
+                collected.resize(counter);
+            } else {
+                collected.resize(num_keep);
+            }
+        }
+        return collected;
+    }
+};
+
+TEST_P(TopBufferTest, Basic) {
+    int num_keep = GetParam();
+    std::mt19937_64 rng(num_keep * 13);
+    std::normal_distribution<> ndist;
+
+    // Rounding to get some ties.
+    std::vector<double> values(1000);
+    for (auto& v : values) {
+        v = std::round(ndist(rng) * 10) / 10;
+    }
+
+    for (bool keep_ties : { false, true }) {
+        singler_classic_markers::TopBuffer<double, int> buffer(num_keep, keep_ties);
+        for (int i = 0, end = values.size(); i < end; ++i) {
+            buffer.emplace(values[i], i);
+        }
+        EXPECT_EQ(buffer.finalize(), reference(values, num_keep, keep_ties));
+    }
+}
+
+TEST_P(TopBufferTest, Merge) {
+    int num_keep = GetParam();
+    std::mt19937_64 rng(num_keep * 17);
+    std::normal_distribution<> ndist;
+
+    std::vector<double> values(1000);
+    for (auto& v : values) {
+        v = std::round(ndist(rng) * 10) / 10;
+    }
+
+    for (bool keep_ties : { false, true }) {
+        singler_classic_markers::TopBuffer<double, int> first(num_keep, keep_ties), second(num_keep, keep_ties);
+        for (int i = 0, end = values.size(); i < end; ++i) {
+            if (i % 3 == 0) {
+                second.emplace(values[i], i);
+            } else {
+                first.emplace(values[i], i);
+            }
+        }
+        first.merge(second);
+        EXPECT_EQ(first.finalize(), reference(values, num_keep, keep_ties));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    TopBuffer,
+    TopBufferTest,
+    ::testing::Values(0, 1, 10, 50, 2000) // number of top genes.
+);
+
+TEST(TopBuffer, Missing) {
+    singler_classic_markers::TopBuffer<double, int> buffer(10, false);
+    buffer.emplace(std::numeric_limits<double>::quiet_NaN(), 0);
+    buffer.emplace(0, 1);
+    buffer.emplace(-1, 2);
+    buffer.emplace(1, 3);
+    std::vector<std::pair<double, int> > expected{ { 1, 3 } };
+    EXPECT_EQ(buffer.finalize(), expected);
+}
+
+TEST(TopBuffer, ManyTies) {
+    singler_classic_markers::TopBuffer<double, int> buffer(5, true);
+    const auto original = buffer.capacity();
+
+    // All candidates are tied at the threshold, so all of them must be retained after each compaction.
+    std::vector<std::pair<double, int> > expected;
+    for (int i = 0; i < 1000; ++i) {
+        buffer.emplace(1, i);
+        expected.emplace_back(1, i);
+    }
+    for (int i = 1000; i < 1100; ++i) {
+        buffer.emplace(0.5, i);
+    }
+
+    // Capacity is increased to accommodate the retained ties plus another chunk.
+    EXPECT_GT(buffer.capacity(), original);
+    EXPECT_GE(buffer.capacity(), expected.size());
+    EXPECT_EQ(buffer.finalize(), expected);
+
+    // Capacity is restored once the ties are broken by larger values.
+    singler_classic_markers::TopBuffer<double, int> other(1, true);
+    const auto other_original = other.capacity();
+    for (int i = 0; i < 100; ++i) {
+        other.emplace(1, i);
+    }
+    EXPECT_GT(other.capacity(), other_original);
+    for (int i = 100; i < 200; ++i) {
+        other.emplace(i, i);
+    }
+    other.compact();
+    EXPECT_EQ(other.capacity(), other_original);
+    std::vector<std::pair<double, int> > other_expected{ { 199, 199 } };
+    EXPECT_EQ(other.finalize(), other_expected);
+}
+
+TEST(TopBufferSet, Bound) {
+    singler_classic_markers::TopBufferSet<double, int> set(2, 3, false);
+    EXPECT_EQ(set.min_threshold(), std::numeric_limits<double>::denorm_min());
+    set.exclude_from_bound(2);
+
+    // Thresholds are only raised upon compaction, i.e., once each buffer has been filled.
+    auto cptr = set.candidates();
+    int counter = 0;
+    while (set.buffer(0).threshold() == 0) {
+        cptr[0] = counter + 1;
+        cptr[1] = (counter + 1) * 0.5;
+        cptr[2] = std::numeric_limits<double>::quiet_NaN();
+        set.add_candidates(counter);
+        ++counter;
+    }
+    EXPECT_EQ(set.buffer(0).threshold(), counter - 1);
+    EXPECT_EQ(set.buffer(1).threshold(), (counter - 1) * 0.5);
+    EXPECT_EQ(set.min_threshold(), (counter - 1) * 0.5); // ignores the excluded buffer, which is never filled.
+
+    // Bound is updated when the lowest threshold increases.
+    for (int i = 0; i < counter; ++i) {
+        cptr[0] = 0;
+        cptr[1] = counter * 10;
+        set.add_candidates(counter + i);
+    }
+    EXPECT_EQ(set.buffer(1).threshold(), counter * 10);
+    EXPECT_EQ(set.min_threshold(), counter - 1);
+
+    // Skipped candidates are counted as pruned, apart from the NaNs.
+    set.enable_counting();
+    set.skip_candidates(1);
+    singler_classic_markers::ThreadStatistics stats;
+    set.transfer_counts(stats);
+    EXPECT_EQ(stats.num_nan, 1);
+    EXPECT_EQ(stats.num_pruned, 2);
+    EXPECT_EQ(stats.num_rejected, 0);
+    EXPECT_EQ(stats.num_accepted, 0);
+}
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include "singler_classic_markers/sketch.hpp"
+#include "quickstats/quickstats.hpp"
+
+class QuantileSketchTest : public ::testing::TestWithParam<std::tuple<int, int> > {
+protected:
+    static std::vector<double> simulate(int n, int seed) {
+        std::mt19937_64 rng(seed);
+        std::normal_distribution<> dist;
+        std::vector<double> output(n);
+        for (auto& x : output) {
+            x = dist(rng);
+        }
+        return output;
+    }
+};
+
+TEST_P(QuantileSketchTest, Bounds) {
+    auto param = GetParam();
+    int n = std::get<0>(param);
+    int capacity = std::get<1>(param);
+
+    auto vals = simulate(n, n * 10 + capacity);
+    singler_classic_markers::QuantileSketch<double> sketch(capacity);
+    for (auto v : vals) {
+        sketch.add(v);
+    }
+    double observed = sketch.median<double>();
+
+    auto copy = vals;
+    double expected = quickstats::median<double>(n, copy.data());
+    if (n <= capacity) {
+        EXPECT_EQ(observed, expected);
+    }
+
+    // Checking that the rank of the reported median lies within the error bound.
+    // For even 'n', the reported median is the average of two values that each satisfy the bound.
+    std::sort(vals.begin(), vals.end());
+    double ratio = static_cast<double>(n) / capacity;
+    double bound = (n <= capacity ? 0 : ratio * (1 + std::log2(ratio)));
+    double lower = std::lower_bound(vals.begin(), vals.end(), observed) - vals.begin();
+    double upper = std::upper_bound(vals.begin(), vals.end(), observed) - vals.begin();
+    double half = n / 2;
+    EXPECT_LE(lower, half + bound + 1);
+    EXPECT_GE(upper, half - bound - 1);
+
+    // Reusing the sketch after clearing gives the same result.
+    sketch.clear();
+    for (auto v : copy) {
+        sketch.add(v);
+    }
+    sketch.clear();
+    auto vals2 = simulate(n, n * 10 + capacity);
+    for (auto v : vals2) {
+        sketch.add(v);
+    }
+    EXPECT_EQ(sketch.median<double>(), observed);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    QuantileSketch,
+    QuantileSketchTest,
+    ::testing::Combine(
+        ::testing::Values(1, 10, 101, 1000, 10001), // number of observations.
+        ::testing::Values(2, 16, 100) // sketch capacity.
+    )
+);
+
+TEST(QuantileSketch, Repeated) {
+    singler_classic_markers::QuantileSketch<double> sketch(16);
+    EXPECT_TRUE(std::isnan(sketch.median<double>()));
+
+    // Repeated zeros are inserted in the same manner as individual values.
+    sketch.add(1);
+    sketch.add(2);
+    sketch.add_repeated(0, 5);
+    EXPECT_EQ(sketch.median<double>(), 0);
+
+    sketch.clear();
+    sketch.add_repeated(0, 2);
+    for (int i = 0; i < 3; ++i) {
+        sketch.add(-1);
+    }
+    sketch.add(1);
+    EXPECT_EQ(sketch.median<double>(), -0.5);
+
+    // NaNs are ignored.
+    sketch.clear();
+    sketch.add(std::numeric_limits<double>::quiet_NaN());
+    sketch.add(3);
+    EXPECT_EQ(sketch.median<double>(), 3);
+}
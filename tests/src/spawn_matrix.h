@@ -31,4 +31,16 @@ inline std::vector<int> spawn_labels(size_t nc, size_t nlabels, int seed) {
     return labels;
 }
 
+// Each label only occurs in 'span' consecutive blocks, starting from a block that is offset from its own label index.
+// With enough blocks, adjacent labels share blocks that straddle the summation lanes in summarize_block_differences(),
+// so any difference in the order of summation of per-block differences will change the results.
+inline std::vector<int> spawn_partly_shared_blocks(const std::vector<int>& labels, size_t nblocks, size_t span, size_t offset, int seed) {
+    const auto shifts = spawn_labels(labels.size(), span, seed);
+    std::vector<int> blocks(labels.size());
+    for (size_t c = 0, end = labels.size(); c < end; ++c) {
+        blocks[c] = (labels[c] + shifts[c] + offset) % nblocks;
+    }
+    return blocks;
+}
+
 #endif
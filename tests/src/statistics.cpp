@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "utils.h"
+#include "spawn_matrix.h"
+
+#include "singler_classic_markers/choose.hpp"
+#include "singler_classic_markers/blocked.hpp"
+#include "singler_classic_markers/profiles.hpp"
+#include "singler_classic_markers/add_label.hpp"
+#include "singler_classic_markers/statistics.hpp"
+
+#include "tatami/tatami.hpp"
+
+class StatisticsTest : public ::testing::TestWithParam<int> {
+protected:
+    static void check_statistics(const singler_classic_markers::ChooseStatistics& stats, std::size_t ngenes, std::size_t ncandidates) {
+        std::size_t nrows = 0, ntotal = 0;
+        for (const auto& t : stats.threads) {
+            EXPECT_GE(t.extraction_time, 0);
+            EXPECT_GE(t.median_time, 0);
+            EXPECT_GE(t.queue_time, 0);
+            nrows += t.num_rows;
+            ntotal += t.num_accepted + t.num_rejected + t.num_nan + t.num_pruned;
+        }
+        EXPECT_EQ(nrows, ngenes);
+        EXPECT_EQ(ntotal, ngenes * ncandidates);
+        EXPECT_GE(stats.merge_time, 0);
+    }
+};
+
+TEST_P(StatisticsTest, Choose) {
+    size_t ngenes = 200;
+    size_t nsamples = 50;
+    int nthreads = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 100 + nthreads, /* density = */ 0.3);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 200 + nthreads);
+
+    singler_classic_markers::ChooseOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = singler_classic_markers::choose(*mat, labels.data(), opt);
+
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    auto output = singler_classic_markers::choose(*mat, labels.data(), opt);
+    EXPECT_EQ(output, ref);
+    EXPECT_EQ(stats.threads.size(), static_cast<std::size_t>(nthreads));
+    check_statistics(stats, ngenes, nlabels * nlabels);
+
+    std::size_t naccepted = 0, nnan = 0;
+    for (const auto& t : stats.threads) {
+        naccepted += t.num_accepted;
+        nnan += t.num_nan;
+    }
+    EXPECT_GT(naccepted, 0);
+    EXPECT_EQ(nnan, 0);
+
+    // Same results with the other engines.
+    auto smat = tatami::convert_to_compressed_sparse<double, int>(*mat, true, {});
+    opt.pipeline = true;
+    EXPECT_EQ(singler_classic_markers::choose(*smat, labels.data(), opt), ref);
+    check_statistics(stats, ngenes, nlabels * nlabels);
+    double pipelined_median_time = 0;
+    for (const auto& t : stats.threads) {
+        pipelined_median_time += t.median_time;
+    }
+    EXPECT_GT(pipelined_median_time, 0); // measured directly around the median calculations.
+
+    opt.approximate = true;
+    singler_classic_markers::choose(*mat, labels.data(), opt);
+    check_statistics(stats, ngenes, nlabels * nlabels);
+
+    opt.approximate = false;
+    opt.dynamic_scheduling = true;
+    opt.dynamic_chunk_size = 7;
+    EXPECT_EQ(singler_classic_markers::choose(*mat, labels.data(), opt), ref);
+    check_statistics(stats, ngenes, nlabels * nlabels);
+    opt.dynamic_scheduling = false;
+
+    // Missing labels lead to NaN differences.
+    for (auto& l : labels) {
+        ++l;
+    }
+    opt.approximate = false;
+    singler_classic_markers::choose(*mat, labels.data(), opt);
+    check_statistics(stats, ngenes, (nlabels + 1) * (nlabels + 1));
+    nnan = 0;
+    for (const auto& t : stats.threads) {
+        nnan += t.num_nan;
+    }
+    EXPECT_EQ(nnan, ngenes * (2 * nlabels + 1));
+}
+
+TEST_P(StatisticsTest, Blocked) {
+    size_t ngenes = 200;
+    size_t nsamples = 60;
+    int nthreads = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 300 + nthreads, /* density = */ 0.3);
+    size_t nlabels = 3, nblocks = 2;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 400 + nthreads);
+    auto blocks = spawn_labels(nsamples, nblocks, /* seed = */ 500 + nthreads);
+
+    singler_classic_markers::ChooseBlockedOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), opt);
+
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    EXPECT_EQ(singler_classic_markers::choose_blocked(*mat, labels.data(), blocks.data(), opt), ref);
+    check_statistics(stats, ngenes, nlabels * nlabels);
+
+    // Each ordered pair is evaluated once for the mean and once for the minimum of the per-block differences.
+    auto both_ref = singler_classic_markers::choose_blocked_both(*mat, labels.data(), blocks.data(), opt);
+    check_statistics(stats, ngenes, nlabels * nlabels * 2);
+    EXPECT_EQ(both_ref.mean, ref);
+
+    // Also works with the profiles.
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    popt.num_threads = nthreads;
+    popt.statistics = &stats;
+    auto profiles = singler_classic_markers::compute_blocked_median_profiles(*mat, labels.data(), blocks.data(), popt);
+    check_statistics(stats, ngenes, 0);
+    EXPECT_EQ(stats.merge_time, 0);
+
+    EXPECT_EQ(singler_classic_markers::choose_blocked_from_profiles(profiles, opt), ref);
+    check_statistics(stats, ngenes, nlabels * nlabels);
+    for (const auto& t : stats.threads) {
+        EXPECT_EQ(t.extraction_time, 0); // no extraction or median calculation for precomputed profiles.
+        EXPECT_EQ(t.median_time, 0);
+    }
+}
+
+TEST_P(StatisticsTest, AddLabel) {
+    size_t ngenes = 200;
+    size_t nsamples = 50;
+    int nthreads = GetParam();
+
+    auto mat = spawn_matrix(ngenes, nsamples, /* seed = */ 600 + nthreads, /* density = */ 0.3);
+    size_t nlabels = 4;
+    auto labels = spawn_labels(nsamples, nlabels, /* seed = */ 700 + nthreads);
+    auto newmat = spawn_matrix(ngenes, 10, /* seed = */ 800 + nthreads, /* density = */ 0.3);
+
+    singler_classic_markers::ComputeMedianProfilesOptions popt;
+    auto profiles = singler_classic_markers::compute_median_profiles(*mat, labels.data(), popt);
+    singler_classic_markers::ChooseOptions opt;
+    opt.num_threads = nthreads;
+    auto existing = singler_classic_markers::choose_from_profiles(profiles, opt);
+
+    auto profiles2 = profiles;
+    auto ref = singler_classic_markers::add_label(existing, profiles2, *newmat, opt);
+
+    singler_classic_markers::ChooseStatistics stats;
+    opt.statistics = &stats;
+    EXPECT_EQ(singler_classic_markers::add_label(existing, profiles, *newmat, opt), ref);
+    check_statistics(stats, ngenes, nlabels * 2);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Statistics,
+    StatisticsTest,
+    ::testing::Values(1, 3) // number of threads.
+);
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <vector>
+#include <algorithm>
 
 template<typename Index_, typename Stat_>
 std::vector<std::vector<std::vector<Index_> > > strip_to_indices(const std::vector<std::vector<std::vector<std::pair<Index_, Stat_> > > >& input) {
@@ -29,4 +30,14 @@ std::vector<std::vector<std::vector<Index_> > > strip_to_indices(const std::vect
     return output;
 }
 
+inline double simple_median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    const auto n = values.size();
+    if (n % 2 == 1) {
+        return values[n / 2];
+    } else {
+        return (values[n / 2 - 1] + values[n / 2]) / 2;
+    }
+}
+
 #endif